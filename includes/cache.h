@@ -0,0 +1,168 @@
+/*******************************************************************************************
+* FILE: cache.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: In memory cache of the static files served by the server and cache of opened
+* 							descriptors for the files too big to be kept in memory.
+*******************************************************************************************/
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_init(long size, long max_file)
+* DESCRITPTION: Initializes the shards of the file cache. Must be called before the threads
+* 							are created.
+* ARGS_IN: long size - maximum number of bytes of file contents kept in memory, 0 disables
+* 										 the cache
+* 				 long max_file - files bigger than this are never cached
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_init(long size, long max_file);
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_lookup(char * path)
+* DESCRITPTION: Looks for a file in the cache. Entries invalidated by the inotify thread are
+* 							ignored. If inotify is not available, once per second the file is checked
+* 							with stat and the entry is dropped if its modification time, size or
+* 							inode changed.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with file_cache_release, or
+* 					NULL if the file is not cached
+*******************************************************************************************/
+FileCacheEntry * file_cache_lookup(char * path);
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_insert(char * path, int fd, char * content_type,
+* 					char * extra_headers, char * server_signature)
+* DESCRITPTION: Reads an opened file into a new cache entry, building its headers, and stores
+* 							it in the cache, evicting other entries of the shard if needed.
+* ARGS_IN: char * path - path of the file
+* 				 int fd - descriptor of the opened file, not closed by the function
+* 				 char * content_type - value of the Content-Type header
+* 				 char * extra_headers - more headers of the replies of the file, each one ended by
+* 																"\r\n", f.e. Content-Encoding for precompressed files
+* 				 char * server_signature - value of the Server header
+* ARGS_OUT: the entry, with a reference that must be released with file_cache_release, or
+* 					NULL if the file cannot be cached (too big, cache disabled or error)
+*******************************************************************************************/
+FileCacheEntry * file_cache_insert(char * path, int fd, char * content_type, char * extra_headers, char * server_signature);
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_compressed(FileCacheEntry * entry, int coding,
+* 					char * content_type, char * extra_headers, char * server_signature)
+* DESCRITPTION: Gives the version of a cached file compressed with a coding. It is compressed
+* 							the first time it is asked for and kept with the entry, counted in the
+* 							memory of its shard, so each file is compressed once while it stays in the
+* 							cache. Its ETag is the one of the file with the coding added, so that it
+* 							is never taken for the version without compression.
+* ARGS_IN: FileCacheEntry * entry - entry of the file, referenced by the caller
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* 				 char * content_type - value of the Content-Type header
+* 				 char * extra_headers - more headers of the replies, Content-Encoding included
+* 				 char * server_signature - value of the Server header
+* ARGS_OUT: the compressed version, with a reference that must be released with
+* 					file_cache_release, or NULL in case of error
+*******************************************************************************************/
+FileCacheEntry * file_cache_compressed(FileCacheEntry * entry, int coding, char * content_type, char * extra_headers, char * server_signature);
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_retain(FileCacheEntry * entry)
+* DESCRITPTION: Takes one more reference to an entry already referenced by the caller.
+* ARGS_IN: FileCacheEntry * entry - entry to retain
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_retain(FileCacheEntry * entry);
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_release(FileCacheEntry * entry)
+* DESCRITPTION: Releases a reference to an entry, freeing it if it was the last one.
+* ARGS_IN: FileCacheEntry * entry - entry to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_release(FileCacheEntry * entry);
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_stats(long * hits, long * misses, long * bytes)
+* DESCRITPTION: Adds up the counters of every shard of the cache.
+* ARGS_IN: long * hits - where the number of hits is written
+* 				 long * misses - where the number of misses is written
+* 				 long * bytes - where the number of cached bytes is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_stats(long * hits, long * misses, long * bytes);
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_init(long entries, long ttl)
+* DESCRITPTION: Initializes the shards of the descriptor cache. Must be called before the
+* 							threads are created.
+* ARGS_IN: long entries - maximum number of entries (opened files and not found paths), 0
+* 												disables the cache
+* 				 long ttl - seconds an entry is trusted without opening the file again
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_init(long entries, long ttl);
+
+/*******************************************************************************************
+* FUNCTION: FdCacheEntry * fd_cache_lookup(char * path)
+* DESCRITPTION: Looks for a path in the descriptor cache. Expired entries and entries
+* 							invalidated by the inotify thread are dropped.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with fd_cache_release, or NULL
+* 					if the path is not cached. The fd of the entry is -1 if the file does not exist.
+*******************************************************************************************/
+FdCacheEntry * fd_cache_lookup(char * path);
+
+/*******************************************************************************************
+* FUNCTION: FdCacheEntry * fd_cache_open(char * path)
+* DESCRITPTION: Opens a file and stores the descriptor and the result of fstat in the cache.
+* 							If the file cannot be opened or is not a regular file a negative entry is
+* 							stored instead, so the next requests of the path do not try again. With
+* 							the cache disabled the entry is only owned by the caller.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with fd_cache_release, or NULL
+* 					in case of error. The fd of the entry is -1 if the file does not exist.
+*******************************************************************************************/
+FdCacheEntry * fd_cache_open(char * path);
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_retain(FdCacheEntry * entry)
+* DESCRITPTION: Takes one more reference to an entry already referenced by the caller.
+* ARGS_IN: FdCacheEntry * entry - entry to retain
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_retain(FdCacheEntry * entry);
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_release(FdCacheEntry * entry)
+* DESCRITPTION: Releases a reference to an entry, closing the file and freeing the entry if
+* 							it was the last one.
+* ARGS_IN: FdCacheEntry * entry - entry to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_release(FdCacheEntry * entry);
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_stats(long * hits, long * misses, long * negative_hits)
+* DESCRITPTION: Adds up the counters of every shard of the descriptor cache.
+* ARGS_IN: long * hits - where the number of hits of opened files is written
+* 				 long * misses - where the number of misses is written
+* 				 long * negative_hits - where the number of hits of not found paths is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_stats(long * hits, long * misses, long * negative_hits);
+
+/*******************************************************************************************
+* FUNCTION: int cache_watch_init(char * server_root)
+* DESCRITPTION: Starts the inotify thread that invalidates the caches when the files under
+* 							server_root change. Without it the file cache checks the files with stat
+* 							and the descriptor cache relies on the ttl of its entries.
+* ARGS_IN: char * server_root - directory to watch
+* ARGS_OUT: -1 in case inotify cannot be used, 0 otherwise
+*******************************************************************************************/
+int cache_watch_init(char * server_root);
+
+#endif
@@ -0,0 +1,94 @@
+/*******************************************************************************************
+* FILE: compress.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Compression of the replies on the fly with zlib, for the clients that accept
+* 							gzip or deflate and the files that have no precompressed version.
+*******************************************************************************************/
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+
+/*******************************************************************************************
+* FUNCTION: void compress_init(long level, long min_size, char * types)
+* DESCRITPTION: Sets what is compressed on the fly. Must be called before the threads are
+* 							created.
+* ARGS_IN: long level - zlib level, from 1 (fastest) to 9 (smallest), 0 disables compression
+* 				 long min_size - files smaller than this are not compressed
+* 				 char * types - types compressed, separated by spaces or commas, f.e.
+* 												"text/html text/css text/javascript"
+* ARGS_OUT: None
+*******************************************************************************************/
+void compress_init(long level, long min_size, char * types);
+
+/*******************************************************************************************
+* FUNCTION: int compress_type(char * content_type, long size)
+* DESCRITPTION: Tells if the replies of a type are compressed on the fly: the type must be in
+* 							the list given to compress_init and the reply not smaller than the minimum
+* 							size. Types that are already compressed (images but svg, audio, video and
+* 							archives) are never compressed, even if the list includes them.
+* ARGS_IN: char * content_type - value of the Content-Type header
+* 				 long size - size of the reply, -1 if it is not known (output of a script)
+* ARGS_OUT: TRUE if the reply must be compressed when the client accepts it, FALSE otherwise
+*******************************************************************************************/
+int compress_type(char * content_type, long size);
+
+/*******************************************************************************************
+* FUNCTION: const char * compress_coding_name(int coding)
+* DESCRITPTION: Gives the value of the Content-Encoding header of a coding.
+* ARGS_IN: int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* ARGS_OUT: the name of the coding
+*******************************************************************************************/
+const char * compress_coding_name(int coding);
+
+/*******************************************************************************************
+* FUNCTION: long compress_buffer(int coding, const char * data, long len, char ** out)
+* DESCRITPTION: Compresses a whole buffer, f.e. a file of the file cache.
+* ARGS_IN: int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* 				 const char * data - bytes to compress
+* 				 long len - number of bytes
+* 				 char ** out - where the compressed bytes are returned, allocated with malloc
+* ARGS_OUT: the number of compressed bytes or -1 in case of error
+*******************************************************************************************/
+long compress_buffer(int coding, const char * data, long len, char ** out);
+
+/*******************************************************************************************
+* FUNCTION: int compressor_init(Compressor * c, int coding)
+* DESCRITPTION: Starts the compression of a reply sent in pieces, f.e. the output of a script.
+* ARGS_IN: Compressor * c - state of the compression
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int compressor_init(Compressor * c, int coding);
+
+/*******************************************************************************************
+* FUNCTION: int compressor_write(Compressor * c, const char * data, size_t len, int flush,
+* 					int (*write)(void * arg, const char * data, size_t len), void * arg)
+* DESCRITPTION: Compresses the next piece of a reply, giving the compressed bytes to the write
+* 							function as the output buffer fills. zlib keeps the bytes it has not
+* 							compressed yet unless flush is Z_SYNC_FLUSH, which gives everything
+* 							received till now, or Z_FINISH, which ends the reply.
+* ARGS_IN: Compressor * c - state of the compression
+* 				 const char * data - bytes of the reply
+* 				 size_t len - number of bytes
+* 				 int flush - Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+* 				 int (*write)(...) - function that sends the compressed bytes, returning -1 in
+* 														 case of error
+* 				 void * arg - first argument of the write function
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int compressor_write(Compressor * c, const char * data, size_t len, int flush,
+                     int (*write)(void * arg, const char * data, size_t len), void * arg);
+
+/*******************************************************************************************
+* FUNCTION: void compressor_end(Compressor * c)
+* DESCRITPTION: Frees the memory used by a compression started with compressor_init.
+* ARGS_IN: Compressor * c - state of the compression
+* ARGS_OUT: None
+*******************************************************************************************/
+void compressor_end(Compressor * c);
+
+#endif
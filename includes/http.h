@@ -13,15 +13,91 @@
 
 
 /*******************************************************************************************
-* FUNCTION: int process_http_request(int desc, char * server_root, char * server_signature)
-* DESCRITPTION: Receive a request from the descriptor, parse it and answer it depending on
-* 							if it is a POST, GET or OPTIONS request.
-* ARGS_IN: int desc - descriptor through where request will be read and the the reply will be sent
+* FUNCTION: int http_init(char * server_signature, long body_size)
+* DESCRITPTION: Builds once the constant part of the replies: status lines, error bodies and
+* 							the Server and Allow headers, so that each request only writes the version,
+* 							the date and the length. Must be called before the threads are created.
+* ARGS_IN: char * server_signature - string containing the server's signature, to be used as
+* 																	 the Server header
+* 				 long body_size - maximum size of the body of a request
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int http_init(char * server_signature, long body_size);
+
+/*******************************************************************************************
+* FUNCTION: void http_timeouts_init(long header, long body, long keepalive, long write)
+* DESCRITPTION: Sets the timeouts of the connections. Must be called before the threads are
+* 							created.
+* ARGS_IN: long header - seconds to receive the headers of a request, since the connection is
+* 												 accepted or the first byte of the request arrives
+* 				 long body - seconds that a streamed request body can go without a byte
+* 				 long keepalive - seconds a connection can wait for its next request
+* 				 long write - seconds a reply can go without a byte being sent
+* ARGS_OUT: None
+*******************************************************************************************/
+void http_timeouts_init(long header, long body, long keepalive, long write);
+
+/*******************************************************************************************
+* FUNCTION: void http_status_init(char * path)
+* DESCRITPTION: Sets the path where the metrics of the server are served. Must be called before
+* 							the threads are created.
+* ARGS_IN: char * path - path of the url, empty so that it is a normal file
+* ARGS_OUT: None
+*******************************************************************************************/
+void http_status_init(char * path);
+
+/*******************************************************************************************
+* FUNCTION: void connection_init(Connection * conn, int fd, int nonblocking,
+* 					TimerWheel * watchdog, Metrics * metrics)
+* DESCRITPTION: Initializes the state of a connection that has just been accepted. The time
+* 							to receive the first request starts now.
+* ARGS_IN: Connection * conn - connection to initialize
+* 				 int fd - socket descriptor of the connection
+* 				 int nonblocking - TRUE if the socket is in non blocking mode
+* 				 TimerWheel * watchdog - wheel where the timer of the connection is armed while it
+* 																 waits for the client, NULL if it is not watched. The
+* 																 owner of the wheel closes the connections that expire:
+* 																 in non blocking mode handle_connection arms the timer
+* 																 before returning, in blocking mode only while it reads
+* 				 Metrics * metrics - counters of the thread that serves the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_init(Connection * conn, int fd, int nonblocking, TimerWheel * watchdog, Metrics * metrics);
+
+/*******************************************************************************************
+* FUNCTION: void connection_watch(Connection * conn)
+* DESCRITPTION: Arms the timer of the connection with the deadline of its current state, or
+* 							disarms it if the timeout of the state is disabled.
+* ARGS_IN: Connection * conn - connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_watch(Connection * conn);
+
+/*******************************************************************************************
+* FUNCTION: void connection_release(Connection * conn)
+* DESCRITPTION: Closes the socket of the connection and frees everything it still holds.
+* 							The Connection structure itself is not freed.
+* ARGS_IN: Connection * conn - connection to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_release(Connection * conn);
+
+/*******************************************************************************************
+* FUNCTION: int handle_connection(Connection * conn, char * server_root,
+* 					char * server_signature)
+* DESCRITPTION: Runs the state machine of the connection: reads, parses and answers requests
+* 							until the socket would block or the connection ends. With blocking
+* 							sockets it only returns when the connection has ended.
+* 							A non blocking connection that is not offloaded stops before a request
+* 							with a script or a streamed body.
+* ARGS_IN: Connection * conn - connection to serve
 * 				 char * server_root - string containing the path where the server's files are stored
 * 				 char * server_signature - string containing the server's signature, to be
 * 																used as the Server header
-* ARGS_OUT: -1 in case connection has ended and 0 otherwise
+* ARGS_OUT: END_OF_CONNECTION in case the connection must be closed, CONN_OFFLOAD if its next
+* 					request must be answered by a blocking thread, 0 if it is waiting for the socket
+* 					to be readable or writable again
 *******************************************************************************************/
-int process_http_request(int desc, char * server_root, char * server_signature);
+int handle_connection(Connection * conn, char * server_root, char * server_signature);
 
 #endif
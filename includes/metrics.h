@@ -0,0 +1,84 @@
+/*******************************************************************************************
+* FILE: metrics.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Counters of the threads of the server, served by the server itself.
+*******************************************************************************************/
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+/* adds to a counter of a Metrics structure. Only the thread that owns it writes it, so a plain
+add is enough, and the store is atomic so that the readers never see half of it */
+#define METRIC_ADD(m, counter, n) __atomic_store_n(&(m)->counter, (m)->counter + (n), __ATOMIC_RELAXED)
+
+
+/*******************************************************************************************
+* FUNCTION: int metrics_init(long nthreads)
+* DESCRITPTION: Creates the counters of the threads, at zero. Must be called before the threads
+* 							are created.
+* ARGS_IN: long nthreads - number of places in the pool of threads
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int metrics_init(long nthreads);
+
+/*******************************************************************************************
+* FUNCTION: Metrics * metrics_thread(int thread_num)
+* DESCRITPTION: Gives the counters of a thread of the pool.
+* ARGS_IN: int thread_num - identifier of the thread
+* ARGS_OUT: the counters of the thread
+*******************************************************************************************/
+Metrics * metrics_thread(int thread_num);
+
+/*******************************************************************************************
+* FUNCTION: int metrics_method(const char * method, size_t len)
+* DESCRITPTION: Gives the position of a method in the requests counters.
+* ARGS_IN: const char * method - method of the request, not '\0' terminated
+* 				 size_t len - length of the method
+* ARGS_OUT: the position, the last one for the methods not counted apart
+*******************************************************************************************/
+int metrics_method(const char * method, size_t len);
+
+/*******************************************************************************************
+* FUNCTION: int metrics_status(int status)
+* DESCRITPTION: Gives the position of a status code in the responses counters.
+* ARGS_IN: int status - status code of a reply
+* ARGS_OUT: the position, the last one for the codes not counted apart
+*******************************************************************************************/
+int metrics_status(int status);
+
+/*******************************************************************************************
+* FUNCTION: long long metrics_clock()
+* DESCRITPTION: Gives the current time with the precision of the latency histograms.
+* ARGS_IN: None
+* ARGS_OUT: microseconds of a monotonic clock
+*******************************************************************************************/
+long long metrics_clock();
+
+/*******************************************************************************************
+* FUNCTION: void metrics_latency(Metrics * metrics, int route, int phase, long long us)
+* DESCRITPTION: Counts the time taken by a phase of a request in the histograms of a thread.
+* ARGS_IN: Metrics * metrics - counters of the thread that served the request
+* 				 int route - ROUTE_STATIC, ROUTE_SCRIPT, ROUTE_OPTIONS or ROUTE_ERROR
+* 				 int phase - one of the LATENCY_ phases
+* 				 long long us - microseconds taken by the phase
+* ARGS_OUT: None
+*******************************************************************************************/
+void metrics_latency(Metrics * metrics, int route, int phase, long long us);
+
+/*******************************************************************************************
+* FUNCTION: long metrics_format(char * buf, size_t size, int json)
+* DESCRITPTION: Writes the counters of every thread added up, and the percentiles of their
+* 							latency histograms merged, in the text format of Prometheus or in JSON.
+* 							The counters are read while the threads write them, without stopping
+* 							them, so the totals may be a few requests behind each other.
+* ARGS_IN: char * buf - where the text is written
+* 				 size_t size - size of buf
+* 				 int json - TRUE for JSON, FALSE for Prometheus
+* ARGS_OUT: the length of the text, -1 if it does not fit
+*******************************************************************************************/
+long metrics_format(char * buf, size_t size, int json);
+
+#endif
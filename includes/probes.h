@@ -0,0 +1,40 @@
+/*******************************************************************************************
+* FILE: probes.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Static tracepoints (USDT) of the server, provider "server", to be used by
+* 							bpftrace, perf or systemtap (see tools/bpftrace). With the sys/sdt.h of
+* 							systemtap each probe is a nop in the code plus a note in the binary telling
+* 							where its arguments are, so it costs nothing till a tracer attaches to it.
+* 							Without that header, or built with -DNO_PROBES, the probes are removed.
+*******************************************************************************************/
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+/* PROBEn(name, args...) fires the probe server:name with n arguments, which must be integers
+or pointers */
+#ifdef HAVE_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(server, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(server, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(server, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(server, name, a, b, c, d)
+#define PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(server, name, a, b, c, d, e, f)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#define PROBE6(name, a, b, c, d, e, f) do {} while (0)
+#endif
+
+#endif
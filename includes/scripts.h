@@ -0,0 +1,55 @@
+/*******************************************************************************************
+* FILE: scripts.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Execution of the python and php scripts requested to the server, either in
+* 							the pools of persistent interpreters or in a new interpreter for each one.
+*******************************************************************************************/
+
+#ifndef _SCRIPTS_H
+#define _SCRIPTS_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+
+/*******************************************************************************************
+* FUNCTION: void script_pool_init(int workers, long max_requests)
+* DESCRITPTION: Initializes the pools of persistent interpreters, one for python and one for
+* 							php. The interpreters are started the first time they are needed. Must be
+* 							called before the threads are created.
+* ARGS_IN: int workers - number of interpreters of each pool, 0 starts one for every script
+* 				 long max_requests - number of scripts run by an interpreter before it is replaced
+* 														 by a new one, 0 never replaces them
+* ARGS_OUT: None
+*******************************************************************************************/
+void script_pool_init(int workers, long max_requests);
+
+/*******************************************************************************************
+* FUNCTION: long script_run(int type, char * path, Slice body, Slice query, char ** env,
+* 					ScriptInput * input, ScriptOutput * output)
+* DESCRITPTION: Runs a script with the arguments of the request, the ones of the body and then
+* 							the ones of the url, splitted by spaces as the shell would do, sending its
+* 							output while it runs. The body is also given as the standard input of the
+* 							script as it is received, and the CGI variables as its environment. Waits
+* 							for a free interpreter of the pool if all are busy.
+* ARGS_IN: int type - PYTHON_SCRIPT or PHP_SCRIPT
+* 				 char * path - path of the script
+* 				 Slice body - body of the request if it fits in the input buffer
+* 				 Slice query - arguments in the url after the '?'
+* 				 char ** env - CGI variables of the request, "NAME=value" strings ended by NULL
+* 				 ScriptInput * input - from where the body of the request is read
+* 				 ScriptOutput * output - where the output of the script is sent
+* ARGS_OUT: number of bytes of the output or -1 in case of error
+*******************************************************************************************/
+long script_run(int type, char * path, Slice body, Slice query, char ** env, ScriptInput * input, ScriptOutput * output);
+
+/*******************************************************************************************
+* FUNCTION: void script_pool_stats(long * requests, long * started)
+* DESCRITPTION: Adds up the counters of both pools.
+* ARGS_IN: long * requests - where the number of scripts run by the interpreters is written
+* 				 long * started - where the number of interpreters started is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void script_pool_stats(long * requests, long * started);
+
+#endif
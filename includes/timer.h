@@ -0,0 +1,77 @@
+/*******************************************************************************************
+* FILE: timer.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Hierarchical timing wheels, used for the timeouts of the connections.
+*******************************************************************************************/
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+
+/*******************************************************************************************
+* FUNCTION: long long timer_now()
+* DESCRITPTION: Gives the current time of the monotonic clock with the precision of the
+* 							kernel tick, which is read without a system call.
+* ARGS_IN: None
+* ARGS_OUT: the time in milliseconds
+*******************************************************************************************/
+long long timer_now();
+
+/*******************************************************************************************
+* FUNCTION: void timer_wheel_init(TimerWheel * wheel, int locked)
+* DESCRITPTION: Initializes an empty timing wheel starting at the current time.
+* ARGS_IN: TimerWheel * wheel - wheel to initialize
+* 				 int locked - TRUE if several threads use the wheel, which is then protected by a
+* 											mutex, FALSE if only the thread that owns it does
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_wheel_init(TimerWheel * wheel, int locked);
+
+/*******************************************************************************************
+* FUNCTION: void timer_arm(TimerWheel * wheel, Timer * timer, long long deadline)
+* DESCRITPTION: Arms a timer to expire at a given time, or moves it if it was already armed.
+* 							Costs the same whatever the number of timers of the wheel.
+* ARGS_IN: TimerWheel * wheel - wheel where the timer is armed
+* 				 Timer * timer - timer to arm, its data field is not modified
+* 				 long long deadline - time of timer_now at which it expires, rounded up to the
+* 															next tick
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_arm(TimerWheel * wheel, Timer * timer, long long deadline);
+
+/*******************************************************************************************
+* FUNCTION: void timer_cancel(TimerWheel * wheel, Timer * timer)
+* DESCRITPTION: Disarms a timer, nothing is done if it is not armed.
+* ARGS_IN: TimerWheel * wheel - wheel where the timer was armed
+* 				 Timer * timer - timer to disarm
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_cancel(TimerWheel * wheel, Timer * timer);
+
+/*******************************************************************************************
+* FUNCTION: void timer_expire(TimerWheel * wheel, long long now, void (*expired)(Timer * timer))
+* DESCRITPTION: Moves the wheel to the current time, calling the function for each timer that
+* 							expires, already disarmed. In a locked wheel the function is called with
+* 							the mutex held, so it runs before a timer_cancel of the same timer returns.
+* ARGS_IN: TimerWheel * wheel - wheel to move
+* 				 long long now - current time of timer_now
+* 				 void (*expired)(Timer * timer) - function called for each expired timer
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_expire(TimerWheel * wheel, long long now, void (*expired)(Timer * timer));
+
+/*******************************************************************************************
+* FUNCTION: int timer_wheel_next(TimerWheel * wheel, long long now)
+* DESCRITPTION: Tells how long the owner of the wheel can sleep before calling timer_expire,
+* 							f.e. as the timeout of epoll_wait. It is the next tick with timers in the
+* 							lowest level, or the next time the upper levels are moved down to it.
+* ARGS_IN: TimerWheel * wheel - wheel of the owner
+* 				 long long now - current time of timer_now
+* ARGS_OUT: the number of milliseconds, -1 if there is no timer armed
+*******************************************************************************************/
+int timer_wheel_next(TimerWheel * wheel, long long now);
+
+#endif
@@ -7,10 +7,16 @@
 #ifndef _UTILS_H
 #define _UTILS_H
 
+/* needed for accept4 and other linux specific calls */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,10 +24,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <confuse.h>
+#include <zlib.h>
 
 #include "../srclib/picohttpparser.h"
 
@@ -31,6 +40,9 @@
 
 #define END_OF_CONNECTION -1
 #define ERROR -1
+#define REQUEST_INCOMPLETE -2
+#define CONN_WOULD_BLOCK -3
+#define CONN_OFFLOAD -4
 #define OK 0
 #define TRUE 1
 #define FALSE 0
@@ -41,15 +53,183 @@
 #define MEDIUM_STRING_SIZE 2047
 #define LARGE_STRING_SIZE 1024*8-1
 
+/* format of the dates of the http headers (Date, Last-Modified), always in GMT, and its length */
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+#define HTTP_DATE_SIZE 29
+/* size of the ETag of a file, quotes included: "inode-size-modification time in ns" in hex,
+followed by "-coding" in the versions compressed by the server */
+#define HTTP_ETAG_SIZE 64
+/* number of Date headers kept by the date cache, a slot is rewritten this number of seconds
+after it was formatted */
+#define DATE_CACHE_SLOTS 4
+
 #define FAM AF_INET
 #define SOCK SOCK_STREAM
 
+/* ways in which the worker threads can serve the connections */
+#define SERVER_MODE_THREADS 0
+#define SERVER_MODE_EPOLL 1
+
+/* maximum number of events returned by each epoll_wait in the reactor */
+#define MAX_EPOLL_EVENTS 256
+
+/* size of the buffer where the requests of a connection are received */
+#define CONNECTION_BUFFER_SIZE 4096
+/* size of the buffer inside each connection where the replies are written, only bigger
+replies need to allocate memory */
+#define CONNECTION_INLINE_OUT_SIZE 512
+/* maximum number of pieces (headers, bodies) of the replies queued in a connection, the
+replies of pipelined requests are sent together till it is reached */
+#define MAX_OUT_SEGMENTS 64
+/* maximum number of ranges of a Range header, requests with more get the whole file */
+#define MAX_RANGES 8
+/* maximum number of pieces of a single reply: the headers and the body, or in a multipart
+reply the headers of each part, its bytes and the closing boundary */
+#define MAX_SEGMENTS_PER_REPLY (2 * MAX_RANGES + 1)
+/* bytes at the start of a range of a file sent with sendfile that are read in advance */
+#define RANGE_READAHEAD (2 * 1024 * 1024)
+/* types of the pieces of a reply */
+#define OUT_SEGMENT_BUFFER 0
+#define OUT_SEGMENT_ENTRY 1
+#define OUT_SEGMENT_FILE 2
+#define OUT_SEGMENT_PIPE 3
+/* content codings of the replies compressed on the fly, in order of preference */
+#define COMPRESSION_GZIP 0
+#define COMPRESSION_DEFLATE 1
+#define COMPRESSION_CODINGS 2
+#define COMPRESSION_NONE -1
+/* size of the buffer where the compressed output of a script is written before being queued */
+#define COMPRESSION_BUFFER_SIZE 16384
+/* maximum number of types of compression_types */
+#define MAX_COMPRESSION_TYPES 32
+/* maximum number of headers of a request */
+#define MAX_REQUEST_HEADERS 100
+
+/* programs run by the persistent interpreters of the scripts, relative to the directory
+where the server is started */
+#define PYTHON_WORKER "workers/python_worker.py"
+#define PHP_WORKER "workers/php_worker.php"
+/* descriptor where the workers receive their end of the socket with the server */
+#define SCRIPT_WORKER_FD 3
+/* records of the protocol between the server and the workers, see workers/python_worker.py */
+#define SCRIPT_RECORD_VERSION 1
+#define SCRIPT_RECORD_HEADER_SIZE 8
+#define SCRIPT_RECORD_BEGIN 1
+#define SCRIPT_RECORD_ARG 2
+#define SCRIPT_RECORD_STDIN 3
+#define SCRIPT_RECORD_STDOUT 4
+#define SCRIPT_RECORD_END 5
+#define SCRIPT_RECORD_PARAM 6
+/* maximum number of CGI variables given to a script */
+#define SCRIPT_ENV_VARS 16
+
+/* number of shards of the file cache, each one with its own lock */
+#define FILE_CACHE_SHARDS 16
+/* number of hash buckets of each shard */
+#define FILE_CACHE_BUCKETS 256
+/* size of a cache line, used to keep data written by different threads apart */
+#define CACHE_LINE_SIZE 64
+/* maximum number of connections waiting in the queue of each worker in acceptor listener
+mode, the acceptor stops accepting while every queue is full */
+#define WORK_QUEUE_SIZE 256
+/* methods and status codes counted by the metrics, each list ends with the rest of them */
+#define METRIC_METHODS 5
+#define METRIC_STATUSES 10
+/* kinds of requests whose phases are timed by the metrics: files, scripts, OPTIONS and the
+ones answered with an error */
+#define METRIC_ROUTES 4
+#define ROUTE_STATIC 0
+#define ROUTE_SCRIPT 1
+#define ROUTE_OPTIONS 2
+#define ROUTE_ERROR 3
+/* phases of a request timed by the metrics: from the accept to the first byte of the first
+request, parsing, opening the file, running the script and sending what is left of the reply */
+#define LATENCY_PHASES 5
+#define LATENCY_FIRST_BYTE 0
+#define LATENCY_PARSE 1
+#define LATENCY_OPEN 2
+#define LATENCY_SCRIPT 3
+#define LATENCY_SEND 4
+/* buckets of the latency histograms: each power of two of microseconds is split in
+2^LATENCY_SUB_BITS buckets, so a value is known with an error below 1 / 2^LATENCY_SUB_BITS,
+up to 2^34 microseconds (more than 4 hours) */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_BUCKETS 256
+/* size of the buffer where the metrics are written when they are served */
+#define METRICS_BUFFER_SIZE 65536
+
+/* states of the per connection state machine */
+#define CONN_STATE_READ 0
+#define CONN_STATE_PARSE 1
+#define CONN_STATE_WRITE 2
+
+/* milliseconds of each tick of the timing wheels of the timeouts, and number of levels and
+of lists of each level (as a power of two), enough for timers of more than 3 weeks */
+#define TIMER_TICK_MS 100
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
 /* structure that stores all the information about the server configuration */
 typedef struct {
 		char* server_root;
 		char* server_signature;
+		/* listen backlog and number of threads of older configurations, used when the options below
+		are not set */
 		long max_clients;
+		/* maximum length of the queue of connections waiting to be accepted */
+		long listen_backlog;
+		/* threads of the pool: in threads mode with a shared listener or the acceptor there are
+		min_workers at first, and more up to max_workers while they are all busy, which leave after
+		worker_idle_timeout seconds without connections. Otherwise there are always max_workers */
+		long min_workers;
+		long max_workers;
+		long worker_idle_timeout;
+		/* threads of epoll mode that answer the requests with a script or a streamed body, which
+		would block the event loops */
+		long blocking_workers;
+		/* maximum number of connections open at the same time, the rest wait in the backlog */
+		long max_connections;
+		/* bytes of stack of each thread */
+		long thread_stack_size;
 		long listen_port;
+		/* "threads" (one blocking connection per thread) or "epoll" (event loop per thread) */
+		char* server_mode;
+		/* "shared" (one socket, accept under a mutex) or "reuseport" (one socket per thread) */
+		char* listener_mode;
+		/* boolean representing if there is one thread per CPU, pinned to it, whose reuseport socket
+		receives the connections of that CPU */
+		long cpu_affinity;
+		/* maximum number of bytes kept in the in memory file cache, 0 disables it */
+		long file_cache_size;
+		/* files bigger than this are never kept in the file cache */
+		long file_cache_max_file;
+		/* maximum number of open descriptors (and not found paths) kept by the descriptor cache,
+		0 disables it */
+		long fd_cache_entries;
+		/* seconds an entry of the descriptor cache is trusted without being opened again */
+		long fd_cache_ttl;
+		/* number of persistent interpreters of each type of script, 0 starts one for each script */
+		long script_workers;
+		/* scripts run by an interpreter before it is replaced, 0 for never */
+		long script_worker_max_requests;
+		/* maximum size of the body of a request, bigger ones are answered with 413 */
+		long max_body_size;
+		/* zlib level (1 to 9) of the replies compressed on the fly, 0 disables the compression */
+		long compression_level;
+		/* files smaller than this are never compressed on the fly */
+		long compression_min_size;
+		/* types compressed on the fly, separated by spaces or commas, a type ending
+		in '*' matches every type that starts like it */
+		char* compression_types;
+		/* seconds given to receive the headers of a request, the body of a request, the next
+		request of a keep-alive connection and to send each piece of a reply, 0 for no limit */
+		long header_timeout;
+		long body_timeout;
+		long keepalive_timeout;
+		long write_timeout;
+		/* path where the metrics of the server are served, empty to disable it */
+		char* status_path;
 } ServerConfiguration;
 
 /* structure that stores all the relevant information of a thread */
@@ -58,42 +238,298 @@ typedef struct {
 		pthread_t thread_tid;
 		/* identifier only valid inside the same process */
 		int thread_num;
-		/* number of connections to the thread */
-		long thread_count;
+		/* boolean representing if a thread is running in this place of the pool */
+		int running;
+		/* in epoll mode, connections given back by the blocking threads and eventfd through where
+		the thread is woken when there are any */
+		struct Connection * returned;
+		int return_fd;
 } Thread;
 
-/* structure that stores all the relevant information of an http header */
+/* structure that stores a file kept in memory by the file cache, together with everything
+needed to answer a GET of it without touching the file system */
+typedef struct FileCacheEntry {
+		/* path of the file, key of the cache */
+		char* path;
+		unsigned long hash;
+		/* contents of the file */
+		char* body;
+		long size;
+		/* modification time and size seen when the file was loaded, to detect changes */
+		time_t mtime;
+		ino_t inode;
+		/* last second in which the file was checked to be unchanged, and boolean representing if
+		its changes are seen by the inotify thread, otherwise it is checked with stat */
+		time_t checked;
+		int watched;
+		/* value of the cache generation when the entry was created, older generations are stale */
+		unsigned long generation;
+		/* Content-Type, Content-Length, Server, Accept-Ranges, ETag, Last-Modified and the extra
+		headers of the file ready to be sent, and the values of ETag and Last-Modified for the
+		rest of replies */
+		char* headers;
+		char etag[HTTP_ETAG_SIZE];
+		char last_modified[TINY_STRING_SIZE + 1];
+		int headers_len;
+		/* versions of the contents compressed on the fly with each coding, made the first time
+		they are asked for and freed together with the entry, NULL till then */
+		struct FileCacheEntry* compressed[COMPRESSION_CODINGS];
+		/* references held by the cache and by the connections sending the entry */
+		int refs;
+		/* boolean set on every hit, used by the clock eviction */
+		int referenced;
+		/* next entry in the same bucket */
+		struct FileCacheEntry* next;
+} FileCacheEntry;
+
+/* structure that stores an opened file, or the fact that a path does not exist (negative
+entry), kept by the descriptor cache for the files that are too big for the file cache */
+typedef struct FdCacheEntry {
+		/* path of the file, key of the cache */
+		char* path;
+		unsigned long hash;
+		/* descriptor of the opened file, -1 in negative entries */
+		int fd;
+		/* result of fstat and the ETag and Last-Modified headers built from it */
+		long size;
+		time_t mtime;
+		ino_t inode;
+		char etag[HTTP_ETAG_SIZE];
+		char last_modified[TINY_STRING_SIZE + 1];
+		/* second from which the entry is not trusted anymore */
+		time_t expires;
+		/* value of the cache generation when the entry was created, older generations are stale */
+		unsigned long generation;
+		/* references held by the cache and by the connections sending the file, the descriptor
+		is closed when the last one is released */
+		int refs;
+		/* boolean set on every hit, used by the clock eviction */
+		int referenced;
+		/* next entry in the same bucket */
+		struct FdCacheEntry* next;
+} FdCacheEntry;
+
+/* structure that stores a piece of a reply waiting to be sent: bytes written in the output
+buffer of the connection, the body of a cached file, a file sent with sendfile or bytes
+waiting in a pipe sent with splice */
 typedef struct {
-		/* name of the header (before the ':') */
-		char name[MEDIUM_STRING_SIZE];
-		/* value of the header (after the ':') */
-		char value[MEDIUM_STRING_SIZE];
-		int name_len;
-		int value_len;
-} Header;
-
-/* structure that stores all the relevant information of an http request */
+		/* OUT_SEGMENT_BUFFER, OUT_SEGMENT_ENTRY, OUT_SEGMENT_FILE or OUT_SEGMENT_PIPE */
+		int type;
+		/* position of the next byte to send, in the output buffer, in the body of the entry or
+		in the file, and number of bytes still to send from it */
+		off_t offset;
+		size_t left;
+		/* cached file or opened file whose reference is held till the piece is sent */
+		FileCacheEntry* entry;
+		FdCacheEntry* file;
+		/* read end of the pipe, owned by whoever queued it */
+		int pipe_fd;
+} OutSegment;
+
+/* structure that stores a timer of a timing wheel, linked in the list of the tick in which
+it expires */
+typedef struct Timer {
+		/* tick in which the timer expires */
+		long long expires;
+		/* next timer in the same list and pointer to where this one is pointed from, NULL if the
+		timer is not armed */
+		struct Timer* next;
+		struct Timer** pprev;
+		/* what the timer belongs to, f.e. its connection */
+		void* data;
+} Timer;
+
+/* structure that stores a hierarchical timing wheel, see timer.c */
+typedef struct {
+		Timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+		/* last tick processed */
+		long long tick;
+		/* number of timers armed */
+		long count;
+		/* boolean representing if the wheel is shared by several threads, protected by lock */
+		int locked;
+		pthread_mutex_t lock;
+} TimerWheel;
+
+/* structure that stores the counters of a thread, only written by that thread, without
+atomic instructions, and read by whoever serves the metrics. Aligned so that the counters of
+two threads never share a cache line */
+typedef struct {
+		/* requests by method and replies by status code, in the order of metrics.c */
+		long requests[METRIC_METHODS];
+		long responses[METRIC_STATUSES];
+		/* bytes received and sent through the sockets */
+		long bytes_in;
+		long bytes_out;
+		/* connections accepted, open and waiting for their next request */
+		long connections;
+		long active;
+		long idle;
+		/* files found or not in the file cache */
+		long cache_hits;
+		long cache_misses;
+		/* scripts run */
+		long scripts;
+		/* histograms of the microseconds taken by each phase of the requests of each route, and
+		their sums */
+		long latency[METRIC_ROUTES][LATENCY_PHASES][LATENCY_BUCKETS];
+		long latency_sum[METRIC_ROUTES][LATENCY_PHASES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) Metrics;
+
+/* structure that stores the state of a client connection: the bytes received and not yet
+parsed and the reply waiting to be sent, so that it can be served without blocking */
+typedef struct Connection {
+		/* socket descriptor of the connection */
+		int fd;
+		/* boolean representing if the socket is in non blocking mode */
+		int nonblocking;
+		/* current state: reading, parsing or writing */
+		int state;
+		/* bytes received and not yet consumed by the parser, always '\0' terminated. Bytes
+		after the request being answered (pipelined requests) are kept for the next one */
+		char in_buf[CONNECTION_BUFFER_SIZE + 1];
+		size_t in_len;
+		/* bytes at the start of in_buf taken by the request being answered */
+		size_t in_request_len;
+		/* bytes of the replies waiting to be sent, it points to out_inline unless they did not
+		fit there */
+		char* out_buf;
+		size_t out_len;
+		size_t out_cap;
+		char out_inline[CONNECTION_INLINE_OUT_SIZE];
+		/* pieces of the replies waiting to be sent, in order, and the first one not sent yet */
+		OutSegment out_segs[MAX_OUT_SEGMENTS];
+		int out_nsegs;
+		int out_seg;
+		/* boolean representing if the connection must be closed once the reply is sent */
+		int close_after_write;
+		/* boolean representing if the socket has been made blocking while a request body or the
+		output of a script are streamed */
+		int blocked;
+		/* boolean representing if the 100 Continue of the current request was sent */
+		int continue_sent;
+		/* timer that closes the connection when it times out, in the wheel of the thread that
+		serves it, NULL if it is not watched */
+		Timer timer;
+		TimerWheel* watchdog;
+		/* times (of timer_now) when the current request started to be received, when the
+		connection went idle after a reply and when a byte of the reply was sent for the last
+		time, and number of requests answered */
+		long long request_start;
+		long long idle_since;
+		long long last_progress;
+		long requests;
+		/* counters of the thread that serves the connection, and boolean representing if the
+		connection is counted as waiting for its next request */
+		Metrics * metrics;
+		int idle;
+		/* times (of metrics_clock) when the connection was accepted and when its replies started
+		to be sent, microseconds taken by each phase of the current request, -1 for the phases it
+		has not gone through, and route of the last request answered */
+		long long accepted;
+		long long send_start;
+		long long latency[LATENCY_PHASES];
+		int route;
+		/* status code of the last reply queued and bytes sent since the last batch of replies was
+		completely sent, given to the probes */
+		int status;
+		long sent;
+		/* boolean representing if a non blocking connection is served by a blocking thread, which
+		answers its requests with a script or a streamed body instead of handing them off */
+		int offloaded;
+		/* in epoll mode, thread whose event loop serves the connection, and next connection in
+		the queue of the blocking threads or in the list of the connections given back */
+		int owner;
+		struct Connection * next;
+} Connection;
+
+/* structure that stores a piece of the input buffer of a connection, it is not '\0'
+terminated, so it must be used with its length (f.e. with "%.*s") */
+typedef struct {
+		const char* ptr;
+		size_t len;
+} Slice;
+
+/* structure that stores all the relevant information of an http request. Nothing is copied,
+every field points into the input buffer of the connection, so the structure is only valid
+while the request is being processed */
 typedef struct {
 		/* method type, f.e. GET, POST... */
-		char method[TINY_STRING_SIZE];
-		/* path to the requested file or script */
-		char path[SMALL_STRING_SIZE];
+		Slice method;
+		/* path to the requested file or script, without the arguments after the '?' */
+		Slice path;
+		/* arguments in the url after the '?' */
+		Slice query;
+		/* body of the post when it fits in the input buffer, received together with the headers.
+		Empty if the body is streamed */
+		Slice body;
+		/* boolean representing if the body is read while the request is answered, because it is
+		chunked or too big for the input buffer */
+		int body_streamed;
 		/* integer representing the http version of the request */
 		int version;
-		/* array of headers */
-		Header* headers;
-		int num_headers;
-		/* length of the file to transmit */
+		/* array of headers, as filled by picohttpparser */
+		struct phr_header headers[MAX_REQUEST_HEADERS];
+		size_t num_headers;
+		/* length of the request line and the headers */
 		int length;
-		/* buffer which stores all the arguments to be passed to the script, either
+		/* boolean representing if the request has arguments to be passed to a script, either
 		in the body of the post or in the url after the '?' */
-		char args[MEDIUM_STRING_SIZE];
-		/* boolean representing if the request has arguments to be passed to a script */
 		int has_args;
-		/* boolean representing if the request contained a Connection: close header */
+		/* boolean representing if the connection must be closed after the reply, because of a
+		Connection: close header or an HTTP/1.0 request without Connection: keep-alive */
 		int connection_close;
+		/* value of the Content-Length header, -1 if there was none */
+		long content_length;
+		/* boolean representing if the body has Transfer-Encoding: chunked */
+		int chunked;
+		/* boolean representing if the client waits for a 100 Continue before sending the body */
+		int expect_continue;
+		/* values of the headers used by the server, empty if they were not received */
+		Slice host;
+		Slice if_modified_since;
+		Slice if_none_match;
+		Slice accept_encoding;
+		Slice range;
+		Slice if_range;
+		Slice content_type;
 } Request;
 
+/* structure through where a script reads the body of the request while it runs */
+typedef struct {
+		/* gives the next piece of the body, valid till the next call, len is 0 at the end of
+		the body. Returns -1 if the body cannot be read */
+		int (*read)(void * arg, const char ** data, size_t * len);
+		/* moves the next piece of the body from the socket to the pipe fd, without copying it
+		to userspace, when the body is received as it is. Returns FALSE if the piece must be
+		taken with read instead, CONN_WOULD_BLOCK if the pipe is full or closed, -1 if the body
+		cannot be read and TRUE otherwise, with len 0 at the end of the body */
+		int (*splice)(void * arg, int fd, size_t * len);
+		/* first argument of the functions */
+		void * arg;
+} ScriptInput;
+
+/* structure through where the output of a script is sent to the client while the script
+runs, the functions return -1 if the output cannot be sent */
+typedef struct {
+		/* queues len bytes of output that are in memory, they are sent on the next flush */
+		int (*write)(void * arg, const char * data, size_t len);
+		/* sends the output queued, called before waiting for more output */
+		int (*flush)(void * arg);
+		/* sends len bytes of output waiting in a pipe without copying them to userspace */
+		int (*splice)(void * arg, int fd, size_t len);
+		/* first argument of the functions */
+		void * arg;
+} ScriptOutput;
+
+/* structure that stores the state of a reply compressed while it is sent, f.e. the output
+of a script */
+typedef struct {
+		z_stream stream;
+		/* where the compressed bytes are written before being given to the write function */
+		unsigned char out[COMPRESSION_BUFFER_SIZE];
+} Compressor;
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
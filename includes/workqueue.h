@@ -0,0 +1,93 @@
+/*******************************************************************************************
+* FILE: workqueue.h
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Queues of the connections accepted by the acceptor thread, one per worker
+* 							thread, from where idle workers steal the connections of busy ones.
+*******************************************************************************************/
+
+#ifndef _WORKQUEUE_H
+#define _WORKQUEUE_H
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "utils.h"
+
+
+/*******************************************************************************************
+* FUNCTION: int work_queues_init(long nworkers)
+* DESCRITPTION: Creates the queues of the workers, empty and closed. Must be called before
+* 							the threads are created.
+* ARGS_IN: long nworkers - number of worker threads
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int work_queues_init(long nworkers);
+
+/*******************************************************************************************
+* FUNCTION: void work_dispatch(int fd)
+* DESCRITPTION: Gives an accepted connection to a worker: to an idle one if there is any, and
+* 							otherwise to the next one in turn, where it waits till that worker or an
+* 							idle one takes it. Waits while every open queue is full. Called by the
+* 							acceptor.
+* ARGS_IN: int fd - socket descriptor of the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_dispatch(int fd);
+
+/*******************************************************************************************
+* FUNCTION: void work_open(int worker)
+* DESCRITPTION: Opens the queue of a worker, which receives connections from then on. Called
+* 							before the worker starts.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_open(int worker);
+
+/*******************************************************************************************
+* FUNCTION: int work_close(int worker)
+* DESCRITPTION: Closes the queue of a worker that is leaving, if there is no connection left
+* 							in it.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: -1 if the queue still has connections, which the worker must serve, 0 otherwise
+*******************************************************************************************/
+int work_close(int worker);
+
+/*******************************************************************************************
+* FUNCTION: int work_take(int worker)
+* DESCRITPTION: Takes the oldest connection of the queue of a worker or, if it is empty, steals
+* 							the oldest one of the queue of another worker. Never waits.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: the socket descriptor of the connection, -1 if every queue is empty
+*******************************************************************************************/
+int work_take(int worker);
+
+/*******************************************************************************************
+* FUNCTION: int work_next(int worker, int timeout)
+* DESCRITPTION: Takes the next connection for a worker that serves one connection at a time,
+* 							sleeping till there is one or the timeout expires.
+* ARGS_IN: int worker - number of the worker
+* 				 int timeout - milliseconds to wait, -1 to wait forever
+* ARGS_OUT: the socket descriptor of the connection, -1 if the timeout expired
+*******************************************************************************************/
+int work_next(int worker, int timeout);
+
+/*******************************************************************************************
+* FUNCTION: void work_idle(int worker, int idle)
+* DESCRITPTION: Tells if a worker is going to wait for work, so that the acceptor wakes it when
+* 							a connection arrives. A worker that waits in its own way (f.e. epoll_wait
+* 							on the descriptor of work_wake_fd) must mark itself idle and then call
+* 							work_take till it is empty before waiting, so that no connection is missed.
+* ARGS_IN: int worker - number of the worker
+* 				 int idle - TRUE before waiting, FALSE once it has been woken
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_idle(int worker, int idle);
+
+/*******************************************************************************************
+* FUNCTION: int work_wake_fd(int worker)
+* DESCRITPTION: Gives the descriptor that becomes readable when a worker is woken, it must be
+* 							read once it is.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: an eventfd descriptor
+*******************************************************************************************/
+int work_wake_fd(int worker);
+
+#endif
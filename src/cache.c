@@ -0,0 +1,856 @@
+/*******************************************************************************************
+* FILE: cache.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: In memory cache of the static files served by the server. The cache is split
+* 							in FILE_CACHE_SHARDS shards, chosen by the hash of the path, each one with
+* 							its own read-write lock, so that concurrent hits only share the read side
+* 							of the lock of one shard. Entries are reference counted so that a
+* 							connection can keep sending an entry that has been evicted meanwhile.
+* 							The files too big to be kept in memory go to the descriptor cache,
+* 							which keeps them opened (or remembers that they do not exist). Both
+* 							caches are invalidated by a thread watching server_root with inotify.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/cache.h"
+#include "../includes/compress.h"
+#include <dirent.h>
+#include <sys/inotify.h>
+
+
+/* structure that stores one shard of the file cache, aligned so that two shards never share
+a cache line */
+typedef struct {
+		pthread_rwlock_t lock;
+		FileCacheEntry * buckets[FILE_CACHE_BUCKETS];
+		/* bytes of file contents stored in the shard */
+		long bytes;
+		/* next bucket to be inspected by the clock eviction */
+		int hand;
+		long hits;
+		long misses;
+} __attribute__((aligned(CACHE_LINE_SIZE))) FileCacheShard;
+
+/* structure that stores one shard of the descriptor cache */
+typedef struct {
+		pthread_rwlock_t lock;
+		FdCacheEntry * buckets[FILE_CACHE_BUCKETS];
+		/* number of entries stored in the shard */
+		long count;
+		/* next bucket to be inspected by the clock eviction */
+		int hand;
+		long hits;
+		long misses;
+		long negative_hits;
+} __attribute__((aligned(CACHE_LINE_SIZE))) FdCacheShard;
+
+/* GLOBAL VARIABLES */
+FileCacheShard file_cache_shards[FILE_CACHE_SHARDS];
+long file_cache_shard_size = 0; /* maximum bytes of each shard, 0 if the cache is disabled */
+long file_cache_max_file = 0; /* files bigger than this are not cached */
+
+FdCacheShard fd_cache_shards[FILE_CACHE_SHARDS];
+long fd_cache_shard_entries = 0; /* maximum entries of each shard, 0 if the cache is disabled */
+long fd_cache_ttl = 0; /* seconds an entry is trusted */
+
+/* entries created before the last generation change are stale, used to invalidate everything */
+unsigned long cache_generation = 0;
+/* boolean representing if the inotify thread is watching server_root */
+int cache_watching = FALSE;
+/* inotify descriptor and path of the directory of each watch descriptor, only changed by the
+inotify thread under watch_lock */
+int watch_fd = -1;
+char ** watch_dirs = NULL;
+int nwatch_dirs = 0;
+pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*******************************************************************************************
+* FUNCTION: unsigned long hash_path(char * path)
+* DESCRITPTION: FNV-1a hash of a path.
+* ARGS_IN: char * path - string to hash
+* ARGS_OUT: the hash of the string
+*******************************************************************************************/
+unsigned long hash_path(char * path) {
+		unsigned long h = 14695981039346656037UL;
+		for (; *path; path++) {
+				h ^= (unsigned char) *path;
+				h *= 1099511628211UL;
+		}
+		return h;
+}
+
+/*******************************************************************************************
+* FUNCTION: void format_etag(char * etag, struct stat * st)
+* DESCRITPTION: Writes the strong ETag of a file from its inode, size and modification time in
+* 							nanoseconds, so that any change of the file changes it without reading it.
+* ARGS_IN: char * etag - where the ETag is written, HTTP_ETAG_SIZE bytes
+* 				 struct stat * st - result of stat of the file
+* ARGS_OUT: None
+*******************************************************************************************/
+void format_etag(char * etag, struct stat * st) {
+		snprintf(etag, HTTP_ETAG_SIZE, "\"%lx-%lx-%lx\"", (unsigned long) st->st_ino, (unsigned long) st->st_size,
+		         (unsigned long) st->st_mtim.tv_sec * 1000000000UL + st->st_mtim.tv_nsec);
+}
+
+/*******************************************************************************************
+* FUNCTION: int cache_watched(char * path)
+* DESCRITPTION: Tells if the changes of a file are seen by the inotify thread: its directory is
+* 							watched, which excludes the directories reached through a symbolic link,
+* 							and it is not a symbolic link itself, whose target may change anywhere.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: TRUE if the file is watched, FALSE otherwise
+*******************************************************************************************/
+int cache_watched(char * path) {
+		char * slash = strrchr(path, '/');
+		struct stat st;
+		int watched = FALSE;
+
+		if (!cache_watching || slash == NULL || lstat(path, &st) < 0 || S_ISLNK(st.st_mode)) return FALSE;
+		pthread_mutex_lock(&watch_lock);
+		for (int i = 0; i < nwatch_dirs && !watched; i++) {
+				watched = watch_dirs[i] && strlen(watch_dirs[i]) == slash - path && strncmp(watch_dirs[i], path, slash - path) == 0;
+		}
+		pthread_mutex_unlock(&watch_lock);
+		return watched;
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_init(long size, long max_file)
+* DESCRITPTION: Initializes the shards of the file cache. Must be called before the threads
+* 							are created.
+* ARGS_IN: long size - maximum number of bytes of file contents kept in memory, 0 disables
+* 										 the cache
+* 				 long max_file - files bigger than this are never cached
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_init(long size, long max_file) {
+		file_cache_shard_size = size / FILE_CACHE_SHARDS;
+		file_cache_max_file = MIN(max_file, file_cache_shard_size);
+		for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+				pthread_rwlock_init(&file_cache_shards[i].lock, NULL);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_retain(FileCacheEntry * entry)
+* DESCRITPTION: Takes one more reference to an entry already referenced by the caller.
+* ARGS_IN: FileCacheEntry * entry - entry to retain
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_retain(FileCacheEntry * entry) {
+		__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_release(FileCacheEntry * entry)
+* DESCRITPTION: Releases a reference to an entry, freeing it if it was the last one.
+* ARGS_IN: FileCacheEntry * entry - entry to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_release(FileCacheEntry * entry) {
+		if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+				for (int i = 0; i < COMPRESSION_CODINGS; i++) {
+						if (entry->compressed[i]) file_cache_release(entry->compressed[i]);
+				}
+				free(entry->path);
+				free(entry->body);
+				free(entry->headers);
+				free(entry);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: long file_cache_entry_bytes(FileCacheEntry * entry)
+* DESCRITPTION: Gives the memory counted for an entry in its shard: the contents of the file
+* 							and of its compressed versions. The write lock of the shard must be held.
+* ARGS_IN: FileCacheEntry * entry - entry of the shard
+* ARGS_OUT: the number of bytes
+*******************************************************************************************/
+long file_cache_entry_bytes(FileCacheEntry * entry) {
+		long bytes = entry->size;
+		for (int i = 0; i < COMPRESSION_CODINGS; i++) {
+				if (entry->compressed[i]) bytes += entry->compressed[i]->size;
+		}
+		return bytes;
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_unlink(FileCacheShard * shard, FileCacheEntry * entry)
+* DESCRITPTION: Removes an entry from its shard, if it is still there, and releases the
+* 							reference held by the cache. The write lock of the shard must be held.
+* ARGS_IN: FileCacheShard * shard - shard of the entry
+* 				 FileCacheEntry * entry - entry to remove
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_unlink(FileCacheShard * shard, FileCacheEntry * entry) {
+		FileCacheEntry ** pp = &shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+
+		for (; *pp; pp = &(*pp)->next) {
+				if (*pp == entry) {
+						*pp = entry->next;
+						shard->bytes -= file_cache_entry_bytes(entry);
+						file_cache_release(entry);
+						return;
+				}
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_lookup(char * path)
+* DESCRITPTION: Looks for a file in the cache. Entries invalidated by the inotify thread are
+* 							ignored. If inotify is not available, or does not see the file, once per
+* 							second the file is checked with stat and the entry is dropped if its
+* 							modification time, size or inode changed.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with file_cache_release, or
+* 					NULL if the file is not cached
+*******************************************************************************************/
+FileCacheEntry * file_cache_lookup(char * path) {
+		FileCacheEntry * entry;
+		FileCacheShard * shard;
+		unsigned long hash;
+		struct stat st;
+		time_t now;
+		int stale;
+
+		if (file_cache_shard_size == 0) return NULL;
+
+		hash = hash_path(path);
+		shard = &file_cache_shards[hash % FILE_CACHE_SHARDS];
+
+		/* only the read side of the lock is taken on a hit */
+		pthread_rwlock_rdlock(&shard->lock);
+		for (entry = shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; entry; entry = entry->next) {
+				if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+						__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+						__atomic_store_n(&entry->referenced, TRUE, __ATOMIC_RELAXED);
+						break;
+				}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		if (entry == NULL) {
+				__atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+				return NULL;
+		}
+
+		/* check the file has not changed: inotify tells us if it sees the file, otherwise stat at
+		most once per second */
+		stale = (entry->generation != __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE));
+		if (!stale && !(cache_watching && entry->watched) && __atomic_load_n(&entry->checked, __ATOMIC_RELAXED) != (now = time(NULL))) {
+				stale = (stat(path, &st) < 0 || st.st_mtime != entry->mtime || st.st_size != entry->size || st.st_ino != entry->inode);
+				__atomic_store_n(&entry->checked, now, __ATOMIC_RELAXED);
+		}
+		if (stale) {
+				pthread_rwlock_wrlock(&shard->lock);
+				file_cache_unlink(shard, entry);
+				pthread_rwlock_unlock(&shard->lock);
+				file_cache_release(entry);
+				__atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+				return NULL;
+		}
+
+		__atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+		return entry;
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_evict(FileCacheShard * shard, long needed)
+* DESCRITPTION: Evicts entries of the shard till needed more bytes fit in it. Uses the clock
+* 							algorithm: entries hit since the hand last passed are spared once. The
+* 							write lock of the shard must be held.
+* ARGS_IN: FileCacheShard * shard - shard where space is needed
+* 				 long needed - number of bytes that must fit
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_evict(FileCacheShard * shard, long needed) {
+		FileCacheEntry ** pp, * entry;
+
+		while (shard->bytes > 0 && shard->bytes + needed > file_cache_shard_size) {
+				pp = &shard->buckets[shard->hand];
+				while ((entry = *pp) != NULL) {
+						if (__atomic_exchange_n(&entry->referenced, FALSE, __ATOMIC_RELAXED)) {
+								pp = &entry->next;
+						} else {
+								*pp = entry->next;
+								shard->bytes -= file_cache_entry_bytes(entry);
+								file_cache_release(entry);
+						}
+				}
+				shard->hand = (shard->hand + 1) % FILE_CACHE_BUCKETS;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int file_cache_headers(FileCacheEntry * entry, char * content_type,
+* 					char * extra_headers, char * server_signature)
+* DESCRITPTION: Writes the headers of the replies of an entry, from its size, ETag and
+* 							Last-Modified.
+* ARGS_IN: FileCacheEntry * entry - entry whose headers are written
+* 				 char * content_type - value of the Content-Type header
+* 				 char * extra_headers - more headers of the replies, each one ended by "\r\n"
+* 				 char * server_signature - value of the Server header
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int file_cache_headers(FileCacheEntry * entry, char * content_type, char * extra_headers, char * server_signature) {
+		char headers[LARGE_STRING_SIZE];
+
+		entry->headers_len = snprintf(headers, sizeof(headers), "Content-Type: %s\r\nContent-Length: %ld\r\n"
+		                              "Server: %s\r\nAccept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n",
+		                              content_type, entry->size, server_signature, entry->etag, entry->last_modified,
+		                              extra_headers);
+		if ((entry->headers = strdup(headers)) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a cache entry.\n");
+				return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_insert(char * path, int fd, char * content_type,
+* 					char * extra_headers, char * server_signature)
+* DESCRITPTION: Reads an opened file into a new cache entry, building its headers, and stores
+* 							it in the cache, evicting other entries of the shard if needed.
+* ARGS_IN: char * path - path of the file
+* 				 int fd - descriptor of the opened file, not closed by the function
+* 				 char * content_type - value of the Content-Type header
+* 				 char * extra_headers - more headers of the replies of the file, each one ended by
+* 																"\r\n", f.e. Content-Encoding for precompressed files
+* 				 char * server_signature - value of the Server header
+* ARGS_OUT: the entry, with a reference that must be released with file_cache_release, or
+* 					NULL if the file cannot be cached (too big, cache disabled or error)
+*******************************************************************************************/
+FileCacheEntry * file_cache_insert(char * path, int fd, char * content_type, char * extra_headers, char * server_signature) {
+		FileCacheEntry * entry, * old;
+		FileCacheShard * shard;
+		struct stat st;
+		struct tm tm;
+		ssize_t ret;
+		long done;
+		/* taken before reading, so that an invalidation while reading makes the entry stale */
+		unsigned long generation = __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE);
+
+		if (file_cache_shard_size == 0) return NULL;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > file_cache_max_file) return NULL;
+
+		if ((entry = calloc(1, sizeof(FileCacheEntry))) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a cache entry.\n");
+				return NULL;
+		}
+		entry->path = strdup(path);
+		entry->body = malloc(MAX(st.st_size, 1));
+		if (entry->path == NULL || entry->body == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a cache entry.\n");
+				entry->refs = 1;
+				file_cache_release(entry);
+				return NULL;
+		}
+
+		/* read the whole file */
+		for (done = 0; done < st.st_size; done += ret) {
+				ret = pread(fd, entry->body + done, st.st_size - done, done);
+				if (ret < 0 && errno == EINTR) {
+						ret = 0;
+				} else if (ret <= 0) {
+						perror("pread");
+						entry->refs = 1;
+						file_cache_release(entry);
+						return NULL;
+				}
+		}
+
+		/* everything but the status line and the Date header is known now */
+		strftime(entry->last_modified, sizeof(entry->last_modified), HTTP_DATE_FORMAT, gmtime_r(&st.st_mtime, &tm));
+		format_etag(entry->etag, &st);
+		entry->size = st.st_size;
+		if (file_cache_headers(entry, content_type, extra_headers, server_signature) == ERROR) {
+				entry->refs = 1;
+				file_cache_release(entry);
+				return NULL;
+		}
+		entry->hash = hash_path(path);
+		entry->mtime = st.st_mtime;
+		entry->inode = st.st_ino;
+		entry->checked = time(NULL);
+		entry->watched = cache_watched(path);
+		entry->generation = generation;
+		/* one reference for the cache and one for the caller */
+		entry->refs = 2;
+
+		shard = &file_cache_shards[entry->hash % FILE_CACHE_SHARDS];
+		pthread_rwlock_wrlock(&shard->lock);
+
+		/* replace the previous version of the file, if any */
+		for (old = shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; old; old = old->next) {
+				if (old->hash == entry->hash && strcmp(old->path, path) == 0) {
+						file_cache_unlink(shard, old);
+						break;
+				}
+		}
+
+		file_cache_evict(shard, entry->size);
+		entry->next = shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+		shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS] = entry;
+		shard->bytes += entry->size;
+
+		pthread_rwlock_unlock(&shard->lock);
+
+		return entry;
+}
+
+/*******************************************************************************************
+* FUNCTION: FileCacheEntry * file_cache_compressed(FileCacheEntry * entry, int coding,
+* 					char * content_type, char * extra_headers, char * server_signature)
+* DESCRITPTION: Gives the version of a cached file compressed with a coding. It is compressed
+* 							the first time it is asked for and kept with the entry, counted in the
+* 							memory of its shard, so each file is compressed once while it stays in the
+* 							cache. Its ETag is the one of the file with the coding added, so that it
+* 							is never taken for the version without compression.
+* ARGS_IN: FileCacheEntry * entry - entry of the file, referenced by the caller
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* 				 char * content_type - value of the Content-Type header
+* 				 char * extra_headers - more headers of the replies, Content-Encoding included
+* 				 char * server_signature - value of the Server header
+* ARGS_OUT: the compressed version, with a reference that must be released with
+* 					file_cache_release, or NULL in case of error
+*******************************************************************************************/
+FileCacheEntry * file_cache_compressed(FileCacheEntry * entry, int coding, char * content_type, char * extra_headers, char * server_signature) {
+		FileCacheShard * shard = &file_cache_shards[entry->hash % FILE_CACHE_SHARDS];
+		FileCacheEntry * variant, * e;
+
+		/* the versions are only set once and freed with the entry, so no lock is needed to read them */
+		if ((variant = __atomic_load_n(&entry->compressed[coding], __ATOMIC_ACQUIRE)) != NULL) {
+				file_cache_retain(variant);
+				return variant;
+		}
+
+		if ((variant = calloc(1, sizeof(FileCacheEntry))) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a cache entry.\n");
+				return NULL;
+		}
+		variant->refs = 1;
+		if ((variant->size = compress_buffer(coding, entry->body, entry->size, &variant->body)) == ERROR) {
+				file_cache_release(variant);
+				return NULL;
+		}
+		/* the ETag of the file with "-coding" before the closing quote */
+		snprintf(variant->etag, sizeof(variant->etag), "%.*s-%s\"", (int) strlen(entry->etag) - 1, entry->etag,
+		         compress_coding_name(coding));
+		strcpy(variant->last_modified, entry->last_modified);
+		variant->hash = entry->hash;
+		variant->mtime = entry->mtime;
+		variant->inode = entry->inode;
+		variant->generation = entry->generation;
+		if (file_cache_headers(variant, content_type, extra_headers, server_signature) == ERROR) {
+				file_cache_release(variant);
+				return NULL;
+		}
+
+		/* kept with the entry if it is still in the cache and no other thread did it meanwhile */
+		pthread_rwlock_wrlock(&shard->lock);
+		if (entry->compressed[coding] != NULL) {
+				file_cache_release(variant);
+				variant = entry->compressed[coding];
+				file_cache_retain(variant);
+		} else {
+				/* the eviction may take the entry itself, which then keeps the version to itself */
+				file_cache_evict(shard, variant->size);
+				for (e = shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; e && e != entry; e = e->next);
+				if (e) {
+						/* one reference for the entry and one for the caller */
+						file_cache_retain(variant);
+						__atomic_store_n(&entry->compressed[coding], variant, __ATOMIC_RELEASE);
+						shard->bytes += variant->size;
+				}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		return variant;
+}
+
+/*******************************************************************************************
+* FUNCTION: void file_cache_stats(long * hits, long * misses, long * bytes)
+* DESCRITPTION: Adds up the counters of every shard of the cache.
+* ARGS_IN: long * hits - where the number of hits is written
+* 				 long * misses - where the number of misses is written
+* 				 long * bytes - where the number of cached bytes is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void file_cache_stats(long * hits, long * misses, long * bytes) {
+		*hits = *misses = *bytes = 0;
+		for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+				*hits += __atomic_load_n(&file_cache_shards[i].hits, __ATOMIC_RELAXED);
+				*misses += __atomic_load_n(&file_cache_shards[i].misses, __ATOMIC_RELAXED);
+				*bytes += __atomic_load_n(&file_cache_shards[i].bytes, __ATOMIC_RELAXED);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_init(long entries, long ttl)
+* DESCRITPTION: Initializes the shards of the descriptor cache. Must be called before the
+* 							threads are created.
+* ARGS_IN: long entries - maximum number of entries (opened files and not found paths), 0
+* 												disables the cache
+* 				 long ttl - seconds an entry is trusted without opening the file again
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_init(long entries, long ttl) {
+		fd_cache_shard_entries = (entries + FILE_CACHE_SHARDS - 1) / FILE_CACHE_SHARDS;
+		fd_cache_ttl = ttl;
+		for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+				pthread_rwlock_init(&fd_cache_shards[i].lock, NULL);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_retain(FdCacheEntry * entry)
+* DESCRITPTION: Takes one more reference to an entry already referenced by the caller.
+* ARGS_IN: FdCacheEntry * entry - entry to retain
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_retain(FdCacheEntry * entry) {
+		__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_release(FdCacheEntry * entry)
+* DESCRITPTION: Releases a reference to an entry, closing the file and freeing the entry if
+* 							it was the last one.
+* ARGS_IN: FdCacheEntry * entry - entry to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_release(FdCacheEntry * entry) {
+		if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+				if (entry->fd >= 0) Close(entry->fd);
+				free(entry->path);
+				free(entry);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_unlink(FdCacheShard * shard, FdCacheEntry * entry)
+* DESCRITPTION: Removes an entry from its shard, if it is still there, and releases the
+* 							reference held by the cache. The write lock of the shard must be held.
+* ARGS_IN: FdCacheShard * shard - shard of the entry
+* 				 FdCacheEntry * entry - entry to remove
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_unlink(FdCacheShard * shard, FdCacheEntry * entry) {
+		FdCacheEntry ** pp = &shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+
+		for (; *pp; pp = &(*pp)->next) {
+				if (*pp == entry) {
+						*pp = entry->next;
+						shard->count--;
+						fd_cache_release(entry);
+						return;
+				}
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: FdCacheEntry * fd_cache_lookup(char * path)
+* DESCRITPTION: Looks for a path in the descriptor cache. Expired entries and entries
+* 							invalidated by the inotify thread are dropped.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with fd_cache_release, or NULL
+* 					if the path is not cached. The fd of the entry is -1 if the file does not exist.
+*******************************************************************************************/
+FdCacheEntry * fd_cache_lookup(char * path) {
+		FdCacheEntry * entry;
+		FdCacheShard * shard;
+		unsigned long hash;
+
+		if (fd_cache_shard_entries == 0) return NULL;
+
+		hash = hash_path(path);
+		shard = &fd_cache_shards[hash % FILE_CACHE_SHARDS];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		for (entry = shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; entry; entry = entry->next) {
+				if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+						__atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+						__atomic_store_n(&entry->referenced, TRUE, __ATOMIC_RELAXED);
+						break;
+				}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		if (entry && (entry->generation != __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE) || time(NULL) >= entry->expires)) {
+				pthread_rwlock_wrlock(&shard->lock);
+				fd_cache_unlink(shard, entry);
+				pthread_rwlock_unlock(&shard->lock);
+				fd_cache_release(entry);
+				entry = NULL;
+		}
+
+		if (entry == NULL) {
+				__atomic_add_fetch(&shard->misses, 1, __ATOMIC_RELAXED);
+		} else if (entry->fd < 0) {
+				__atomic_add_fetch(&shard->negative_hits, 1, __ATOMIC_RELAXED);
+		} else {
+				__atomic_add_fetch(&shard->hits, 1, __ATOMIC_RELAXED);
+		}
+		return entry;
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_evict(FdCacheShard * shard)
+* DESCRITPTION: Evicts entries of the shard till there is room for a new one, with the same
+* 							clock algorithm as the file cache. The write lock must be held.
+* ARGS_IN: FdCacheShard * shard - shard where room is needed
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_evict(FdCacheShard * shard) {
+		FdCacheEntry ** pp, * entry;
+
+		while (shard->count >= fd_cache_shard_entries) {
+				pp = &shard->buckets[shard->hand];
+				while ((entry = *pp) != NULL) {
+						if (__atomic_exchange_n(&entry->referenced, FALSE, __ATOMIC_RELAXED)) {
+								pp = &entry->next;
+						} else {
+								*pp = entry->next;
+								shard->count--;
+								fd_cache_release(entry);
+						}
+				}
+				shard->hand = (shard->hand + 1) % FILE_CACHE_BUCKETS;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: FdCacheEntry * fd_cache_open(char * path)
+* DESCRITPTION: Opens a file and stores the descriptor and the result of fstat in the cache.
+* 							If the file cannot be opened or is not a regular file a negative entry is
+* 							stored instead, so the next requests of the path do not try again. With
+* 							the cache disabled the entry is only owned by the caller.
+* ARGS_IN: char * path - path of the file
+* ARGS_OUT: the entry, with a reference that must be released with fd_cache_release, or NULL
+* 					in case of error. The fd of the entry is -1 if the file does not exist.
+*******************************************************************************************/
+FdCacheEntry * fd_cache_open(char * path) {
+		FdCacheEntry * entry, * old;
+		FdCacheShard * shard;
+		struct stat st;
+		struct tm tm;
+		/* taken before opening, so that an invalidation meanwhile makes the entry stale */
+		unsigned long generation = __atomic_load_n(&cache_generation, __ATOMIC_ACQUIRE);
+
+		if ((entry = calloc(1, sizeof(FdCacheEntry))) == NULL || (entry->path = strdup(path)) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a cache entry.\n");
+				free(entry);
+				return NULL;
+		}
+		entry->hash = hash_path(path);
+		entry->generation = generation;
+		entry->expires = time(NULL) + fd_cache_ttl;
+
+		entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (entry->fd >= 0 && (fstat(entry->fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+				Close(entry->fd);
+				entry->fd = -1;
+		}
+		if (entry->fd >= 0) {
+				/* the files are read whole into the file cache or sent with sendfile mostly from start to
+				end, so the kernel can read them ahead in bigger steps */
+				posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+				entry->size = st.st_size;
+				entry->mtime = st.st_mtime;
+				entry->inode = st.st_ino;
+				strftime(entry->last_modified, sizeof(entry->last_modified), HTTP_DATE_FORMAT, gmtime_r(&st.st_mtime, &tm));
+				format_etag(entry->etag, &st);
+		}
+
+		if (fd_cache_shard_entries == 0) {
+				entry->refs = 1;
+				return entry;
+		}
+
+		/* one reference for the cache and one for the caller */
+		entry->refs = 2;
+		shard = &fd_cache_shards[entry->hash % FILE_CACHE_SHARDS];
+		pthread_rwlock_wrlock(&shard->lock);
+		for (old = shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; old; old = old->next) {
+				if (old->hash == entry->hash && strcmp(old->path, path) == 0) {
+						fd_cache_unlink(shard, old);
+						break;
+				}
+		}
+		fd_cache_evict(shard);
+		entry->next = shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS];
+		shard->buckets[(entry->hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS] = entry;
+		shard->count++;
+		pthread_rwlock_unlock(&shard->lock);
+
+		return entry;
+}
+
+/*******************************************************************************************
+* FUNCTION: void fd_cache_stats(long * hits, long * misses, long * negative_hits)
+* DESCRITPTION: Adds up the counters of every shard of the descriptor cache.
+* ARGS_IN: long * hits - where the number of hits of opened files is written
+* 				 long * misses - where the number of misses is written
+* 				 long * negative_hits - where the number of hits of not found paths is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void fd_cache_stats(long * hits, long * misses, long * negative_hits) {
+		*hits = *misses = *negative_hits = 0;
+		for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+				*hits += __atomic_load_n(&fd_cache_shards[i].hits, __ATOMIC_RELAXED);
+				*misses += __atomic_load_n(&fd_cache_shards[i].misses, __ATOMIC_RELAXED);
+				*negative_hits += __atomic_load_n(&fd_cache_shards[i].negative_hits, __ATOMIC_RELAXED);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void cache_invalidate(char * path)
+* DESCRITPTION: Drops a path from the file cache and from the descriptor cache.
+* ARGS_IN: char * path - path of the file that changed
+* ARGS_OUT: None
+*******************************************************************************************/
+void cache_invalidate(char * path) {
+		unsigned long hash = hash_path(path);
+		FileCacheShard * file_shard = &file_cache_shards[hash % FILE_CACHE_SHARDS];
+		FdCacheShard * fd_shard = &fd_cache_shards[hash % FILE_CACHE_SHARDS];
+		FileCacheEntry * file_entry;
+		FdCacheEntry * fd_entry;
+
+		pthread_rwlock_wrlock(&file_shard->lock);
+		for (file_entry = file_shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; file_entry; file_entry = file_entry->next) {
+				if (file_entry->hash == hash && strcmp(file_entry->path, path) == 0) {
+						file_cache_unlink(file_shard, file_entry);
+						break;
+				}
+		}
+		pthread_rwlock_unlock(&file_shard->lock);
+
+		pthread_rwlock_wrlock(&fd_shard->lock);
+		for (fd_entry = fd_shard->buckets[(hash / FILE_CACHE_SHARDS) % FILE_CACHE_BUCKETS]; fd_entry; fd_entry = fd_entry->next) {
+				if (fd_entry->hash == hash && strcmp(fd_entry->path, path) == 0) {
+						fd_cache_unlink(fd_shard, fd_entry);
+						break;
+				}
+		}
+		pthread_rwlock_unlock(&fd_shard->lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: void cache_watch_directory(char * dir)
+* DESCRITPTION: Adds an inotify watch to a directory and to all its subdirectories, saving
+* 							the path of each one to rebuild the paths of the events.
+* ARGS_IN: char * dir - path of the directory
+* ARGS_OUT: None
+*******************************************************************************************/
+void cache_watch_directory(char * dir) {
+		char path[MEDIUM_STRING_SIZE];
+		struct dirent * de;
+		struct stat st;
+		DIR * d;
+		int wd;
+
+		wd = inotify_add_watch(watch_fd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+		                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+		if (wd < 0) {
+				perror("inotify_add_watch");
+				return;
+		}
+		pthread_mutex_lock(&watch_lock);
+		if (wd >= nwatch_dirs) {
+				char ** tmp = realloc(watch_dirs, (wd + 1) * sizeof(char *));
+				if (tmp == NULL) {
+						pthread_mutex_unlock(&watch_lock);
+						return;
+				}
+				memset(tmp + nwatch_dirs, 0, (wd + 1 - nwatch_dirs) * sizeof(char *));
+				watch_dirs = tmp;
+				nwatch_dirs = wd + 1;
+		}
+		free(watch_dirs[wd]);
+		watch_dirs[wd] = strdup(dir);
+		pthread_mutex_unlock(&watch_lock);
+
+		if ((d = opendir(dir)) == NULL) return;
+		while ((de = readdir(d)) != NULL) {
+				if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+				snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+				if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN && stat(path, &st) == 0 && S_ISDIR(st.st_mode))) {
+						cache_watch_directory(path);
+				}
+		}
+		closedir(d);
+}
+
+/*******************************************************************************************
+* FUNCTION: void* cache_watch_main(void *arg)
+* DESCRITPTION: Function executed by the inotify thread. Every change of a file drops it from
+* 							both caches. Changes of directories, or lost events, invalidate every
+* 							entry at once by changing the cache generation.
+* ARGS_IN: void * arg - not used
+* ARGS_OUT: None
+*******************************************************************************************/
+void* cache_watch_main(void *arg) {
+		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		char path[MEDIUM_STRING_SIZE];
+		struct inotify_event * ev;
+		ssize_t len;
+
+		Pthread_detach(pthread_self());
+
+		for (;;) {
+				if ((len = read(watch_fd, buf, sizeof(buf))) < 0) {
+						if (errno == EINTR) continue;
+						perror("inotify read");
+						cache_watching = FALSE;
+						return NULL;
+				}
+
+				for (char * p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+						ev = (struct inotify_event *) p;
+						if ((ev->mask & IN_Q_OVERFLOW) || ev->wd < 0 || ev->wd >= nwatch_dirs || watch_dirs[ev->wd] == NULL) {
+								__atomic_add_fetch(&cache_generation, 1, __ATOMIC_ACQ_REL);
+								continue;
+						}
+						if ((ev->mask & IN_ISDIR) || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+								/* a whole directory appeared or disappeared */
+								__atomic_add_fetch(&cache_generation, 1, __ATOMIC_ACQ_REL);
+								if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len) {
+										snprintf(path, sizeof(path), "%s/%s", watch_dirs[ev->wd], ev->name);
+										cache_watch_directory(path);
+								}
+								continue;
+						}
+						if (ev->len) {
+								snprintf(path, sizeof(path), "%s/%s", watch_dirs[ev->wd], ev->name);
+								cache_invalidate(path);
+						}
+				}
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int cache_watch_init(char * server_root)
+* DESCRITPTION: Starts the inotify thread that invalidates the caches when the files under
+* 							server_root change. Without it the file cache checks the files with stat
+* 							and the descriptor cache relies on the ttl of its entries.
+* ARGS_IN: char * server_root - directory to watch
+* ARGS_OUT: -1 in case inotify cannot be used, 0 otherwise
+*******************************************************************************************/
+int cache_watch_init(char * server_root) {
+		pthread_t tid;
+
+		if ((watch_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+				perror("inotify_init1");
+				return ERROR;
+		}
+		cache_watch_directory(server_root);
+		if (nwatch_dirs == 0) {
+				Close(watch_fd);
+				return ERROR;
+		}
+
+		cache_watching = TRUE;
+		Pthread_create(&tid, cache_watch_main, NULL);
+		return OK;
+}
@@ -0,0 +1,334 @@
+/*******************************************************************************************
+* FILE: client.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Benchmark client. Starts several concurrent clients, each one making a number
+* 							of requests to the server, and prints the throughput together with the
+* 							latency percentiles of the connection establishment, of the headers of the
+* 							replies and of the complete replies.
+* 							Usage: ./client [-c clients] [-n requests] [-k] [-P depth] [-h host] [-p port]
+* 							[path]
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/utils.h"
+#include <arpa/inet.h>
+#include <time.h>
+
+/* GLOBAL VARIABLES */
+/* Benchmark parameters */
+int nclients = 10, nrequests = 100, keep_alive = FALSE, pipeline = 1, port = 800;
+char * host = "127.0.0.1";
+char * path = "/www/index.html";
+
+/* Latencies in microseconds of every request, each client writes in its own slice */
+double * connect_latency; /* from connect() to the connection being established */
+double * reply_latency; /* from connect() (or the send in keep alive) to the headers of the reply */
+double * complete_latency; /* from connect() (or the send in keep alive) to the last byte of the reply */
+long errors = 0;
+pthread_mutex_t errors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*******************************************************************************************
+* FUNCTION: double now_us()
+* DESCRITPTION: Returns the value of the monotonic clock in microseconds.
+* ARGS_IN: None
+* ARGS_OUT: the current time in microseconds
+*******************************************************************************************/
+double now_us() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*******************************************************************************************
+* FUNCTION: int open_connection()
+* DESCRITPTION: Opens a connection with the server.
+* ARGS_IN: None
+* ARGS_OUT: the socket descriptor or -1 in case of error
+*******************************************************************************************/
+int open_connection() {
+		struct sockaddr_in addr;
+		int fd;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = FAM;
+		addr.sin_port = htons(port);
+		inet_pton(FAM, host, &addr.sin_addr);
+
+		if ((fd = socket(FAM, SOCK, 0)) < 0) {
+				perror("socket error");
+				return ERROR;
+		}
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+				perror("connect error");
+				close(fd);
+				return ERROR;
+		}
+		return fd;
+}
+
+/*******************************************************************************************
+* FUNCTION: int read_reply(int fd, char * buf, size_t * buflen, double start, double * latency,
+* 					double * complete)
+* DESCRITPTION: Reads a whole reply from the connection, using picohttpparser to find the
+* 							Content-Length or to decode the chunks of the body. The bytes read after
+* 							the reply (the next pipelined replies) are left at the start of the buffer.
+* ARGS_IN: int fd - connection with the server
+* 				 char * buf - buffer of LARGE_STRING_SIZE bytes, with the bytes already read
+* 				 size_t * buflen - number of bytes in the buffer, updated at the end
+* 				 double start - time from which the latency of the reply is measured
+* 				 double * latency - where the latency of the headers of the reply is written
+* 				 double * complete - where the latency of the whole reply is written
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int read_reply(int fd, char * buf, size_t * buflen, double start, double * latency, double * complete) {
+		struct phr_header headers[100];
+		struct phr_chunked_decoder decoder;
+		size_t num_headers, msg_len, body_left = 0, size;
+		int minor_version, status, pret, chunked = FALSE;
+		const char * msg;
+		ssize_t ret;
+
+		/* read till the headers are complete, there may be a whole reply in the buffer already */
+		for (;;) {
+				if (*buflen > 0) {
+						num_headers = sizeof(headers) / sizeof(headers[0]);
+						pret = phr_parse_response(buf, *buflen, &minor_version, &status, &msg, &msg_len, headers, &num_headers, 0);
+						if (pret == -1) return ERROR;
+						if (pret > 0) break;
+				}
+				if (*buflen == LARGE_STRING_SIZE) return ERROR;
+				ret = read(fd, buf + *buflen, LARGE_STRING_SIZE - *buflen);
+				if (ret <= 0) return ERROR;
+				*buflen += ret;
+		}
+		*latency = now_us() - start;
+
+		for (int i = 0; i < num_headers; i++) {
+				if (headers[i].name_len == 14 && strncasecmp(headers[i].name, "Content-Length", 14) == 0) {
+						body_left = atol(headers[i].value);
+				} else if (headers[i].name_len == 17 && strncasecmp(headers[i].name, "Transfer-Encoding", 17) == 0 &&
+				           headers[i].value_len == 7 && strncasecmp(headers[i].value, "chunked", 7) == 0) {
+						chunked = TRUE;
+				}
+		}
+
+		/* a chunked body is decoded as it arrives, the decoded bytes are not needed */
+		if (chunked) {
+				memset(&decoder, 0, sizeof(decoder));
+				decoder.consume_trailer = 1;
+				size = *buflen - pret;
+				memmove(buf, buf + pret, size);
+				for (;;) {
+						ssize_t left = phr_decode_chunked(&decoder, buf, &size);
+						if (left == -1) return ERROR;
+						if (left >= 0) {
+								memmove(buf, buf + size, left);
+								*buflen = left;
+								break;
+						}
+						ret = read(fd, buf, LARGE_STRING_SIZE);
+						if (ret <= 0) return ERROR;
+						size = ret;
+				}
+				*complete = now_us() - start;
+				return OK;
+		}
+
+		/* then skip the body, keeping what comes after it */
+		if (*buflen - pret >= body_left) {
+				*buflen -= pret + body_left;
+				memmove(buf, buf + pret + body_left, *buflen);
+				*complete = now_us() - start;
+				return OK;
+		}
+		body_left -= *buflen - pret;
+		*buflen = 0;
+		while (body_left > 0) {
+				ret = read(fd, buf, LARGE_STRING_SIZE);
+				if (ret <= 0) return ERROR;
+				if (ret > body_left) {
+						*buflen = ret - body_left;
+						memmove(buf, buf + body_left, *buflen);
+						break;
+				}
+				body_left -= ret;
+		}
+		*complete = now_us() - start;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int do_requests(int fd, int n, double start, double * latencies, double * completes)
+* DESCRITPTION: Sends n pipelined GET requests through the connection at once and reads all
+* 							the replies.
+* ARGS_IN: int fd - connection with the server
+* 				 int n - number of requests
+* 				 double start - time from which the latency of the replies is measured
+* 				 double * latencies - where the latency of the headers of each reply is written
+* 				 double * completes - where the latency of each whole reply is written
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int do_requests(int fd, int n, double start, double * latencies, double * completes) {
+		char request[MEDIUM_STRING_SIZE], buf[LARGE_STRING_SIZE];
+		char * requests;
+		size_t buflen = 0;
+		int len;
+
+		len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, host,
+		               keep_alive ? "" : "Connection: Close\r\n");
+		if ((requests = malloc((size_t)len * n)) == NULL) return ERROR;
+		for (int i = 0; i < n; i++) {
+				memcpy(requests + (size_t)len * i, request, len);
+		}
+		if (send(fd, requests, (size_t)len * n, MSG_NOSIGNAL) != (ssize_t)len * n) {
+				free(requests);
+				return ERROR;
+		}
+		free(requests);
+
+		for (int i = 0; i < n; i++) {
+				if (read_reply(fd, buf, &buflen, start, &latencies[i], &completes[i]) == ERROR) return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: void* client_main(void *arg)
+* DESCRITPTION: Function executed by each client thread, makes nrequests requests opening a
+* 							connection for each one, or reusing the same one in keep alive mode, where
+* 							they are sent in pipelined groups of the given depth.
+* ARGS_IN: void * arg - an int pointer to the number of the client
+* ARGS_OUT: None
+*******************************************************************************************/
+void* client_main(void *arg) {
+		int fd = -1, client = (intptr_t) arg, n;
+		double start;
+
+		for (int i = 0; i < nrequests; i += n) {
+				double * conn_lat = &connect_latency[client * nrequests + i];
+				double * rep_lat = &reply_latency[client * nrequests + i];
+				double * comp_lat = &complete_latency[client * nrequests + i];
+
+				n = MIN(pipeline, nrequests - i);
+				start = now_us();
+				for (int j = 0; j < n; j++) conn_lat[j] = 0;
+				if (fd < 0) {
+						if ((fd = open_connection()) < 0) goto error;
+						*conn_lat = now_us() - start;
+				}
+				if (do_requests(fd, n, start, rep_lat, comp_lat) == ERROR) goto error;
+
+				if (!keep_alive) {
+						close(fd);
+						fd = -1;
+				}
+				continue;
+
+error:
+				for (int j = 0; j < n; j++) conn_lat[j] = rep_lat[j] = comp_lat[j] = -1;
+				Pthread_mutex_lock(&errors_mutex);
+				errors += n;
+				Pthread_mutex_unlock(&errors_mutex);
+				if (fd >= 0) close(fd);
+				fd = -1;
+		}
+		if (fd >= 0) close(fd);
+		return NULL;
+}
+
+/*******************************************************************************************
+* FUNCTION: int compare_doubles(const void * a, const void * b)
+* DESCRITPTION: Comparison function for qsort.
+* ARGS_IN: const void * a, const void * b - pointers to the doubles to compare
+* ARGS_OUT: negative, 0 or positive as needed by qsort
+*******************************************************************************************/
+int compare_doubles(const void * a, const void * b) {
+		double x = *(const double *)a, y = *(const double *)b;
+		return (x > y) - (x < y);
+}
+
+/*******************************************************************************************
+* FUNCTION: void print_percentiles(char * name, double * values, long n)
+* DESCRITPTION: Sorts the latencies and prints the mean and the main percentiles, ignoring
+* 							the requests that failed (negative latency).
+* ARGS_IN: char * name - name of the measure
+* 				 double * values - latencies in microseconds
+* 				 long n - number of latencies
+* ARGS_OUT: None
+*******************************************************************************************/
+void print_percentiles(char * name, double * values, long n) {
+		double sum = 0;
+		long first = 0;
+
+		qsort(values, n, sizeof(double), compare_doubles);
+		while (first < n && values[first] < 0) first++;
+		if (first == n) return;
+		values += first;
+		n -= first;
+		for (long i = 0; i < n; i++) sum += values[i];
+
+		printf("%-10s mean %9.1f us  p50 %9.1f us  p90 %9.1f us  p99 %9.1f us  p99.9 %9.1f us  max %9.1f us\n",
+		       name, sum / n, values[n / 2], values[(long)(n * 0.9)], values[(long)(n * 0.99)],
+		       values[(long)(n * 0.999)], values[n - 1]);
+}
+
+/*******************************************************************************************
+* FUNCTION: int main(int argc, char **argv)
+* DESCRITPTION: Parses the arguments, starts the clients, waits for them and prints the results.
+* ARGS_IN: int argc - number of input arguments
+*					 char **argv - input arguments
+* ARGS_OUT: returns EXIT_SUCCESS in case everything goes as expected, EXIT_FAILURE otherwise.
+*******************************************************************************************/
+int main(int argc, char **argv) {
+		int opt;
+		pthread_t * tids;
+		double start, elapsed;
+
+		while ((opt = getopt(argc, argv, "c:n:kP:h:p:")) != -1) {
+				switch (opt) {
+				case 'c': nclients = atoi(optarg); break;
+				case 'n': nrequests = atoi(optarg); break;
+				case 'k': keep_alive = TRUE; break;
+				case 'P': pipeline = MAX(atoi(optarg), 1); break;
+				case 'h': host = optarg; break;
+				case 'p': port = atoi(optarg); break;
+				default:
+						fprintf(stderr, "Usage: %s [-c clients] [-n requests] [-k] [-P depth] [-h host] [-p port] [path]\n", argv[0]);
+						exit(EXIT_FAILURE);
+				}
+		}
+		if (optind < argc) path = argv[optind];
+		if (!keep_alive) pipeline = 1;
+
+		tids = calloc(nclients, sizeof(pthread_t));
+		connect_latency = calloc((long)nclients * nrequests, sizeof(double));
+		reply_latency = calloc((long)nclients * nrequests, sizeof(double));
+		complete_latency = calloc((long)nclients * nrequests, sizeof(double));
+		if (tids == NULL || connect_latency == NULL || reply_latency == NULL || complete_latency == NULL) {
+				fprintf(stderr, "Error when allocating memory for the clients.\n");
+				exit(EXIT_FAILURE);
+		}
+
+		start = now_us();
+		for (int i = 0; i < nclients; i++) {
+				Pthread_create(&tids[i], client_main, (void *)(intptr_t)i);
+		}
+		for (int i = 0; i < nclients; i++) {
+				pthread_join(tids[i], NULL);
+		}
+		elapsed = now_us() - start;
+
+		printf("%d clients x %d requests of %s (%s, pipeline %d): %.3f s, %.0f requests/s, %ld errors\n",
+		       nclients, nrequests, path, keep_alive ? "keep alive" : "connection per request", pipeline,
+		       elapsed / 1e6, ((double)nclients * nrequests - errors) / (elapsed / 1e6), errors);
+		if (!keep_alive) print_percentiles("connect", connect_latency, (long)nclients * nrequests);
+		print_percentiles("reply", reply_latency, (long)nclients * nrequests);
+		print_percentiles("complete", complete_latency, (long)nclients * nrequests);
+
+		free(tids);
+		free(connect_latency);
+		free(reply_latency);
+		free(complete_latency);
+		exit(EXIT_SUCCESS);
+}
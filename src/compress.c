@@ -0,0 +1,215 @@
+/*******************************************************************************************
+* FILE: compress.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Compression of the replies on the fly with zlib. The files are compressed
+* 							once, when they are in the file cache, and the compressed version is kept
+* 							with them (see cache.c), while the output of the scripts is compressed
+* 							as it is sent.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/compress.h"
+
+
+/* GLOBAL VARIABLES */
+int compression_level = 0; /* zlib level, 0 if the compression is disabled */
+long compression_min_size = 0; /* smaller files are not compressed */
+/* types compressed, as given in the configuration, a type ending
+in '*' matches every type that starts like it */
+char compression_types[MAX_COMPRESSION_TYPES][TINY_STRING_SIZE + 1];
+int ncompression_types = 0;
+
+/* types whose contents are already compressed, compressing them again only costs time */
+const char * compressed_types[] = {
+		"image/", "video/", "audio/", "font/woff", "application/zip", "application/gzip",
+		"application/x-gzip", "application/x-bzip2", "application/x-xz", "application/zstd",
+		"application/pdf", NULL
+};
+
+
+/*******************************************************************************************
+* FUNCTION: void compress_init(long level, long min_size, char * types)
+* DESCRITPTION: Sets what is compressed on the fly. Must be called before the threads are
+* 							created.
+* ARGS_IN: long level - zlib level, from 1 (fastest) to 9 (smallest), 0 disables compression
+* 				 long min_size - files smaller than this are not compressed
+* 				 char * types - types compressed, separated by spaces or commas, f.e.
+* 												"text/html text/css text/javascript"
+* ARGS_OUT: None
+*******************************************************************************************/
+void compress_init(long level, long min_size, char * types) {
+		char * p = types;
+		size_t len;
+
+		compression_level = MAX(0, MIN(level, 9));
+		compression_min_size = min_size;
+		ncompression_types = 0;
+		while (p && *p && ncompression_types < MAX_COMPRESSION_TYPES) {
+				p += strspn(p, " \t,");
+				len = strcspn(p, " \t,");
+				if (len > 0 && len <= TINY_STRING_SIZE) {
+						memcpy(compression_types[ncompression_types], p, len);
+						compression_types[ncompression_types++][len] = '\0';
+				}
+				p += len;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int compress_type(char * content_type, long size)
+* DESCRITPTION: Tells if the replies of a type are compressed on the fly: the type must be in
+* 							the list given to compress_init and the reply not smaller than the minimum
+* 							size. Types that are already compressed (images but svg, audio, video and
+* 							archives) are never compressed, even if the list includes them.
+* ARGS_IN: char * content_type - value of the Content-Type header
+* 				 long size - size of the reply, -1 if it is not known (output of a script)
+* ARGS_OUT: TRUE if the reply must be compressed when the client accepts it, FALSE otherwise
+*******************************************************************************************/
+int compress_type(char * content_type, long size) {
+		/* the parameters of the type, f.e. "; charset=utf-8", are not compared */
+		size_t len = strcspn(content_type, " ;"), n;
+
+		if (compression_level == 0 || (size >= 0 && size < compression_min_size)) return FALSE;
+
+		if (len != strlen("image/svg+xml") || strncasecmp(content_type, "image/svg+xml", len) != 0) {
+				for (int i = 0; compressed_types[i]; i++) {
+						if (strncasecmp(content_type, compressed_types[i], strlen(compressed_types[i])) == 0) return FALSE;
+				}
+		}
+
+		for (int i = 0; i < ncompression_types; i++) {
+				n = strlen(compression_types[i]);
+				/* a type ending in '*' matches by the part before it */
+				if (compression_types[i][n - 1] == '*') {
+						if (strncasecmp(content_type, compression_types[i], n - 1) == 0) return TRUE;
+				} else if (n == len && strncasecmp(content_type, compression_types[i], len) == 0) {
+						return TRUE;
+				}
+		}
+		return FALSE;
+}
+
+/*******************************************************************************************
+* FUNCTION: const char * compress_coding_name(int coding)
+* DESCRITPTION: Gives the value of the Content-Encoding header of a coding.
+* ARGS_IN: int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* ARGS_OUT: the name of the coding
+*******************************************************************************************/
+const char * compress_coding_name(int coding) {
+		return coding == COMPRESSION_GZIP ? "gzip" : "deflate";
+}
+
+/*******************************************************************************************
+* FUNCTION: int compress_stream_init(z_stream * stream, int coding)
+* DESCRITPTION: Starts a zlib stream with the level of the configuration. The deflate coding
+* 							of http is the zlib format, gzip has its own header.
+* ARGS_IN: z_stream * stream - stream to initialize
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int compress_stream_init(z_stream * stream, int coding) {
+		memset(stream, 0, sizeof(z_stream));
+		if (deflateInit2(stream, compression_level, Z_DEFLATED, coding == COMPRESSION_GZIP ? 15 + 16 : 15,
+		                 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+				fprintf(stderr, "ERROR: error when starting the compression.\n");
+				return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: long compress_buffer(int coding, const char * data, long len, char ** out)
+* DESCRITPTION: Compresses a whole buffer, f.e. a file of the file cache.
+* ARGS_IN: int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* 				 const char * data - bytes to compress
+* 				 long len - number of bytes
+* 				 char ** out - where the compressed bytes are returned, allocated with malloc
+* ARGS_OUT: the number of compressed bytes or -1 in case of error
+*******************************************************************************************/
+long compress_buffer(int coding, const char * data, long len, char ** out) {
+		z_stream stream;
+		long size;
+
+		if (compress_stream_init(&stream, coding) == ERROR) return ERROR;
+
+		/* the bound is enough to compress everything in a single call */
+		size = deflateBound(&stream, len);
+		if ((*out = malloc(size)) == NULL) {
+				deflateEnd(&stream);
+				return ERROR;
+		}
+		stream.next_in = (unsigned char *) data;
+		stream.avail_in = len;
+		stream.next_out = (unsigned char *) *out;
+		stream.avail_out = size;
+		if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+				fprintf(stderr, "ERROR: error when compressing a file.\n");
+				deflateEnd(&stream);
+				free(*out);
+				*out = NULL;
+				return ERROR;
+		}
+		size = stream.total_out;
+		deflateEnd(&stream);
+		return size;
+}
+
+/*******************************************************************************************
+* FUNCTION: int compressor_init(Compressor * c, int coding)
+* DESCRITPTION: Starts the compression of a reply sent in pieces, f.e. the output of a script.
+* ARGS_IN: Compressor * c - state of the compression
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int compressor_init(Compressor * c, int coding) {
+		return compress_stream_init(&c->stream, coding);
+}
+
+/*******************************************************************************************
+* FUNCTION: int compressor_write(Compressor * c, const char * data, size_t len, int flush,
+* 					int (*write)(void * arg, const char * data, size_t len), void * arg)
+* DESCRITPTION: Compresses the next piece of a reply, giving the compressed bytes to the write
+* 							function as the output buffer fills. zlib keeps the bytes it has not
+* 							compressed yet unless flush is Z_SYNC_FLUSH, which gives everything
+* 							received till now, or Z_FINISH, which ends the reply.
+* ARGS_IN: Compressor * c - state of the compression
+* 				 const char * data - bytes of the reply
+* 				 size_t len - number of bytes
+* 				 int flush - Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+* 				 int (*write)(...) - function that sends the compressed bytes, returning -1 in
+* 														 case of error
+* 				 void * arg - first argument of the write function
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int compressor_write(Compressor * c, const char * data, size_t len, int flush,
+                     int (*write)(void * arg, const char * data, size_t len), void * arg) {
+		size_t have;
+		int ret;
+
+		c->stream.next_in = (unsigned char *) data;
+		c->stream.avail_in = len;
+		/* zlib stops when the input is consumed and the output buffer was not filled */
+		do {
+				c->stream.next_out = c->out;
+				c->stream.avail_out = sizeof(c->out);
+				ret = deflate(&c->stream, flush);
+				if (ret == Z_STREAM_ERROR) {
+						fprintf(stderr, "ERROR: error when compressing a reply.\n");
+						return ERROR;
+				}
+				have = sizeof(c->out) - c->stream.avail_out;
+				if (have > 0 && write(arg, (char *) c->out, have) == ERROR) return ERROR;
+		} while (c->stream.avail_out == 0);
+
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: void compressor_end(Compressor * c)
+* DESCRITPTION: Frees the memory used by a compression started with compressor_init.
+* ARGS_IN: Compressor * c - state of the compression
+* ARGS_OUT: None
+*******************************************************************************************/
+void compressor_end(Compressor * c) {
+		deflateEnd(&c->stream);
+}
@@ -6,38 +6,214 @@
 
 /* All defines, data structure definition and constant definition is stored in utils.h */
 #include "../includes/http.h"
+#include "../includes/cache.h"
+#include "../includes/compress.h"
+#include "../includes/metrics.h"
+#include "../includes/probes.h"
+#include "../includes/scripts.h"
+#include "../includes/timer.h"
+#include <limits.h>
+#include <stdarg.h>
+
+/* value of the Date header in the templates of the replies, overwritten on every request */
+#define HTTP_DATE_PLACEHOLDER "Thu, 01 Jan 1970 00:00:00 GMT"
+/* interim reply to a client that waits for it before sending the body */
+#define HTTP_CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
+
+/* structure that stores a Date header formatted for one second */
+typedef struct {
+		time_t second;
+		char value[HTTP_DATE_SIZE + 1];
+} HttpDate;
+
+/* structure that stores a reply, or its first lines, serialized at startup. Only the http
+version and the date change from one request to another */
+typedef struct {
+		char* data;
+		size_t len;
+		/* position of the minor version digit and of the date inside data */
+		size_t version_offset;
+		size_t date_offset;
+		/* status code, and its position in the responses counters */
+		int code;
+		int status;
+} HttpTemplate;
+
+/* structure that stores the reply of a script whose output is sent while the script runs,
+the headers are sent together with the first bytes of output */
+typedef struct {
+		Connection * conn;
+		Request * request;
+		char * content_type;
+		char * date;
+		char * last_modified;
+		/* more headers of the reply, each one ended by "\r\n" */
+		char * extra_headers;
+		/* compression of the output, NULL if it is sent as the script writes it */
+		Compressor * compressor;
+		/* bytes of output sent to the client, and boolean representing if output was given to
+		zlib since its last flush */
+		long sent;
+		int pending;
+} ScriptReply;
+
+/* structure that stores the state of the body of a request that is read while the request is
+answered. The body is read in the part of the input buffer after the headers, so that the
+fields of the request stay valid and the memory used does not depend on its size */
+typedef struct {
+		Connection * conn;
+		Request * request;
+		/* position of the input buffer where the pieces of the body are read */
+		size_t start;
+		/* bytes of a body with Content-Length not given yet */
+		long left;
+		/* state of the decoding of a chunked body */
+		struct phr_chunked_decoder decoder;
+		/* bytes of the body given till now */
+		long total;
+		/* boolean representing if the whole body has been given */
+		int done;
+		/* booleans representing if the body could not be read, and if it was because it was too
+		big or badly chunked. The connection is closed after the reply */
+		int failed;
+		int too_large;
+		int malformed;
+} BodyReader;
+
+/* structure that stores one of the ranges of a file asked in a Range header */
+typedef struct {
+		off_t start;
+		off_t len;
+} ByteRange;
+
+/* GLOBAL VARIABLES */
+/* replies built by http_init from the configuration of the server */
+static HttpTemplate reply_200, reply_200_cached, reply_206, reply_304, reply_416, reply_options, reply_400, reply_404, reply_413, reply_431, reply_500;
+/* precompressed versions of the files looked for, in order of preference */
+static const struct { const char * encoding; const char * suffix; } precompressed[] = {
+		{"br", ".br"}, {"zstd", ".zst"}, {"gzip", ".gz"},
+};
+/* number written in the boundary of the next multipart reply, starting at a random value */
+static unsigned long last_boundary = 0;
+/* maximum size of the body of a request */
+static long max_body_size = 0;
+/* Date headers shared by all the threads. The first request of each second formats the new
+one in the next slot and publishes it swapping current_date, so the rest only copy it */
+static HttpDate date_cache[DATE_CACHE_SLOTS];
+static HttpDate * current_date = NULL;
+/* last second claimed by a thread to be formatted */
+static time_t date_formatting = 0;
+/* timeouts of the connections in milliseconds, 0 for no limit */
+static long header_timeout = 0, body_timeout = 0, keepalive_timeout = 0, write_timeout = 0;
+/* path where the metrics are served, empty if they are not */
+static char * status_path = "";
 
+/*******************************************************************************************
+* FUNCTION: int slice_equals(Slice s, const char * str)
+* DESCRITPTION: Compares a slice of the input buffer with a string.
+* ARGS_IN: Slice s - slice to compare
+* 				 const char * str - '\0' terminated string
+* ARGS_OUT: TRUE if both are equal, FALSE otherwise
+*******************************************************************************************/
+int slice_equals(Slice s, const char * str) {
+		return strlen(str) == s.len && memcmp(s.ptr, str, s.len) == 0;
+}
 
 /*******************************************************************************************
-* FUNCTION: void print_request(Request r)
-* DESCRITPTION: Prints the fields of a Request structure.
-* ARGS_IN: Request r - Request structure whose fields are to be printed
-* ARGS_OUT: None
+* FUNCTION: int slice_case_equals(const char * ptr, size_t len, const char * str)
+* DESCRITPTION: Compares a piece of the input buffer with a string ignoring the case, as
+* 							needed for the names of the headers.
+* ARGS_IN: const char * ptr - start of the piece of the buffer
+* 				 size_t len - length of the piece
+* 				 const char * str - '\0' terminated string
+* ARGS_OUT: TRUE if both are equal, FALSE otherwise
+*******************************************************************************************/
+int slice_case_equals(const char * ptr, size_t len, const char * str) {
+		return strlen(str) == len && strncasecmp(ptr, str, len) == 0;
+}
+
+/*******************************************************************************************
+* FUNCTION: int slice_has_token(const char * ptr, size_t len, const char * token)
+* DESCRITPTION: Looks for a token in a comma separated header value ignoring the case, f.e.
+* 							"close" in "Connection: TE, Close".
+* ARGS_IN: const char * ptr - start of the header value
+* 				 size_t len - length of the header value
+* 				 const char * token - '\0' terminated token
+* ARGS_OUT: TRUE if the token is in the list, FALSE otherwise
 *******************************************************************************************/
-void print_request(Request r) {
-		printf("PRINTING REQUEST: \n\n");
-		printf("method name: %s\n", r.method);
-		printf("path name: %s\n", r.path);
-		printf("number of headers: %d\n", r.num_headers);
-		printf("length of the request: %d\n", r.length);
-		printf("arguments in post: %s\n", r.args);
-		for(int i = 0; i < r.num_headers; i++) {
-				printf("header %d:\n", i);
-				printf("header name: '%s', header content: '%s'\n", r.headers[i].name, r.headers[i].value);
+int slice_has_token(const char * ptr, size_t len, const char * token) {
+		size_t start = 0, end;
+
+		while (start < len) {
+				// skip the separators before the token, then find its end
+				while (start < len && (ptr[start] == ',' || ptr[start] == ' ' || ptr[start] == '\t')) start++;
+				end = start;
+				while (end < len && ptr[end] != ',') end++;
+				size_t token_end = end;
+				while (token_end > start && (ptr[token_end - 1] == ' ' || ptr[token_end - 1] == '\t')) token_end--;
+				if (slice_case_equals(ptr + start, token_end - start, token)) return TRUE;
+				start = end;
 		}
+		return FALSE;
 }
 
 /*******************************************************************************************
 * FUNCTION: void get_time(char* s)
-* DESCRITPTION: Writes the actual time on a string.
-* ARGS_IN: char* s - string where the time is going to be written
-*                    Format example: Mon, 17 May 2021 14:29:48 GMT
+* DESCRITPTION: Writes the actual time on a string, copying it from the date cache. The date
+* 							is only formatted by the first request of each second, the threads that
+* 							see the new second while it is being formatted format their own copy.
+* ARGS_IN: char* s - string where the time is going to be written, at least HTTP_DATE_SIZE + 1
+* 										 bytes. Format example: Mon, 17 May 2021 14:29:48 GMT
 * ARGS_OUT: None
 *******************************************************************************************/
 void get_time(char* s) {
-		time_t now = time(0);
-		struct tm tm = *gmtime(&now);
-		strftime(s, SMALL_STRING_SIZE, "%a, %d %b %Y %H:%M:%S %Z", &tm);
+		time_t now = time(NULL), formatting;
+		HttpDate * date = __atomic_load_n(&current_date, __ATOMIC_ACQUIRE);
+		struct tm tm;
+
+		if (date == NULL || date->second != now) {
+				formatting = __atomic_load_n(&date_formatting, __ATOMIC_RELAXED);
+				if (formatting < now && __atomic_compare_exchange_n(&date_formatting, &formatting, now, FALSE,
+				                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+						// this thread formats the new second, in a slot not read since DATE_CACHE_SLOTS seconds ago
+						date = &date_cache[now % DATE_CACHE_SLOTS];
+						date->second = now;
+						strftime(date->value, sizeof(date->value), HTTP_DATE_FORMAT, gmtime_r(&now, &tm));
+						__atomic_store_n(&current_date, date, __ATOMIC_RELEASE);
+				} else {
+						// another thread is formatting it
+						strftime(s, HTTP_DATE_SIZE + 1, HTTP_DATE_FORMAT, gmtime_r(&now, &tm));
+						return;
+				}
+		}
+		memcpy(s, date->value, HTTP_DATE_SIZE + 1);
+}
+
+/*******************************************************************************************
+* FUNCTION: int canonical_path(char * path)
+* DESCRITPTION: Removes the empty ("//") and "." segments of the path of a request, so that a
+* 							file has a single path, the one the caches are keyed by and the inotify
+* 							thread rebuilds from its events. ".." segments are refused, as they could
+* 							leave server_root.
+* ARGS_IN: char * path - path of the request, changed in place
+* ARGS_OUT: -1 if the path has a ".." segment, 0 otherwise
+*******************************************************************************************/
+int canonical_path(char * path) {
+		char * in = path, * out = path;
+
+		while (*in) {
+				if (in[0] == '/' && in[1] == '/') {
+						in++;
+				} else if (in[0] == '/' && in[1] == '.' && (in[2] == '/' || in[2] == '\0')) {
+						in += 2;
+				} else if (in[0] == '/' && in[1] == '.' && in[2] == '.' && (in[3] == '/' || in[3] == '\0')) {
+						return ERROR;
+				} else {
+						*out++ = *in++;
+				}
+		}
+		*out = '\0';
+		return OK;
 }
 
 /*******************************************************************************************
@@ -82,543 +258,2407 @@ int get_content_type(char * path, char * res) {
 }
 
 /*******************************************************************************************
-* FUNCTION: void get_content_lenght_and_last_modified(char* path, long * size,
+* FUNCTION: int get_content_lenght_and_last_modified(char* path, int fd, long * size,
 *						char * last_modified)
 * DESCRITPTION: Writes the content date of the last modification and the size of a given file.
 * ARGS_IN: char* path - path of the file
+*					 int fd - descriptor of the file if it is already opened, -1 otherwise. The
+*									 descriptor is preferred so that the size is the one of the file sent.
 *					 char* res - where the resulting length of the file will be written
 *          char * last_modified - where the date of the last modification is stored
-* ARGS_OUT: none
+* ARGS_OUT: -1 in case of error, 0 otherwise
 *******************************************************************************************/
-void get_content_lenght_and_last_modified(char* path, long * size, char * last_modified) {
+int get_content_lenght_and_last_modified(char* path, int fd, long * size, char * last_modified) {
 		struct stat st;
-		stat(path, &st);
+		struct tm tm;
+		if ((fd >= 0 ? fstat(fd, &st) : stat(path, &st)) < 0) {
+				perror("stat");
+				return ERROR;
+		}
 		*size =  st.st_size;
-		strftime(last_modified, SMALL_STRING_SIZE, "%a, %d %b %Y %H:%M:%S %Z", gmtime(&st.st_mtime));
+		strftime(last_modified, SMALL_STRING_SIZE, HTTP_DATE_FORMAT, gmtime_r(&st.st_mtime, &tm));
+		return OK;
 }
 
 /*******************************************************************************************
-* FUNCTION: void clean_and_close(int desc, Request * request)
-* DESCRITPTION: Closes connection in case there was a connection close header and dellocates
-* 							a Request structure.
-* ARGS_IN: int desc - descriptor to close in case of connection close
-*					 Request * request - request to be freed
+* FUNCTION: void clean_and_close(Connection * conn, Request * request)
+* DESCRITPTION: Marks the connection to be closed once the reply is sent in case there was a
+* 							connection close header. The request itself lives in the input buffer, so
+* 							there is nothing to free.
+* ARGS_IN: Connection * conn - connection to close in case of connection close
+*					 Request * request - request that has been answered
 * ARGS_OUT: none
 *******************************************************************************************/
-void clean_and_close(int desc, Request * request) {
-		// check not NULL already
-		if (request) {
-				if (request->connection_close == TRUE) {
-						// the client sent a connection close in their request
-						//printf("Connection close received.\n");
-						Close(desc);
-				}
-				if (request->headers) free(request->headers);
-				free(request);
+void clean_and_close(Connection * conn, Request * request) {
+		if (request->connection_close == TRUE) {
+				// the client sent a connection close in their request
+				conn->close_after_write = TRUE;
 		}
 }
 
+/*******************************************************************************************
+* FUNCTION: void http_timeouts_init(long header, long body, long keepalive, long write)
+* DESCRITPTION: Sets the timeouts of the connections. Must be called before the threads are
+* 							created.
+* ARGS_IN: long header - seconds to receive the headers of a request, since the connection is
+* 												 accepted or the first byte of the request arrives
+* 				 long body - seconds that a streamed request body can go without a byte
+* 				 long keepalive - seconds a connection can wait for its next request
+* 				 long write - seconds a reply can go without a byte being sent
+* ARGS_OUT: None
+*******************************************************************************************/
+void http_timeouts_init(long header, long body, long keepalive, long write) {
+		header_timeout = MAX(0, header) * 1000;
+		body_timeout = MAX(0, body) * 1000;
+		keepalive_timeout = MAX(0, keepalive) * 1000;
+		write_timeout = MAX(0, write) * 1000;
+}
 
 /*******************************************************************************************
-* FUNCTION: void send_200_ok(int desc, int version, char * content_type, long content_len,
-*						char * date, char * last_modified, char * server_signature)
-* DESCRITPTION: Sends a 200 OK reply to the through the specified descriptor given the
-* 							arguments to be written in the headers of the response
-* ARGS_IN: int desc - descriptor through where the the reply will be sent
-*					 int version - http version to be written in the header
-* 				 char * content_type - content type to be witten in the Content-Type header
-* 				 long content_len - length of the file, to be witten in the Content-Length header
-* 				 char * date - string containing the date to be used as the Date header
-* 				 char * last_modified - string containing the date of the last modification,
-* 																to be used as the Last-Modified header
-* 				 char * server_signature - string containing the server's signature, to be
-* 																	 used as the Server header
-* ARGS_OUT: none
+* FUNCTION: void http_status_init(char * path)
+* DESCRITPTION: Sets the path where the metrics of the server are served. Must be called before
+* 							the threads are created.
+* ARGS_IN: char * path - path of the url, empty so that it is a normal file
+* ARGS_OUT: None
 *******************************************************************************************/
-void send_200_ok(int desc, int version, char * content_type, long content_len, char * date, char * last_modified, char * server_signature) {
-		char buffer[LARGE_STRING_SIZE];
-		int ret;
+void http_status_init(char * path) {
+		status_path = path ? path : "";
+}
 
-		// write the request on the buffer
-		ret = sprintf(buffer, "HTTP/1.%d 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld"
-		              "\r\nDate: %s\r\nServer: %s\r\nLast-Modified: %s\r\n\r\n",
-		              version, content_type, content_len, date, server_signature, last_modified);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				return;
-		}
+/*******************************************************************************************
+* FUNCTION: int socket_timeout(int fd, int option, long timeout)
+* DESCRITPTION: Sets how long a blocking read or write of a socket waits before failing with
+* 							EAGAIN.
+* ARGS_IN: int fd - socket descriptor
+* 				 int option - SO_RCVTIMEO or SO_SNDTIMEO
+* 				 long timeout - milliseconds, 0 to wait forever
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int socket_timeout(int fd, int option, long timeout) {
+		struct timeval tv;
 
-		// send the request through the given descriptor
-		ret = send(desc, buffer, strlen(buffer), MSG_NOSIGNAL);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: send failed.\n");
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) < 0) {
+				perror("setsockopt timeout");
+				return ERROR;
 		}
+		return OK;
 }
 
 /*******************************************************************************************
-* FUNCTION: void send_200_ok_options(int desc, int version, char * date,
-* 					char * server_signature)
-* DESCRITPTION: Sends a 200 OK, options reply to the through the specified descriptor given
-* 							the	arguments to be written in the headers of the response. The allow header
-* 							is always "Allow: GET, POST, OPTIONS".
-* ARGS_IN: int desc - descriptor through where the the reply will be sent
-*					 int version - http version to be written in the header
-* 				 char * date - string containing the date to be used as the Date header
-* 				 char * server_signature - string containing the server's signature, to be
-* 																	 used as the Server header
-* ARGS_OUT: none
+* FUNCTION: long long connection_deadline(Connection * conn)
+* DESCRITPTION: Gives when the connection times out in its current state: when writing, once
+* 							the write timeout passes without sending a byte; when waiting for a new
+* 							request on a keep-alive connection, once the keep-alive timeout passes
+* 							since the last reply; and otherwise, once the header timeout passes since
+* 							the request started to arrive (or the connection was accepted).
+* ARGS_IN: Connection * conn - connection
+* ARGS_OUT: the time of timer_now at which it times out, -1 if the timeout is disabled
 *******************************************************************************************/
-void send_200_ok_options(int desc, int version, char * date, char * server_signature) {
-		char buffer[LARGE_STRING_SIZE];
-
-		// write the request on the buffer
-		int ret = sprintf(buffer, "HTTP/1.%d 200 OK\r\nContent-Length: 0\r\nDate: %s\r\nServer: %s\r\n"
-		                  "Allow: GET, POST, OPTIONS\r\n", version, date, server_signature);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				return;
+long long connection_deadline(Connection * conn) {
+		if (conn->state == CONN_STATE_WRITE) {
+				return write_timeout ? conn->last_progress + write_timeout : -1;
 		}
-
-		// send the request through the given descriptor
-		ret = send(desc, buffer, strlen(buffer), MSG_NOSIGNAL);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: send failed.\n");
+		if (conn->in_len == 0 && conn->requests > 0) {
+				return keepalive_timeout ? conn->idle_since + keepalive_timeout : -1;
 		}
+		return header_timeout ? conn->request_start + header_timeout : -1;
 }
 
 /*******************************************************************************************
-* FUNCTION: void send_400_bad_request(int desc, int version, char * date,
-* 					char * server_signature)
-* DESCRITPTION: Sends a 400 bad request reply to the through the specified descriptor given
-* 							the arguments to be written in the headers of the response
-* ARGS_IN: int desc - descriptor through where the the reply will be sent
-*					 int version - http version to be written in the header
-* 				 char * date - string containing the date to be used as the Date header
-* 				 char * server_signature - string containing the server's signature, to be
-* 																	 used as the Server header
-* ARGS_OUT: none
+* FUNCTION: void connection_watch(Connection * conn)
+* DESCRITPTION: Arms the timer of the connection with the deadline of its current state, or
+* 							disarms it if the timeout of the state is disabled.
+* ARGS_IN: Connection * conn - connection
+* ARGS_OUT: None
 *******************************************************************************************/
-void send_400_bad_request(int desc, int version, char * date, char * server_signature) {
-		printf("Bad request!, error 400 sent.\n");
+void connection_watch(Connection * conn) {
+		long long deadline;
 
-		char buffer[LARGE_STRING_SIZE];
-		int ret;
-		char error_400[MEDIUM_STRING_SIZE] = "<html><b>400 Bad Request</b></html>";
+		if (conn->watchdog == NULL) return;
+		if ((deadline = connection_deadline(conn)) < 0) timer_cancel(conn->watchdog, &conn->timer);
+		else timer_arm(conn->watchdog, &conn->timer, deadline);
+}
 
-		// write the request on the buffer
-		ret = sprintf(buffer, "HTTP/1.%d 400 Bad Request\r\nContent-Type: text/html\r\nContent-Length: %ld"
-		              "\r\nDate: %s\r\nServer: %s\r\n\r\n%s",
-		              version, strlen(error_400), date, server_signature, error_400);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				return;
-		}
+/*******************************************************************************************
+* FUNCTION: void connection_init(Connection * conn, int fd, int nonblocking,
+* 					TimerWheel * watchdog, Metrics * metrics)
+* DESCRITPTION: Initializes the state of a connection that has just been accepted. Nagle's
+* 							algorithm is disabled, as every reply is already sent in as few calls as
+* 							possible and the last bytes must not wait for the ack of the previous ones.
+* 							The time to receive the first request starts now, and so does the time
+* 							till its first byte.
+* ARGS_IN: Connection * conn - connection to initialize
+* 				 int fd - socket descriptor of the connection
+* 				 int nonblocking - TRUE if the socket is in non blocking mode
+* 				 TimerWheel * watchdog - wheel where the timer of the connection is armed while it
+* 																 waits for the client, NULL if it is not watched
+* 				 Metrics * metrics - counters of the thread that serves the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_init(Connection * conn, int fd, int nonblocking, TimerWheel * watchdog, Metrics * metrics) {
+		int one = 1;
 
-		// send the request through the given descriptor
-		send(desc, buffer, strlen(buffer), MSG_NOSIGNAL);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: send failed.\n");
+		memset(conn, 0, sizeof(Connection));
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+				perror("setsockopt TCP_NODELAY");
 		}
+		conn->fd = fd;
+		conn->nonblocking = nonblocking;
+		conn->state = CONN_STATE_READ;
+		conn->out_buf = conn->out_inline;
+		conn->out_cap = sizeof(conn->out_inline);
+		conn->timer.data = conn;
+		conn->watchdog = watchdog;
+		conn->request_start = timer_now();
+		conn->metrics = metrics;
+		conn->accepted = metrics_clock();
+		for (int i = 0; i < LATENCY_PHASES; i++) conn->latency[i] = -1;
+		METRIC_ADD(metrics, connections, 1);
+		METRIC_ADD(metrics, active, 1);
+		PROBE1(conn_accept, fd);
+
+		/* the writes of a blocking socket are bounded by the socket itself */
+		if (nonblocking == FALSE && write_timeout > 0) socket_timeout(fd, SO_SNDTIMEO, write_timeout);
+		if (nonblocking) connection_watch(conn);
 }
 
 /*******************************************************************************************
-* FUNCTION: void send_404_not_found(int desc, int version, char * date,
-* 					char * server_signature)
-* DESCRITPTION: Sends a 404 not found reply to the through the specified descriptor given
-* 							the arguments to be written in the headers of the response
-* ARGS_IN: int desc - descriptor through where the the reply will be sent
-*					 int version - http version to be written in the header
-* 				 char * date - string containing the date to be used as the Date header
-* 				 char * server_signature - string containing the server's signature, to be
-* 																	 used as the Server header
-* ARGS_OUT: none
+* FUNCTION: void connection_idle(Connection * conn, int idle)
+* DESCRITPTION: Counts a connection as waiting for its next request, or not anymore.
+* ARGS_IN: Connection * conn - connection
+* 				 int idle - TRUE if it waits for its next request
+* ARGS_OUT: None
 *******************************************************************************************/
-void send_404_not_found(int desc, int version, char * date, char * server_signature) {
-		printf("ERROR: not found!, error 404.\n");
-
-		char buffer[LARGE_STRING_SIZE];
-		int ret;
-		char error_404[MEDIUM_STRING_SIZE] = "<html><b>404 Not Found</b></html>";
-
-		// write the request on the buffer
-		ret = sprintf(buffer, "HTTP/1.%d 404 Not Found\r\nContent-Type: text/html\r\nContent-Length: %ld"
-		              "\r\nDate: %s\r\nServer: %s\r\n\r\n%s",
-		              version, strlen(error_404), date, server_signature, error_404);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				return;
-		}
+void connection_idle(Connection * conn, int idle) {
+		if (conn->idle == idle) return;
+		conn->idle = idle;
+		METRIC_ADD(conn->metrics, idle, idle ? 1 : -1);
+}
 
-		// send the request through the given descriptor
-		send(desc, buffer, strlen(buffer), MSG_NOSIGNAL);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: send failed.\n");
+/*******************************************************************************************
+* FUNCTION: void connection_latency(Connection * conn)
+* DESCRITPTION: Counts the time taken by the phases the request just answered has gone through
+* 							in the histograms of its route, and forgets them for the next request.
+* ARGS_IN: Connection * conn - connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_latency(Connection * conn) {
+		for (int i = 0; i < LATENCY_PHASES; i++) {
+				if (conn->latency[i] >= 0) metrics_latency(conn->metrics, conn->route, i, conn->latency[i]);
+				conn->latency[i] = -1;
 		}
 }
 
 /*******************************************************************************************
-* FUNCTION: void send_500_server_error(int desc, int version, char * date,
-* 					char * server_signature)
-* DESCRITPTION: Sends a 500 server error reply to the through the specified descriptor given
-* 							the arguments to be written in the headers of the response
-* ARGS_IN: int desc - descriptor through where the the reply will be sent
-*					 int version - http version to be written in the header
-* 				 char * date - string containing the date to be used as the Date header
-* 				 char * server_signature - string containing the server's signature, to be
-* 																	 used as the Server header
-* ARGS_OUT: none
+* FUNCTION: void release_segment(OutSegment * seg)
+* DESCRITPTION: Releases the cached file or the opened file referenced by a piece of a reply.
+* ARGS_IN: OutSegment * seg - piece of the reply
+* ARGS_OUT: None
 *******************************************************************************************/
-void send_500_server_error(int desc, int version, char * date, char * server_signature) {
-		printf("ERROR: Internal server error!, sent 500 message.\n");
-
-		char buffer[LARGE_STRING_SIZE];
-		int ret;
-		char error_500[MEDIUM_STRING_SIZE] = "<html><b>500 internal server error</b></html>";
-
-		// write the request on the buffer
-		ret = sprintf(buffer, "HTTP/1.%d 500 Server Error\r\nContent-Type: text/html\r\nContent-Length: %ld"
-		              "\r\nDate: %s\r\nServer: %s\r\n\r\n%s",
-		              version, strlen(error_500), date, server_signature, error_500);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				return;
-		}
+void release_segment(OutSegment * seg) {
+		if (seg->type == OUT_SEGMENT_ENTRY) file_cache_release(seg->entry);
+		else if (seg->type == OUT_SEGMENT_FILE) fd_cache_release(seg->file);
+		seg->entry = NULL;
+		seg->file = NULL;
+}
 
-		// send the request through the given descriptor
-		send(desc, buffer, strlen(buffer), MSG_NOSIGNAL);
-		if (ret < 0) {
-				fprintf(stderr, "ERROR: send failed.\n");
+/*******************************************************************************************
+* FUNCTION: void connection_release(Connection * conn)
+* DESCRITPTION: Closes the socket of the connection and frees everything it still holds.
+* 							The Connection structure itself is not freed.
+* ARGS_IN: Connection * conn - connection to release
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_release(Connection * conn) {
+		for (int i = conn->out_seg; i < conn->out_nsegs; i++) {
+				release_segment(&conn->out_segs[i]);
 		}
-
+		conn->out_seg = conn->out_nsegs = 0;
+		if (conn->out_buf != conn->out_inline) free(conn->out_buf);
+		conn->out_buf = conn->out_inline;
+		if (conn->watchdog) timer_cancel(conn->watchdog, &conn->timer);
+		PROBE2(conn_close, conn->fd, conn->requests);
+		Close(conn->fd);
+		connection_idle(conn, FALSE);
+		METRIC_ADD(conn->metrics, active, -1);
 }
 
-
 /*******************************************************************************************
-* FUNCTION: Request* get_and_parse_request(int desc, char * date, char * server_signature)
-* DESCRITPTION: Reads a request from the descriptor, parses it and saves the information
-* 							in a Request structure.
-* ARGS_IN: int desc - descriptor through where request will be read and the the reply will be sent
-* 				 char * date - string containing the date to be used as the Date header in case of
-*												 internal server error
-* 				 char * server_signature - string containing the server's signature, to be
-* 																used as the Server header in case of internal server error
-* ARGS_OUT: Request structure containg all the important information got from the request
-*******************************************************************************************/
-Request* get_and_parse_request(int desc, char * date, char * server_signature) {
-		char buf[4096], *method, *path;
-		int pret, minor_version;
-		struct phr_header headers[100];
-		size_t buflen = 0, prevbuflen = 0, method_len, path_len, num_headers;
-		ssize_t rret;
-
-		/* parse request using picohttpparser and its example of use in github */
-		while (1) {
-				/* read the request */
-				while ((rret = read(desc, buf + buflen, sizeof(buf) - buflen)) == -1 && errno == EINTR);
-
-				if (rret == 0) {
-						// if server has read nothing it means the client has closed the connection
-						return NULL;
-				} else if (rret < 0) {
-						// if it has read a negative number of bytes there has been an error on the server
-						fprintf(stderr, "ERROR: read from descriptor returned negative number.\n");
-						send_500_server_error(desc, 1, date, server_signature);
-						return NULL;
-				}
-
-				prevbuflen = buflen;
-				buflen += rret;
-				/* parse the request */
-				num_headers = sizeof(headers) / sizeof(headers[0]);
-				pret = phr_parse_request(buf, buflen, (const char**) &method, &method_len,
-				                         (const char**) &path, &path_len, &minor_version,
-				                         headers, &num_headers, prevbuflen);
-				if (pret > 0) {
-						// successfully parsed the request, exit the loop
-						break;
-				} else if (pret == -1) {
-						// if there has been an error on phr_parse_request send a 500 message
-						fprintf(stderr, "ERROR: Error on phr_parse_request.\n");
-						send_500_server_error(desc, 1, date, server_signature);
-						return NULL;
-				}
-				// else request is incomplete, continue the loop, unless the buffer is full
-				if (buflen == sizeof(buf)) {
-						fprintf(stderr, "ERROR: Request does not fit in the buffer.\n");
-						send_500_server_error(desc, 1, date, server_signature);
-						return NULL;
-				}
+* FUNCTION: int connection_block(Connection * conn)
+* DESCRITPTION: Makes the socket of a non blocking connection blocking, while a request body or
+* 							the output of a script are streamed. In epoll mode it is only done by
+* 							the blocking threads, which serve no other connection meanwhile. As the
+* 							connection has no timer meanwhile, the reads and writes are bounded by
+* 							the body and write timeouts of the socket. connection_unblock undoes it.
+* ARGS_IN: Connection * conn - connection to block
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int connection_block(Connection * conn) {
+		if (conn->blocked == TRUE) return OK;
+		if (conn->nonblocking && fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+				perror("fcntl");
+				return ERROR;
 		}
-
-		/* allocating memory for our data structure containing the request */
-		Request* request = NULL;
-		request = calloc(1, sizeof(Request));
-		if(request == NULL) {
-				fprintf(stderr, "Error when allocating memory for request.\n");
-				send_500_server_error(desc, 1, date, server_signature);
-				return NULL;
+		conn->blocked = TRUE;
+		if ((body_timeout > 0 && socket_timeout(conn->fd, SO_RCVTIMEO, body_timeout) == ERROR) ||
+		    (conn->nonblocking && write_timeout > 0 && socket_timeout(conn->fd, SO_SNDTIMEO, write_timeout) == ERROR)) {
+				return ERROR;
 		}
+		return OK;
+}
 
-		/* save the obtained values in our data structure */
-		if (sprintf(request->method, "%.*s", (int)method_len, method) < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				free (request);
-				send_500_server_error(desc, 1, date, server_signature);
-				return NULL;
-		}
-		if (sprintf(request->path, "%.*s", (int)path_len, path) < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				free (request);
-				send_500_server_error(desc, 1, date, server_signature);
-				return NULL;
+/*******************************************************************************************
+* FUNCTION: void connection_unblock(Connection * conn)
+* DESCRITPTION: Makes non blocking again a connection blocked by connection_block.
+* ARGS_IN: Connection * conn - connection to unblock
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_unblock(Connection * conn) {
+		if (conn->blocked == FALSE) return;
+		/* the headers of the next request are bounded by the timer of the connection */
+		if (body_timeout > 0) socket_timeout(conn->fd, SO_RCVTIMEO, 0);
+		if (conn->nonblocking && fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK) < 0) {
+				perror("fcntl");
 		}
-		request->version = minor_version;
-		request->num_headers = num_headers;
-		request->length = pret;
-		request->has_args = FALSE;
-		request->connection_close = FALSE;
-
-		/* store the post and / or get arguments */
-		request->args[0] = '\0'; // in order to use strcat directly
-		if ((strcmp(request->method, "POST") == 0) || (strcmp(request->method, "GET") == 0)) {
-				// if it is a get or post request...
-				if (strcmp(request->method, "POST") == 0) {
-						if (strlen(pret+buf)) {
-								// if it is a post request and it has a body save the arguments
-								strcat(request->args, pret + buf);
-								request->has_args = TRUE;
-						} else {
-								// else post without body => send bad request
-								printf("POST without arguments, sending bad request\n");
-								free(request);
-								send_400_bad_request(desc, request->version, date, server_signature);
-								return NULL;
-						}
-				}
-				if(strstr(request->path, "?")) {
-						// if it has argument in the url, obtain then with strtok
-						char * token;
-						token = strtok(request->path, "?");
-						token = strtok(NULL, "?");
+		conn->blocked = FALSE;
+}
 
-						if (token == NULL) {
-								// if nothing after the "?" the request is incorrect
-								printf("Nothing after '?', sending bad request\n");
-								free(request);
-								send_400_bad_request(desc, request->version, date, server_signature);
-								return NULL;
-						} else {
-								// else add the arguments in the url to the request field
-								if(request->has_args) {
-										// add an intermidiate space if it is a post with body and arguments
-										strcat(request->args, " ");
-								}
-								strcat(request->args, token);
-								request->has_args = TRUE;
-						}
+/*******************************************************************************************
+* FUNCTION: int queue_response(Connection * conn, const char * data, size_t len)
+* DESCRITPTION: Appends bytes to the replies waiting to be sent through the connection. Memory
+* 							is only allocated when the replies do not fit in the buffer of the
+* 							connection.
+* ARGS_IN: Connection * conn - connection through where the bytes will be sent
+* 				 const char * data - bytes to send
+* 				 size_t len - number of bytes
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int queue_response(Connection * conn, const char * data, size_t len) {
+		OutSegment * last = conn->out_nsegs ? &conn->out_segs[conn->out_nsegs - 1] : NULL;
+
+		// bytes that follow the previous ones in the buffer go in the same piece
+		if (last == NULL || last->type != OUT_SEGMENT_BUFFER || last->offset + last->left != conn->out_len) {
+				if (conn->out_nsegs == MAX_OUT_SEGMENTS) {
+						fprintf(stderr, "ERROR: too many replies queued in the connection.\n");
+						return ERROR;
 				}
+				last = &conn->out_segs[conn->out_nsegs++];
+				memset(last, 0, sizeof(OutSegment));
+				last->type = OUT_SEGMENT_BUFFER;
+				last->offset = conn->out_len;
 		}
 
-		/* save the headers */
-		request->headers = calloc(num_headers, sizeof(Header));
-		if(request->headers == NULL) {
-				fprintf(stderr, "ERROR: error when allocaing memory for headers\n");
-				free(request);
-				send_500_server_error(desc, 1, date, server_signature);
-				return NULL;
-		}
-
-		for(int i = 0; i < num_headers; i++) {
-				sprintf(request->headers[i].name, "%.*s", (int)headers[i].name_len, headers[i].name);
-				sprintf(request->headers[i].value, "%.*s", (int)headers[i].value_len, headers[i].value);
-				request->headers[i].name_len =  (int)headers[i].name_len;
-				request->headers[i].value_len =  (int)headers[i].value_len;
-				if (strstr(request->headers[i].name, "Connection")) {
-						if (strstr(request->headers[i].value, "Close")) {
-								// if we have received a Connection: close save it
-								request->connection_close = TRUE;
-						}
+		if (conn->out_len + len > conn->out_cap) {
+				size_t cap = MAX(conn->out_cap * 2, conn->out_len + len);
+				char * tmp = conn->out_buf == conn->out_inline ? malloc(cap) : realloc(conn->out_buf, cap);
+				if (tmp == NULL) {
+						fprintf(stderr, "ERROR: error when allocating memory for the reply.\n");
+						return ERROR;
 				}
+				if (conn->out_buf == conn->out_inline) memcpy(tmp, conn->out_inline, conn->out_len);
+				conn->out_buf = tmp;
+				conn->out_cap = cap;
 		}
-
-		return request;
+		memcpy(conn->out_buf + conn->out_len, data, len);
+		conn->out_len += len;
+		last->left += len;
+		return OK;
 }
 
-
 /*******************************************************************************************
-* FUNCTION: int process_http_request(int desc, char * server_root, char * server_signature)
-* DESCRITPTION: Receive a request from the descriptor, parse it and answer it depending on
-* 							if it is a POST, GET or OPTIONS request.
-* ARGS_IN: int desc - descriptor through where request will be read and the the reply will be sent
-* 				 char * server_root - string containing the path where the server's files are stored
-* 				 char * server_signature - string containing the server's signature, to be
-* 																used as the Server header
-* ARGS_OUT: -1 in case connection has ended and 0 otherwise
+* FUNCTION: int queue_body(Connection * conn, FileCacheEntry * entry, FdCacheEntry * file,
+* 					off_t offset, size_t len)
+* DESCRITPTION: Appends the body of a file to the replies waiting to be sent through the
+* 							connection, either from the memory of a cached file or from an opened file
+* 							with sendfile. The connection takes the reference to the file, which is
+* 							released once it has been sent (or now in case of error).
+* ARGS_IN: Connection * conn - connection through where the body will be sent
+* 				 FileCacheEntry * entry - cached file to send, NULL to send an opened file
+* 				 FdCacheEntry * file - opened file to send if entry is NULL
+* 				 off_t offset - first byte of the file to send
+* 				 size_t len - number of bytes to send
+* ARGS_OUT: -1 in case of error, 0 otherwise
 *******************************************************************************************/
-int process_http_request(int desc, char * server_root, char * server_signature) {
-		char buffer[LARGE_STRING_SIZE];
-		int ret;
-		char date[SMALL_STRING_SIZE];
-		get_time(date);
+int queue_body(Connection * conn, FileCacheEntry * entry, FdCacheEntry * file, off_t offset, size_t len) {
+		OutSegment * seg;
 
-		// first of all parse the request in order to have the information correctly stored in the
-		// the data structure
-		Request *request = get_and_parse_request(desc, date, server_signature);
-		if(request == NULL) {
-				// if we have not been able to parse the request close the descriptor and inform with return
-				Close(desc);
-				return END_OF_CONNECTION;
+		if (conn->out_nsegs == MAX_OUT_SEGMENTS) {
+				fprintf(stderr, "ERROR: too many replies queued in the connection.\n");
+				if (entry) file_cache_release(entry);
+				else fd_cache_release(file);
+				return ERROR;
 		}
+		seg = &conn->out_segs[conn->out_nsegs++];
+		seg->type = entry ? OUT_SEGMENT_ENTRY : OUT_SEGMENT_FILE;
+		seg->entry = entry;
+		seg->file = entry ? NULL : file;
+		seg->offset = offset;
+		seg->left = len;
+		return OK;
+}
 
-		/* obtain the final path concatenating the server_root and the path of the request */
-		char final_file_path[MEDIUM_STRING_SIZE];
-		if (sprintf(final_file_path, "%s%s", server_root, request->path) < 0) {
-				fprintf(stderr, "ERROR: sprintf failed.\n");
-				send_500_server_error(desc, request->version, date, server_signature);
-				clean_and_close(desc, request);
-				return OK;
-		}
+/*******************************************************************************************
+* FUNCTION: int queue_pipe(Connection * conn, int fd, size_t len)
+* DESCRITPTION: Appends bytes waiting in a pipe to the replies waiting to be sent through the
+* 							connection, they are moved to the socket with splice. The pipe is not
+* 							closed, and must be kept opened till the bytes are sent.
+* ARGS_IN: Connection * conn - connection through where the bytes will be sent
+* 				 int fd - read end of the pipe
+* 				 size_t len - number of bytes to send, they must be already in the pipe
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int queue_pipe(Connection * conn, int fd, size_t len) {
+		OutSegment * seg;
 
-		/* obtain the content type using the function designed for that */
-		char content_type[SMALL_STRING_SIZE];
-		int script;
-		if((script = get_content_type(request->path, content_type)) == ERROR) {
-				printf("Not supported type of file.\n");
-				send_400_bad_request(desc, request->version, date, server_signature);
-				clean_and_close(desc, request);
-				return OK;
+		if (conn->out_nsegs == MAX_OUT_SEGMENTS) {
+				fprintf(stderr, "ERROR: too many replies queued in the connection.\n");
+				return ERROR;
 		}
+		seg = &conn->out_segs[conn->out_nsegs++];
+		memset(seg, 0, sizeof(OutSegment));
+		seg->type = OUT_SEGMENT_PIPE;
+		seg->pipe_fd = fd;
+		seg->left = len;
+		return OK;
+}
 
-		/* NON SCRIPT GET CASE */
-		if ((strcmp(request->method, "GET") == 0) && (script == NON_SCRIPT)) {
-			  /* get case and not a script */
-				printf("Received GET request!\n");
+/*******************************************************************************************
+* FUNCTION: int read_connection(Connection * conn)
+* DESCRITPTION: Reads from the socket into the input buffer of the connection. Non blocking
+* 							sockets are read till they would block, as needed by edge triggered epoll.
+* ARGS_IN: Connection * conn - connection to read from
+* ARGS_OUT: number of bytes read, 0 if the client closed the connection, CONN_WOULD_BLOCK if
+* 					there was nothing to read and -1 in case of error
+*******************************************************************************************/
+int read_connection(Connection * conn) {
+		ssize_t rret;
+		int total = 0;
+
+		while (conn->in_len < CONNECTION_BUFFER_SIZE) {
+				rret = read(conn->fd, conn->in_buf + conn->in_len, CONNECTION_BUFFER_SIZE - conn->in_len);
+				if (rret < 0) {
+						if (errno == EINTR) continue;
+						if (errno == EAGAIN || errno == EWOULDBLOCK) {
+								return total ? total : CONN_WOULD_BLOCK;
+						}
+						fprintf(stderr, "ERROR: read from descriptor returned negative number.\n");
+						return ERROR;
+				} else if (rret == 0) {
+						// the client has closed the connection, report it on the next call if something was read
+						return total;
+				}
 
+				conn->in_len += rret;
+				conn->in_buf[conn->in_len] = '\0';
+				total += rret;
+				METRIC_ADD(conn->metrics, bytes_in, rret);
 
-				if(request->has_args == TRUE) {
-						/* if it has arguments then the request is incorrect, as it should be a script */
-						printf("Get with parameters but not srcipt!\n");
-						send_400_bad_request(desc, request->version, date, server_signature);
-						clean_and_close(desc, request);
-						return OK;
-				}
+				// a blocking socket would block on the next read, go and parse what we have
+				if (conn->nonblocking == FALSE) break;
+		}
 
-				/* open the desired resource in order to be sent */
-				int file = open(final_file_path, O_RDONLY);
-				if(file == -1) {
-						/* if requested file is not oppened is because it does not exist */
-						fprintf(stderr, "ERROR: requested file not found, %s\n", final_file_path);
-						send_404_not_found(desc, request->version, date, server_signature);
-						clean_and_close(desc, request);
-						return OK;
-				}
+		return total;
+}
 
-				/* the length of the file and the last modified time are obtained */
-				long file_len;
-				char last_modified[SMALL_STRING_SIZE];
-				get_content_lenght_and_last_modified(final_file_path, &file_len, last_modified);
+/*******************************************************************************************
+* FUNCTION: int flush_blocked(Connection * conn, int progress)
+* DESCRITPTION: Tells what a send that would block means for the connection. A blocking socket
+* 							only gives EAGAIN when its write timeout expires, while a non blocking one
+* 							waits for the socket to be writable, remembering if something was sent.
+* ARGS_IN: Connection * conn - connection whose replies are sent
+* 				 int progress - TRUE if some bytes were sent before the socket got full
+* ARGS_OUT: CONN_WOULD_BLOCK if the connection must wait, -1 if it timed out
+*******************************************************************************************/
+int flush_blocked(Connection * conn, int progress) {
+		if (conn->nonblocking == FALSE || conn->blocked == TRUE) {
+				fprintf(stderr, "ERROR: timeout when sending a reply.\n");
+				return ERROR;
+		}
+		if (progress) conn->last_progress = timer_now();
+		return CONN_WOULD_BLOCK;
+}
 
-				/* the request headers are sent with the previously obtained information */
-				send_200_ok(desc, request->version, content_type, file_len, date, last_modified, server_signature);
+/*******************************************************************************************
+* FUNCTION: int flush_connection(Connection * conn)
+* DESCRITPTION: Sends the pending replies of the connection, piece by piece. Consecutive pieces
+* 							in memory (headers and cached bodies, of one or several pipelined replies)
+* 							go together in a single sendmsg, while opened files are sent with sendfile
+* 							and pipes with splice so that their contents never go through userspace.
+* 							When a file or a pipe follows, the pieces are sent with MSG_MORE so that
+* 							the headers leave in the same packets as the beginning of the file. Partial sends are remembered so the
+* 							replies can be resumed when the socket is writable again.
+* ARGS_IN: Connection * conn - connection whose replies are sent
+* ARGS_OUT: 0 when everything has been sent, CONN_WOULD_BLOCK if the socket is full and -1 in
+* 					case of error
+*******************************************************************************************/
+int flush_connection(Connection * conn) {
+		struct iovec iov[MAX_OUT_SEGMENTS];
+		struct msghdr msg;
+		ssize_t ret;
+		int n, progress = FALSE;
+
+		while (conn->out_seg < conn->out_nsegs) {
+				OutSegment * seg = &conn->out_segs[conn->out_seg];
+
+				/* pieces completely sent are released */
+				if (seg->left == 0) {
+						release_segment(seg);
+						conn->out_seg++;
+						continue;
+				}
 
-				/* the contents of the file are sent */
-				while ((ret = read(file, buffer, LARGE_STRING_SIZE)) > 0) {
-						if (send(desc, buffer, ret, MSG_NOSIGNAL) == -1) {
-								perror("send");
-								fprintf(stderr, "ERROR: send failed.\n");
+				if (seg->type == OUT_SEGMENT_FILE) {
+						/* the file, from the offset where the previous call stopped */
+						ret = sendfile(conn->fd, seg->file->fd, &seg->offset, seg->left);
+						if (ret < 0) {
+								if (errno == EINTR) continue;
+								if (errno == EAGAIN || errno == EWOULDBLOCK) return flush_blocked(conn, progress);
+								perror("sendfile");
+								return ERROR;
+						} else if (ret == 0) {
+								// the file is shorter than the announced Content-Length, the reply cannot be completed
+								fprintf(stderr, "ERROR: file shrank while it was being sent.\n");
+								return ERROR;
 						}
+						seg->left -= ret;
+						progress = TRUE;
+						METRIC_ADD(conn->metrics, bytes_out, ret);
+						conn->sent += ret;
+						continue;
 				}
 
-				/* the file descriptor is closed */
-				Close(file);
-
-
-		/* SCRIPT CASE: GET OR POST */
-		} else if (((strcmp(request->method, "POST") == 0) || (strcmp(request->method, "GET") == 0)) &&
-		           ((script == PHP_SCRIPT) || (script == PYTHON_SCRIPT))) {
-
-				/* the file in the url is a script and the method is get or post */
-				printf("Received POST request or GET with args!\n");
-
-				if(script == PHP_SCRIPT) {
-						/* if it is a php write in the buffer the command to be executed by popen */
-						if (sprintf(buffer, "php %s %s", final_file_path, request->args) < 0) {
-								fprintf(stderr, "ERROR: sprintf failed.\n");
-								send_500_server_error(desc, request->version, date, server_signature);
-								clean_and_close(desc, request);
-								return OK;
-						}
-				} else if (script == PYTHON_SCRIPT) {
-						/* if it is a python write in the buffer the command to be executed by popen */
-						if (sprintf(buffer, "python %s %s", final_file_path, request->args) < 0) {
-								fprintf(stderr, "ERROR: sprintf failed.\n");
-								send_500_server_error(desc, request->version, date, server_signature);
-								clean_and_close(desc, request);
-								return OK;
+				if (seg->type == OUT_SEGMENT_PIPE) {
+						/* the bytes of the pipe, moved to the socket inside the kernel */
+						ret = splice(seg->pipe_fd, NULL, conn->fd, NULL, seg->left,
+						             SPLICE_F_MOVE | (conn->out_seg + 1 < conn->out_nsegs ? SPLICE_F_MORE : 0));
+						if (ret < 0) {
+								if (errno == EINTR) continue;
+								if (errno == EAGAIN || errno == EWOULDBLOCK) return flush_blocked(conn, progress);
+								perror("splice");
+								return ERROR;
+						} else if (ret == 0) {
+								fprintf(stderr, "ERROR: pipe closed while it was being sent.\n");
+								return ERROR;
 						}
+						seg->left -= ret;
+						progress = TRUE;
+						METRIC_ADD(conn->metrics, bytes_out, ret);
+						conn->sent += ret;
+						continue;
 				}
 
-				char script_output[LARGE_STRING_SIZE];
-				/* clean the buffer from previous executions */
-				memset(script_output, 0, LARGE_STRING_SIZE);
-
-				/* execute the script with the arguments parsed from the request */
-				FILE* pipe_desc = popen(buffer, "r");
-				if(pipe_desc == NULL) {
-						perror("popen");
-						pclose(pipe_desc);
-						fprintf(stderr, "ERROR: error when creating the pipe\n");
-						send_500_server_error(desc, request->version, date, server_signature);
-						clean_and_close(desc, request);
-						return OK;
+				/* the pieces in memory till the next file or pipe */
+				for (n = 0; conn->out_seg + n < conn->out_nsegs; n++) {
+						OutSegment * s = &conn->out_segs[conn->out_seg + n];
+						if (s->type == OUT_SEGMENT_FILE || s->type == OUT_SEGMENT_PIPE) break;
+						iov[n].iov_base = (s->type == OUT_SEGMENT_ENTRY ? s->entry->body : conn->out_buf) + s->offset;
+						iov[n].iov_len = s->left;
+				}
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = n;
+				ret = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (conn->out_seg + n < conn->out_nsegs ? MSG_MORE : 0));
+				if (ret < 0) {
+						if (errno == EINTR) continue;
+						if (errno == EAGAIN || errno == EWOULDBLOCK) return flush_blocked(conn, progress);
+						perror("sendmsg");
+						return ERROR;
 				}
 
-				/* read the output of the script into another buffer, script_output */
-				ret = fread(script_output, 1, LARGE_STRING_SIZE, pipe_desc);
-				if(ret < 0 || strlen(script_output) == 0) {
-						perror("fread");
-						pclose(pipe_desc);
-						fprintf(stderr, "ERROR: error when reading the output of the script!\n");
-						send_500_server_error(desc, request->version, date, server_signature);
-						clean_and_close(desc, request);
-						return OK;
+				/* move forward the pieces sent, the last one may have been sent partially */
+				progress = progress || ret > 0;
+				METRIC_ADD(conn->metrics, bytes_out, ret);
+				conn->sent += ret;
+				for (int i = conn->out_seg; ret > 0; i++) {
+						size_t sent = MIN((size_t)ret, conn->out_segs[i].left);
+						conn->out_segs[i].offset += sent;
+						conn->out_segs[i].left -= sent;
+						ret -= sent;
 				}
+		}
 
-				/* descriptor no longer needed */
-				pclose(pipe_desc);
+		/* everything queued is sent, a buffer allocated for big replies is released so that idle
+		connections take little memory */
+		conn->out_seg = conn->out_nsegs = 0;
+		if (conn->out_buf != conn->out_inline) {
+				free(conn->out_buf);
+				conn->out_buf = conn->out_inline;
+				conn->out_cap = sizeof(conn->out_inline);
+		}
+		conn->out_len = 0;
 
-				/* Obtain the last modified of the script, the file_len won't be used */
-				long file_len;
-				char last_modified[SMALL_STRING_SIZE];
-				get_content_lenght_and_last_modified(final_file_path, &file_len, last_modified);
+		return OK;
+}
 
-				/* send the response headers to the client */
-				send_200_ok(desc, request->version, content_type, strlen(script_output), date, last_modified, server_signature);
+/*******************************************************************************************
+* FUNCTION: int template_init(HttpTemplate * t, const char * format, ...)
+* DESCRITPTION: Serializes a reply, or its first lines, into a template. The reply must start
+* 							with "HTTP/1.1" and contain a Date header with HTTP_DATE_PLACEHOLDER as
+* 							value, which are replaced on every request.
+* ARGS_IN: HttpTemplate * t - template to build
+* 				 const char * format - printf format of the reply
+* 				 ... - arguments of the format
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int template_init(HttpTemplate * t, const char * format, ...) {
+		va_list args;
+		int len;
+
+		va_start(args, format);
+		len = vasprintf(&t->data, format, args);
+		va_end(args);
+		if (len < 0) {
+				fprintf(stderr, "ERROR: error when allocating memory for the replies.\n");
+				return ERROR;
+		}
+		t->len = len;
+		t->version_offset = strlen("HTTP/1.");
+		t->date_offset = strstr(t->data, "\r\nDate: ") + strlen("\r\nDate: ") - t->data;
+		t->code = atoi(t->data + strlen("HTTP/1.1 "));
+		t->status = metrics_status(t->code);
+		return OK;
+}
 
-				/* send the output of the script to the client */
-				if (send(desc, script_output, strlen(script_output), MSG_NOSIGNAL)  == -1) {
-						perror("send");
-						fprintf(stderr, "ERROR: send failed.\n");
+/*******************************************************************************************
+* FUNCTION: int http_init(char * server_signature, long body_size)
+* DESCRITPTION: Builds once the constant part of the replies: status lines, error bodies and
+* 							the Server and Allow headers, so that each request only writes the version,
+* 							the date and the length. Must be called before the threads are created.
+* ARGS_IN: char * server_signature - string containing the server's signature, to be used as
+* 																	 the Server header
+* 				 long body_size - maximum size of the body of a request
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int http_init(char * server_signature, long body_size) {
+		struct { HttpTemplate * t; char * status; char * body; } errors[] = {
+				{&reply_400, "400 Bad Request", "<html><b>400 Bad Request</b></html>"},
+				{&reply_404, "404 Not Found", "<html><b>404 Not Found</b></html>"},
+				{&reply_413, "413 Payload Too Large", "<html><b>413 Payload Too Large</b></html>"},
+				{&reply_431, "431 Request Header Fields Too Large", "<html><b>431 Request Header Fields Too Large</b></html>"},
+				{&reply_500, "500 Server Error", "<html><b>500 internal server error</b></html>"},
+		};
+
+		max_body_size = body_size;
+
+		/* error replies are complete, body included */
+		for (int i = 0; i < sizeof(errors) / sizeof(errors[0]); i++) {
+				if (template_init(errors[i].t, "HTTP/1.1 %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n"
+				                  "Date: " HTTP_DATE_PLACEHOLDER "\r\nServer: %s\r\n\r\n%s", errors[i].status,
+				                  strlen(errors[i].body), server_signature, errors[i].body) == ERROR) {
+						return ERROR;
 				}
+		}
 
+		if (template_init(&reply_options, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nDate: " HTTP_DATE_PLACEHOLDER
+		                  "\r\nServer: %s\r\nAllow: GET, POST, OPTIONS\r\n\r\n", server_signature) == ERROR) {
+				return ERROR;
+		}
 
-
-		/* OPTIONS CASE */
-		} else if (strcmp(request->method, "OPTIONS") == 0) {
-				printf("Received OPTIONS request!\n");
-				/* if treceived an options request answer appropiately */
-				send_200_ok_options(desc, request->version, date, server_signature);
-
-		} else {
-				printf("Unknown type of request!, %s\n", request->method);
-				/* if the request is not a GET POST or OPTIONS then or the request is not
-				well formed or the server cannot understand it, either way send a bad
-				request reply */
-				send_400_bad_request(desc, request->version, date, server_signature);
+		/* the rest of the headers of a 200 depend on the file, the cached files already have the Server header */
+		if (template_init(&reply_200, "HTTP/1.1 200 OK\r\nDate: " HTTP_DATE_PLACEHOLDER "\r\nServer: %s\r\n",
+		                  server_signature) == ERROR ||
+		    template_init(&reply_200_cached, "HTTP/1.1 200 OK\r\nDate: " HTTP_DATE_PLACEHOLDER "\r\n") == ERROR ||
+		    template_init(&reply_304, "HTTP/1.1 304 Not Modified\r\nDate: " HTTP_DATE_PLACEHOLDER "\r\nServer: %s\r\n",
+		                  server_signature) == ERROR ||
+		    template_init(&reply_206, "HTTP/1.1 206 Partial Content\r\nDate: " HTTP_DATE_PLACEHOLDER "\r\nServer: %s\r\n"
+		                  "Accept-Ranges: bytes\r\n", server_signature) == ERROR ||
+		    template_init(&reply_416, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\nDate: " HTTP_DATE_PLACEHOLDER
+		                  "\r\nServer: %s\r\n", server_signature) == ERROR) {
+				return ERROR;
 		}
 
-		/* clean the Request structure and close the descriptor if connection close */
-		clean_and_close(desc, request);
+		/* the boundaries of the multipart replies must not be guessed from the files sent */
+		srandom(time(NULL) ^ getpid());
+		last_boundary = ((unsigned long) random() << 32) ^ random();
+		return OK;
+}
 
+/*******************************************************************************************
+* FUNCTION: int queue_template(Connection * conn, HttpTemplate * t, int version, char * date)
+* DESCRITPTION: Queues a reply built by http_init, writing in it the version and the date, and
+* 							counts its status code. Every reply starts with one of them.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 HttpTemplate * t - reply to send
+*					 int version - http version to be written in the status line
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int queue_template(Connection * conn, HttpTemplate * t, int version, char * date) {
+		char * reply;
+
+		if (queue_response(conn, t->data, t->len) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+				return ERROR;
+		}
+		reply = conn->out_buf + conn->out_len - t->len;
+		reply[t->version_offset] = '0' + version;
+		memcpy(reply + t->date_offset, date, HTTP_DATE_SIZE);
+		METRIC_ADD(conn->metrics, responses[t->status], 1);
+		if (t->code >= 400) conn->route = ROUTE_ERROR;
+		conn->status = t->code;
 		return OK;
 }
+
+/*******************************************************************************************
+* FUNCTION: char * append_long(char * s, long n)
+* DESCRITPTION: Writes a non negative number in decimal, without the cost of printf.
+* ARGS_IN: char * s - where the number is written
+* 				 long n - number to write
+* ARGS_OUT: pointer to the byte after the number
+*******************************************************************************************/
+char * append_long(char * s, long n) {
+		char digits[TINY_STRING_SIZE];
+		int i = 0;
+
+		do {
+				digits[i++] = '0' + n % 10;
+				n /= 10;
+		} while (n > 0);
+		while (i > 0) *s++ = digits[--i];
+		return s;
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_200_ok(Connection * conn, int version, char * content_type, long content_len,
+*						char * date, char * etag, char * last_modified, char * extra_headers)
+* DESCRITPTION: Sends a 200 OK reply to the through the specified descriptor given the
+* 							arguments to be written in the headers of the response. The status line and
+* 							the Server header come from the template built by http_init.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * content_type - content type to be witten in the Content-Type header
+* 				 long content_len - length of the file, to be witten in the Content-Length header.
+* 														-1 if it is not known: the body is sent in chunks in http/1.1
+* 														and till the connection is closed in http/1.0
+* 				 char * date - string containing the date to be used as the Date header
+* 				 char * etag - ETag of the file, NULL for the output of scripts
+* 				 char * last_modified - string containing the date of the last modification,
+* 																to be used as the Last-Modified header
+* 				 char * extra_headers - more headers, each one ended by "\r\n"
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_200_ok(Connection * conn, int version, char * content_type, long content_len, char * date, char * etag, char * last_modified, char * extra_headers) {
+		char buffer[MEDIUM_STRING_SIZE], *p = buffer;
+
+		// the headers that depend on the file go after the template
+		p = stpcpy(p, "Content-Type: ");
+		p = stpcpy(p, content_type);
+		if (content_len >= 0) {
+				p = stpcpy(p, "\r\nContent-Length: ");
+				p = append_long(p, content_len);
+				p = stpcpy(p, "\r\nAccept-Ranges: bytes");
+		} else if (version == 1) {
+				p = stpcpy(p, "\r\nTransfer-Encoding: chunked");
+		}
+		if (etag) {
+				p = stpcpy(p, "\r\nETag: ");
+				p = stpcpy(p, etag);
+		}
+		p = stpcpy(p, "\r\nLast-Modified: ");
+		p = stpcpy(p, last_modified);
+		p = stpcpy(p, "\r\n");
+		p = stpcpy(p, extra_headers);
+		p = stpcpy(p, "\r\n");
+
+		// queue the reply in the given connection
+		if (queue_template(conn, &reply_200, version, date) == ERROR || queue_response(conn, buffer, p - buffer) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_200_ok_cached(Connection * conn, int version, char * date,
+* 					FileCacheEntry * entry)
+* DESCRITPTION: Sends a 200 OK reply with the body of a cached file. Only the status line and
+* 							the Date header are written, the rest of the headers are already in the
+* 							entry. The connection takes the reference to the entry.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* 				 FileCacheEntry * entry - cached file to send
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_200_ok_cached(Connection * conn, int version, char * date, FileCacheEntry * entry) {
+		// write the status line and the date, the rest comes from the entry
+		if (queue_template(conn, &reply_200_cached, version, date) == ERROR ||
+		    queue_response(conn, entry->headers, entry->headers_len) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+		}
+
+		// the body is sent from the memory of the entry by flush_connection
+		queue_body(conn, entry, NULL, 0, entry->size);
+}
+
+/*******************************************************************************************
+* FUNCTION: int parse_ranges(Slice header, long size, ByteRange * ranges)
+* DESCRITPTION: Parses the value of a Range header ("bytes=0-99,200-,-50") for a file of the
+* 							given size. Ranges that go past the end of the file are cut, and the ones
+* 							that start after it are left out. A header that cannot be understood, that
+* 							has more than MAX_RANGES ranges or whose ranges overlap is ignored, as the
+* 							whole file is a valid answer to any Range header.
+* ARGS_IN: Slice header - value of the Range header
+* 				 long size - size of the file
+* 				 ByteRange * ranges - array of MAX_RANGES where the ranges are written
+* ARGS_OUT: number of ranges, 0 if the header must be ignored and -1 if no range is satisfiable
+*******************************************************************************************/
+int parse_ranges(Slice header, long size, ByteRange * ranges) {
+		const char * p = header.ptr, * end = header.ptr + header.len;
+		int n = 0, specs = 0;
+
+		if (header.len < strlen("bytes=") || !slice_case_equals(p, strlen("bytes="), "bytes=")) return 0;
+		p += strlen("bytes=");
+
+		while (p < end) {
+				long first = -1, last = -1;
+
+				/* each range is "first-last", "first-" or "-suffix", separated by commas */
+				while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+				if (p == end) break;
+				if (isdigit(*p)) {
+						for (first = 0; p < end && isdigit(*p); p++) {
+								if (first > (LONG_MAX - 9) / 10) return 0;
+								first = first * 10 + (*p - '0');
+						}
+				}
+				if (p == end || *p != '-') return 0;
+				p++;
+				if (p < end && isdigit(*p)) {
+						for (last = 0; p < end && isdigit(*p); p++) {
+								if (last > (LONG_MAX - 9) / 10) return 0;
+								last = last * 10 + (*p - '0');
+						}
+				}
+				while (p < end && (*p == ' ' || *p == '\t')) p++;
+				if ((p < end && *p != ',') || (first == -1 && last == -1) || (first != -1 && last != -1 && last < first)) {
+						return 0;
+				}
+				if (++specs > MAX_RANGES) return 0;
+
+				if (first == -1) {
+						/* the last bytes of the file */
+						if (last == 0 || size == 0) continue;
+						first = MAX(size - last, 0);
+						last = size - 1;
+				} else {
+						if (first >= size) continue;
+						if (last == -1 || last >= size) last = size - 1;
+				}
+				for (int i = 0; i < n; i++) {
+						if (first < ranges[i].start + ranges[i].len && ranges[i].start <= last) return 0;
+				}
+				ranges[n].start = first;
+				ranges[n].len = last - first + 1;
+				n++;
+		}
+
+		if (specs == 0) return 0;
+		return n ? n : ERROR;
+}
+
+/*******************************************************************************************
+* FUNCTION: char * append_part_header(char * p, unsigned long boundary, char * content_type,
+* 					ByteRange * range, long size)
+* DESCRITPTION: Writes the boundary and the headers of a part of a multipart/byteranges reply.
+* ARGS_IN: char * p - where the headers are written
+* 				 unsigned long boundary - number of the boundary of the reply
+* 				 char * content_type - type of the file
+* 				 ByteRange * range - range of the file sent in the part
+* 				 long size - size of the file
+* ARGS_OUT: pointer to the byte after the headers
+*******************************************************************************************/
+char * append_part_header(char * p, unsigned long boundary, char * content_type, ByteRange * range, long size) {
+		p += sprintf(p, "\r\n--%016lx\r\nContent-Type: ", boundary);
+		p = stpcpy(p, content_type);
+		p = stpcpy(p, "\r\nContent-Range: bytes ");
+		p = append_long(p, range->start);
+		*p++ = '-';
+		p = append_long(p, range->start + range->len - 1);
+		*p++ = '/';
+		p = append_long(p, size);
+		return stpcpy(p, "\r\n\r\n");
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_206_partial_content(Connection * conn, int version, char * content_type,
+* 					char * date, char * etag, char * last_modified, char * extra_headers, long size,
+* 					ByteRange * ranges, int n, FileCacheEntry * entry, FdCacheEntry * file)
+* DESCRITPTION: Sends a 206 Partial Content reply with some ranges of a file. A single range is
+* 							sent as the body with a Content-Range header, several ones as the parts of
+* 							a multipart/byteranges body. The bytes of each range are pieces of the
+* 							reply pointing into the cached file or the opened file, so they are sent
+* 							from memory or with sendfile from their offset, without being copied. The
+* 							connection takes the reference to the file.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * content_type - type of the file
+* 				 char * date - string containing the date to be used as the Date header
+* 				 char * etag - ETag of the file
+* 				 char * last_modified - string containing the date of the last modification
+* 				 char * extra_headers - more headers of the file, each one ended by "\r\n"
+* 				 long size - size of the file
+* 				 ByteRange * ranges - ranges to send
+* 				 int n - number of ranges
+* 				 FileCacheEntry * entry - cached file to send, NULL to send an opened file
+* 				 FdCacheEntry * file - opened file to send if entry is NULL
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_206_partial_content(Connection * conn, int version, char * content_type, char * date, char * etag,
+                              char * last_modified, char * extra_headers, long size, ByteRange * ranges, int n, FileCacheEntry * entry, FdCacheEntry * file) {
+		char buffer[MEDIUM_STRING_SIZE], parts[MAX_RANGES][SMALL_STRING_SIZE + TINY_STRING_SIZE * 4];
+		char closing[TINY_STRING_SIZE + 1], *p = buffer;
+		size_t part_len[MAX_RANGES], closing_len = 0;
+		unsigned long boundary = 0;
+		long content_len = 0;
+
+		if (n == 1) {
+				content_len = ranges[0].len;
+		} else {
+				/* the length of the body is known before sending it, headers of the parts included */
+				boundary = __atomic_add_fetch(&last_boundary, 1, __ATOMIC_RELAXED);
+				for (int i = 0; i < n; i++) {
+						part_len[i] = append_part_header(parts[i], boundary, content_type, &ranges[i], size) - parts[i];
+						content_len += part_len[i] + ranges[i].len;
+				}
+				closing_len = sprintf(closing, "\r\n--%016lx--\r\n", boundary);
+				content_len += closing_len;
+		}
+
+		if (n == 1) {
+				p = stpcpy(p, "Content-Type: ");
+				p = stpcpy(p, content_type);
+				p = stpcpy(p, "\r\nContent-Range: bytes ");
+				p = append_long(p, ranges[0].start);
+				*p++ = '-';
+				p = append_long(p, ranges[0].start + ranges[0].len - 1);
+				*p++ = '/';
+				p = append_long(p, size);
+		} else {
+				p += sprintf(p, "Content-Type: multipart/byteranges; boundary=%016lx", boundary);
+		}
+		p = stpcpy(p, "\r\nContent-Length: ");
+		p = append_long(p, content_len);
+		p = stpcpy(p, "\r\nETag: ");
+		p = stpcpy(p, etag);
+		p = stpcpy(p, "\r\nLast-Modified: ");
+		p = stpcpy(p, last_modified);
+		p = stpcpy(p, "\r\n");
+		p = stpcpy(p, extra_headers);
+		p = stpcpy(p, "\r\n");
+
+		if (queue_template(conn, &reply_206, version, date) == ERROR || queue_response(conn, buffer, p - buffer) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+		}
+
+		/* each piece of the body holds its own reference to the file */
+		for (int i = 0; i < n; i++) {
+				if (i > 0) {
+						if (entry) file_cache_retain(entry);
+						else fd_cache_retain(file);
+				}
+				if (n > 1) queue_response(conn, parts[i], part_len[i]);
+				queue_body(conn, entry, file, ranges[i].start, ranges[i].len);
+		}
+		if (n > 1) queue_response(conn, closing, closing_len);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_416_range_not_satisfiable(Connection * conn, int version, char * date,
+* 					long size)
+* DESCRITPTION: Sends a 416 Range Not Satisfiable reply, telling the size of the file in the
+* 							Content-Range header.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* 				 long size - size of the file
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_416_range_not_satisfiable(Connection * conn, int version, char * date, long size) {
+		char buffer[SMALL_STRING_SIZE], *p = buffer;
+
+		p = stpcpy(p, "Content-Range: bytes */");
+		p = append_long(p, size);
+		p = stpcpy(p, "\r\n\r\n");
+		if (queue_template(conn, &reply_416, version, date) == ERROR || queue_response(conn, buffer, p - buffer) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int send_range(Connection * conn, Request * request, char * content_type,
+* 					char * extra_headers, char * date, FileCacheEntry * entry, FdCacheEntry * file)
+* DESCRITPTION: Answers a request with a Range header with the ranges of the file it asks for.
+* 							With an If-Range header the ranges are only sent if the file has not
+* 							changed, its value being the ETag or the Last-Modified of the file,
+* 							otherwise the whole file is. The start of the ranges of files sent
+* 							with sendfile is read in advance, as they do not follow the previous reads.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+* 				 Request * request - request to answer
+* 				 char * content_type - type of the file
+* 				 char * extra_headers - more headers of the file, each one ended by "\r\n"
+* 				 char * date - string containing the date to be used as the Date header
+* 				 FileCacheEntry * entry - cached file, NULL to use the opened file
+* 				 FdCacheEntry * file - opened file if entry is NULL
+* ARGS_OUT: TRUE if the request was answered, taking the reference to the file, and FALSE if
+* 					the whole file must be sent
+*******************************************************************************************/
+int send_range(Connection * conn, Request * request, char * content_type, char * extra_headers, char * date, FileCacheEntry * entry, FdCacheEntry * file) {
+		char * last_modified = entry ? entry->last_modified : file->last_modified;
+		char * etag = entry ? entry->etag : file->etag;
+		long size = entry ? entry->size : file->size;
+		ByteRange ranges[MAX_RANGES];
+		int n;
+
+		if (request->range.len == 0) return FALSE;
+		if (request->if_range.len && !slice_equals(request->if_range, last_modified) && !slice_equals(request->if_range, etag)) {
+				return FALSE;
+		}
+		if ((n = parse_ranges(request->range, size, ranges)) == 0) return FALSE;
+
+		if (n == ERROR) {
+				send_416_range_not_satisfiable(conn, request->version, date, size);
+				if (entry) file_cache_release(entry);
+				else fd_cache_release(file);
+				return TRUE;
+		}
+
+		for (int i = 0; entry == NULL && i < n; i++) {
+				if (ranges[i].start > 0) {
+						posix_fadvise(file->fd, ranges[i].start, MIN(ranges[i].len, RANGE_READAHEAD), POSIX_FADV_WILLNEED);
+				}
+		}
+		send_206_partial_content(conn, request->version, content_type, date, etag, last_modified, extra_headers, size, ranges, n, entry, file);
+		return TRUE;
+}
+
+/*******************************************************************************************
+* FUNCTION: int etag_list_matches(Slice list, const char * etag)
+* DESCRITPTION: Looks for an ETag in the value of an If-None-Match header, a list of entity tags
+* 							separated by commas or "*". The comparison is weak, as If-None-Match asks
+* 							for it: W/ in front of a tag is ignored.
+* ARGS_IN: Slice list - value of the header
+* 				 const char * etag - ETag of the file, quotes included
+* ARGS_OUT: TRUE if the ETag is in the list, FALSE otherwise
+*******************************************************************************************/
+int etag_list_matches(Slice list, const char * etag) {
+		const char * p = list.ptr, * end = list.ptr + list.len, * tag;
+		size_t etag_len = strlen(etag);
+
+		while (p < end) {
+				while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+				if (p == end) break;
+				if (*p == '*') return TRUE;
+				if (end - p > 2 && p[0] == 'W' && p[1] == '/') p += 2;
+				// the tag goes till its closing quote
+				tag = p;
+				if (p < end && *p == '"') {
+						for (p++; p < end && *p != '"'; p++);
+						if (p < end) p++;
+				}
+				if (p - tag == etag_len && memcmp(tag, etag, etag_len) == 0) return TRUE;
+				while (p < end && *p != ',') p++;
+		}
+		return FALSE;
+}
+
+/*******************************************************************************************
+* FUNCTION: int not_modified(Request * request, const char * etag, time_t mtime,
+* 					const char * last_modified)
+* DESCRITPTION: Checks the conditional headers of a GET of a file that the client may already
+* 							have. If-None-Match is used when it is present, and If-Modified-Since
+* 							otherwise. Clients usually send back the Last-Modified they received, which
+* 							is compared as it is before parsing the date.
+* ARGS_IN: Request * request - request received
+* 				 const char * etag - ETag of the file
+* 				 time_t mtime - modification time of the file
+* 				 const char * last_modified - Last-Modified of the file
+* ARGS_OUT: TRUE if the file has not changed for the client, FALSE otherwise
+*******************************************************************************************/
+int not_modified(Request * request, const char * etag, time_t mtime, const char * last_modified) {
+		char since[SMALL_STRING_SIZE];
+		struct tm tm;
+
+		if (request->if_none_match.len) {
+				return etag_list_matches(request->if_none_match, etag);
+		}
+		if (request->if_modified_since.len == 0 || request->if_modified_since.len >= sizeof(since)) {
+				return FALSE;
+		}
+		if (slice_equals(request->if_modified_since, last_modified)) {
+				return TRUE;
+		}
+
+		memcpy(since, request->if_modified_since.ptr, request->if_modified_since.len);
+		since[request->if_modified_since.len] = '\0';
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(since, HTTP_DATE_FORMAT, &tm) == NULL) {
+				return FALSE;
+		}
+		return mtime <= timegm(&tm);
+}
+
+/*******************************************************************************************
+* FUNCTION: int send_not_modified(Connection * conn, Request * request, char * extra_headers,
+* 					char * date, FileCacheEntry * entry, FdCacheEntry * file)
+* DESCRITPTION: Answers a conditional GET with 304 Not Modified, without a body, if the file has
+* 							not changed for the client. Everything needed is in the entry of the cache,
+* 							so the file is not touched.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+* 				 Request * request - request to answer
+* 				 char * extra_headers - more headers of the file, each one ended by "\r\n"
+* 				 char * date - string containing the date to be used as the Date header
+* 				 FileCacheEntry * entry - cached file, NULL to use the opened file
+* 				 FdCacheEntry * file - opened file if entry is NULL
+* ARGS_OUT: TRUE if the request was answered, releasing the reference to the file, and FALSE
+* 					otherwise
+*******************************************************************************************/
+int send_not_modified(Connection * conn, Request * request, char * extra_headers, char * date, FileCacheEntry * entry, FdCacheEntry * file) {
+		char * etag = entry ? entry->etag : file->etag;
+		char buffer[SMALL_STRING_SIZE], *p = buffer;
+
+		if (request->if_none_match.len == 0 && request->if_modified_since.len == 0) return FALSE;
+		if (!not_modified(request, etag, entry ? entry->mtime : file->mtime, entry ? entry->last_modified : file->last_modified)) {
+				return FALSE;
+		}
+
+		p = stpcpy(p, "ETag: ");
+		p = stpcpy(p, etag);
+		p = stpcpy(p, "\r\n");
+		p = stpcpy(p, extra_headers);
+		p = stpcpy(p, "\r\n");
+		if (queue_template(conn, &reply_304, request->version, date) == ERROR || queue_response(conn, buffer, p - buffer) == ERROR) {
+				fprintf(stderr, "ERROR: send failed.\n");
+		}
+		if (entry) file_cache_release(entry);
+		else fd_cache_release(file);
+		return TRUE;
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_200_ok_options(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 200 OK, options reply to the through the specified descriptor. The allow
+* 							header is always "Allow: GET, POST, OPTIONS".
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_200_ok_options(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_options, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_400_bad_request(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 400 bad request reply to the through the specified descriptor.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_400_bad_request(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_400, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_404_not_found(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 404 not found reply to the through the specified descriptor.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_404_not_found(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_404, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_413_payload_too_large(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 413 payload too large reply, to a request whose body is bigger than the
+* 							max_body_size of the configuration.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_413_payload_too_large(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_413, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_431_header_too_large(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 431 request header fields too large reply, to a request whose headers
+* 							do not fit in the input buffer.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_431_header_too_large(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_431, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_500_server_error(Connection * conn, int version, char * date)
+* DESCRITPTION: Sends a 500 server error reply to the through the specified descriptor.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+*					 int version - http version to be written in the header
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_500_server_error(Connection * conn, int version, char * date) {
+		queue_template(conn, &reply_500, version, date);
+}
+
+/*******************************************************************************************
+* FUNCTION: char * append_hex(char * s, size_t n)
+* DESCRITPTION: Writes a number in hexadecimal, as the sizes of the chunks are written.
+* ARGS_IN: char * s - where the number is written
+* 				 size_t n - number to write
+* ARGS_OUT: pointer to the byte after the number
+*******************************************************************************************/
+char * append_hex(char * s, size_t n) {
+		char digits[TINY_STRING_SIZE];
+		int i = 0;
+
+		do {
+				digits[i++] = "0123456789abcdef"[n % 16];
+				n /= 16;
+		} while (n > 0);
+		while (i > 0) *s++ = digits[--i];
+		return s;
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_reply_begin(ScriptReply * reply, size_t len)
+* DESCRITPTION: Queues what goes before the next len bytes of output of a script: the headers,
+* 							with the first ones, and in http/1.1 the size of the chunk. The "\r\n"
+* 							that ends a chunk is sent in front of the next one, so that each chunk
+* 							leaves in a single write. The socket is made blocking while the output is
+* 							sent.
+* ARGS_IN: ScriptReply * reply - reply of the script
+* 				 size_t len - number of bytes of output that follow
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int script_reply_begin(ScriptReply * reply, size_t len) {
+		char buffer[TINY_STRING_SIZE], *p = buffer;
+		Connection * conn = reply->conn;
+
+		if (reply->sent == 0) {
+				if (connection_block(conn) == ERROR) return ERROR;
+				send_200_ok(conn, reply->request->version, reply->content_type, -1, reply->date, NULL, reply->last_modified, reply->extra_headers);
+		}
+		if (reply->request->version == 1) {
+				if (reply->sent > 0) p = stpcpy(p, "\r\n");
+				p = append_hex(p, len);
+				p = stpcpy(p, "\r\n");
+				if (queue_response(conn, buffer, p - buffer) == ERROR) return ERROR;
+		}
+		reply->sent += len;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_reply_queue(void * arg, const char * data, size_t len)
+* DESCRITPTION: Queues bytes of the body of the reply of a script, as they are sent to the
+* 							client, in a new chunk.
+* ARGS_IN: void * arg - ScriptReply of the script
+* 				 const char * data - bytes of the body
+* 				 size_t len - number of bytes
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int script_reply_queue(void * arg, const char * data, size_t len) {
+		ScriptReply * reply = arg;
+
+		if (len == 0) return OK;
+		if (script_reply_begin(reply, len) == ERROR || queue_response(reply->conn, data, len) == ERROR) {
+				return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_reply_write(void * arg, const char * data, size_t len)
+* DESCRITPTION: Queues bytes of output of a script that are in memory, they are sent on the
+* 							next flush. If the reply is compressed they go through zlib, which gives
+* 							its output in pieces of COMPRESSION_BUFFER_SIZE. Used as ScriptOutput.
+* ARGS_IN: void * arg - ScriptReply of the script
+* 				 const char * data - bytes of output
+* 				 size_t len - number of bytes
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int script_reply_write(void * arg, const char * data, size_t len) {
+		ScriptReply * reply = arg;
+
+		if (reply->compressor) {
+				if (len == 0) return OK;
+				reply->pending = TRUE;
+				return compressor_write(reply->compressor, data, len, Z_NO_FLUSH, script_reply_queue, reply);
+		}
+		return script_reply_queue(reply, data, len);
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_reply_flush(void * arg)
+* DESCRITPTION: Sends to the client the output of a script queued till now. If the script ends
+* 							before, its output leaves together with the last chunk. Used as
+* 							ScriptOutput.
+* ARGS_IN: void * arg - ScriptReply of the script
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int script_reply_flush(void * arg) {
+		ScriptReply * reply = arg;
+
+		/* the output kept by zlib is sent too, so that the client sees it while the script waits.
+		Without new output there is nothing to flush, and a flush before the first output would
+		send the headers of a reply that may still turn out to be an error */
+		if (reply->compressor && reply->pending) {
+				reply->pending = FALSE;
+				if (compressor_write(reply->compressor, NULL, 0, Z_SYNC_FLUSH, script_reply_queue, reply) == ERROR) return ERROR;
+		}
+		if (reply->sent == 0) return OK;
+		return flush_connection(reply->conn) == OK ? OK : ERROR;
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_reply_splice(void * arg, int fd, size_t len)
+* DESCRITPTION: Sends to the client bytes of output of a script that are waiting in a pipe,
+* 							with splice, together with everything queued before them. If the reply is
+* 							compressed they have to be read to go through zlib. Used as ScriptOutput.
+* ARGS_IN: void * arg - ScriptReply of the script
+* 				 int fd - read end of the pipe
+* 				 size_t len - number of bytes in the pipe
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int script_reply_splice(void * arg, int fd, size_t len) {
+		ScriptReply * reply = arg;
+		char buffer[COMPRESSION_BUFFER_SIZE];
+		ssize_t ret;
+
+		if (len == 0) return OK;
+		if (reply->compressor) {
+				while (len > 0) {
+						if ((ret = read(fd, buffer, MIN(len, sizeof(buffer)))) < 0 && errno == EINTR) continue;
+						if (ret <= 0 || script_reply_write(reply, buffer, ret) == ERROR) return ERROR;
+						len -= ret;
+				}
+				return script_reply_flush(reply);
+		}
+		if (script_reply_begin(reply, len) == ERROR || queue_pipe(reply->conn, fd, len) == ERROR) {
+				return ERROR;
+		}
+		return flush_connection(reply->conn) == OK ? OK : ERROR;
+}
+
+
+/*******************************************************************************************
+* FUNCTION: int get_and_parse_request(Connection * conn, char * date, Request * request)
+* DESCRITPTION: Parses the request received in the input buffer of the connection and saves
+* 							the information in a Request structure. No memory is allocated nor copied,
+* 							the fields of the structure point into the input buffer.
+* ARGS_IN: Connection * conn - connection whose input buffer is parsed and through where the
+* 															reply will be sent in case of error
+* 				 char * date - string containing the date to be used as the Date header in case of
+*												 error
+* 				 Request * request - where all the important information got from the request
+* 														 is written
+* ARGS_OUT: REQUEST_INCOMPLETE if more bytes are needed, -1 in case of error (the error reply
+* 					is already queued) and 0 otherwise
+*******************************************************************************************/
+int get_and_parse_request(Connection * conn, char * date, Request * request) {
+		const char * buf = conn->in_buf, *target, *mark;
+		int pret, minor_version, keep_alive = FALSE;
+		size_t buflen = conn->in_len, target_len;
+
+		/* parse request using picohttpparser and its example of use in github, the headers are
+		written straight into the request */
+		request->num_headers = MAX_REQUEST_HEADERS;
+		pret = phr_parse_request(buf, buflen, &request->method.ptr, &request->method.len,
+		                         &target, &target_len, &minor_version,
+		                         request->headers, &request->num_headers, 0);
+		if (pret == -1) {
+				// if there has been an error on phr_parse_request send a 500 message
+				fprintf(stderr, "ERROR: Error on phr_parse_request.\n");
+				send_500_server_error(conn, 1, date);
+				return ERROR;
+		} else if (pret == -2) {
+				// request is incomplete, wait for more bytes unless the buffer is full
+				if (buflen == CONNECTION_BUFFER_SIZE) {
+						fprintf(stderr, "ERROR: Request headers do not fit in the buffer.\n");
+						send_431_header_too_large(conn, 1, date);
+						return ERROR;
+				}
+				return REQUEST_INCOMPLETE;
+		}
+
+		/* save the obtained values in our data structure */
+		request->version = minor_version;
+		request->length = pret;
+		request->has_args = FALSE;
+		request->connection_close = FALSE;
+		request->content_length = -1;
+		request->chunked = request->expect_continue = FALSE;
+		request->host = request->if_modified_since = request->if_none_match = request->accept_encoding = request->range = request->if_range = request->content_type = (Slice) {NULL, 0};
+
+		/* split the arguments in the url after the '?' from the path */
+		request->path.ptr = target;
+		request->path.len = target_len;
+		request->query = (Slice) {NULL, 0};
+		if ((mark = memchr(target, '?', target_len)) != NULL) {
+				request->path.len = mark - target;
+				request->query.ptr = mark + 1;
+				request->query.len = target_len - request->path.len - 1;
+		}
+
+		/* pick the headers used by the server */
+		for(int i = 0; i < request->num_headers; i++) {
+				struct phr_header * h = &request->headers[i];
+				Slice value = {h->value, h->value_len};
+
+				if (slice_case_equals(h->name, h->name_len, "Connection")) {
+						if (slice_has_token(h->value, h->value_len, "close")) {
+								// if we have received a Connection: close save it
+								request->connection_close = TRUE;
+						} else if (slice_has_token(h->value, h->value_len, "keep-alive")) {
+								keep_alive = TRUE;
+						}
+				} else if (slice_case_equals(h->name, h->name_len, "Content-Length")) {
+						char * end;
+						request->content_length = strtol(h->value, &end, 10);
+						if (end == h->value || end != h->value + h->value_len || request->content_length < 0) {
+								send_400_bad_request(conn, request->version, date);
+								return ERROR;
+						}
+				} else if (slice_case_equals(h->name, h->name_len, "Transfer-Encoding")) {
+						// chunked is the only transfer coding understood
+						if (!slice_case_equals(h->value, h->value_len, "chunked")) {
+								send_400_bad_request(conn, request->version, date);
+								return ERROR;
+						}
+						request->chunked = TRUE;
+				} else if (slice_case_equals(h->name, h->name_len, "Expect")) {
+						// http/1.0 clients do not know about 100 Continue
+						request->expect_continue = request->version == 1 && slice_case_equals(h->value, h->value_len, "100-continue");
+				} else if (slice_case_equals(h->name, h->name_len, "Host")) {
+						request->host = value;
+				} else if (slice_case_equals(h->name, h->name_len, "If-Modified-Since")) {
+						request->if_modified_since = value;
+				} else if (slice_case_equals(h->name, h->name_len, "If-None-Match")) {
+						request->if_none_match = value;
+				} else if (slice_case_equals(h->name, h->name_len, "Accept-Encoding")) {
+						request->accept_encoding = value;
+				} else if (slice_case_equals(h->name, h->name_len, "Range")) {
+						request->range = value;
+				} else if (slice_case_equals(h->name, h->name_len, "If-Range")) {
+						request->if_range = value;
+				} else if (slice_case_equals(h->name, h->name_len, "Content-Type")) {
+						request->content_type = value;
+				}
+		}
+
+		/* HTTP/1.0 connections are not persistent unless the client asks for it */
+		if (request->version == 0 && keep_alive == FALSE) {
+				request->connection_close = TRUE;
+		}
+
+		/* a body with both lengths could be read differently by a proxy in front of the server */
+		if (request->chunked && request->content_length >= 0) {
+				send_400_bad_request(conn, request->version, date);
+				return ERROR;
+		}
+		if (request->content_length > max_body_size) {
+				send_413_payload_too_large(conn, request->version, date);
+				return ERROR;
+		}
+
+		/* the body is made of the Content-Length bytes after the headers, the bytes after it belong
+		to the next pipelined request. Chunked bodies and the ones that do not fit in the buffer
+		are read while the request is answered */
+		request->body.ptr = buf + pret;
+		request->body.len = MAX(request->content_length, 0);
+		request->body_streamed = request->chunked || pret + request->body.len > CONNECTION_BUFFER_SIZE;
+		if (request->body_streamed) {
+				request->body.len = 0;
+				conn->in_request_len = pret;
+		} else if (pret + request->body.len > buflen) {
+				// body is incomplete, wait for more bytes telling the client to send them if it waits for it
+				if (request->expect_continue && buflen == pret && conn->continue_sent == FALSE) {
+						conn->continue_sent = TRUE;
+						queue_response(conn, HTTP_CONTINUE, strlen(HTTP_CONTINUE));
+				}
+				return REQUEST_INCOMPLETE;
+		} else {
+				conn->in_request_len = pret + request->body.len;
+		}
+
+		/* store the post and / or get arguments */
+		if (slice_equals(request->method, "POST") || slice_equals(request->method, "GET")) {
+				// if it is a get or post request...
+				if (slice_equals(request->method, "POST")) {
+						if (request->body.len || request->body_streamed) {
+								// if it is a post request and it has a body there are arguments
+								request->has_args = TRUE;
+						} else {
+								// else post without body => send bad request
+								send_400_bad_request(conn, request->version, date);
+								return ERROR;
+						}
+				}
+				if (mark) {
+						if (request->query.len == 0) {
+								// if nothing after the "?" the request is incorrect
+								send_400_bad_request(conn, request->version, date);
+								return ERROR;
+						}
+						request->has_args = TRUE;
+				}
+		}
+
+		return OK;
+}
+
+
+/*******************************************************************************************
+* FUNCTION: void body_reader_init(BodyReader * reader, Connection * conn, Request * request)
+* DESCRITPTION: Prepares the reading of the body of a request.
+* ARGS_IN: BodyReader * reader - reader to initialize
+* 				 Connection * conn - connection where the request was received
+* 				 Request * request - request whose body is read
+* ARGS_OUT: None
+*******************************************************************************************/
+void body_reader_init(BodyReader * reader, Connection * conn, Request * request) {
+		memset(reader, 0, sizeof(BodyReader));
+		reader->conn = conn;
+		reader->request = request;
+		reader->start = request->length;
+		reader->left = request->content_length;
+		reader->decoder.consume_trailer = 1;
+}
+
+/*******************************************************************************************
+* FUNCTION: int body_expect(BodyReader * reader)
+* DESCRITPTION: Prepares the socket to wait for more bytes of a streamed body, sending before the
+* 							100 Continue if the client waits for it.
+* ARGS_IN: BodyReader * reader - reader of the body
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int body_expect(BodyReader * reader) {
+		Connection * conn = reader->conn;
+
+		if (connection_block(conn) == ERROR) {
+				reader->failed = TRUE;
+				return ERROR;
+		}
+		if (reader->request->expect_continue && conn->continue_sent == FALSE) {
+				conn->continue_sent = TRUE;
+				if (queue_response(conn, HTTP_CONTINUE, strlen(HTTP_CONTINUE)) == ERROR || flush_connection(conn) != OK) {
+						reader->failed = TRUE;
+						return ERROR;
+				}
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int body_receive(BodyReader * reader)
+* DESCRITPTION: Waits for more bytes of a streamed body and appends them to the input buffer.
+* ARGS_IN: BodyReader * reader - reader of the body
+* ARGS_OUT: -1 in case of error or if the client closed the connection, 0 otherwise
+*******************************************************************************************/
+int body_receive(BodyReader * reader) {
+		Connection * conn = reader->conn;
+		ssize_t ret;
+
+		if (body_expect(reader) == ERROR) return ERROR;
+
+		do {
+				ret = read(conn->fd, conn->in_buf + conn->in_len, CONNECTION_BUFFER_SIZE - conn->in_len);
+		} while (ret < 0 && errno == EINTR);
+		if (ret <= 0) {
+				if (ret < 0 && errno == EAGAIN) fprintf(stderr, "ERROR: timeout when receiving a request body.\n");
+				else fprintf(stderr, "ERROR: connection closed in the middle of a request body.\n");
+				reader->failed = TRUE;
+				return ERROR;
+		}
+		conn->in_len += ret;
+		conn->in_buf[conn->in_len] = '\0';
+		METRIC_ADD(conn->metrics, bytes_in, ret);
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int body_read(void * arg, const char ** data, size_t * len)
+* DESCRITPTION: Gives the next piece of the body of a request. A body that fits in the input
+* 							buffer is given at once. The rest are read from the socket into the part
+* 							of the input buffer after the headers, decoding the chunks in place if it
+* 							is chunked, so each piece overwrites the previous one. The bytes received
+* 							after the body are kept for the next pipelined request. Used as ScriptInput.
+* ARGS_IN: void * arg - BodyReader of the request
+* 				 const char ** data - where the piece is written, valid till the next call
+* 				 size_t * len - where the length of the piece is written, 0 at the end of the body
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int body_read(void * arg, const char ** data, size_t * len) {
+		BodyReader * reader = arg;
+		Connection * conn = reader->conn;
+		Request * request = reader->request;
+		ssize_t ret;
+
+		*len = 0;
+		if (reader->failed) return ERROR;
+		if (reader->done) return OK;
+
+		if (request->body_streamed == FALSE) {
+				*data = request->body.ptr;
+				*len = request->body.len;
+				reader->done = TRUE;
+				return OK;
+		}
+
+		for (;;) {
+				/* the bytes already received go first */
+				if (conn->in_len == reader->start && body_receive(reader) == ERROR) {
+						return ERROR;
+				}
+				*data = conn->in_buf + reader->start;
+
+				if (request->chunked) {
+						size_t size = conn->in_len - reader->start;
+						ret = phr_decode_chunked(&reader->decoder, conn->in_buf + reader->start, &size);
+						if (ret == -1) {
+								fprintf(stderr, "ERROR: badly chunked request body.\n");
+								reader->failed = reader->malformed = TRUE;
+								return ERROR;
+						}
+						*len = size;
+						if (ret >= 0) {
+								// the undecoded bytes after the last chunk are the next request
+								reader->done = TRUE;
+								conn->in_request_len = reader->start + size;
+								conn->in_len = reader->start + size + ret;
+								conn->in_buf[conn->in_len] = '\0';
+						} else {
+								conn->in_len = reader->start;
+						}
+				} else {
+						*len = MIN(conn->in_len - reader->start, (size_t) reader->left);
+						reader->left -= *len;
+						if (reader->left == 0) {
+								reader->done = TRUE;
+								conn->in_request_len = reader->start + *len;
+						} else {
+								conn->in_len = reader->start;
+						}
+				}
+
+				reader->total += *len;
+				if (reader->total > max_body_size) {
+						fprintf(stderr, "ERROR: request body bigger than max_body_size.\n");
+						reader->failed = reader->too_large = TRUE;
+						*len = 0;
+						return ERROR;
+				}
+				// a chunk header alone gives nothing, and an empty piece would be the end
+				if (*len > 0 || reader->done) return OK;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int body_splice(void * arg, int fd, size_t * len)
+* DESCRITPTION: Moves the next piece of a streamed body with Content-Length from the socket to a
+* 							pipe with splice, so it never goes through userspace. Chunked bodies must be
+* 							decoded and the bytes already in the input buffer must be given first, so
+* 							those are left to body_read. Used as ScriptInput.
+* ARGS_IN: void * arg - BodyReader of the request
+* 				 int fd - pipe where the body is written
+* 				 size_t * len - where the number of bytes moved is written, 0 at the end of the body
+* ARGS_OUT: FALSE if the piece must be read with body_read, CONN_WOULD_BLOCK if the pipe is
+* 					full or its reader has closed it, -1 in case of error and TRUE otherwise
+*******************************************************************************************/
+int body_splice(void * arg, int fd, size_t * len) {
+		BodyReader * reader = arg;
+		Connection * conn = reader->conn;
+		long long start;
+		ssize_t ret;
+
+		*len = 0;
+		if (reader->failed) return ERROR;
+		if (reader->done) return TRUE;
+		if (reader->request->body_streamed == FALSE || reader->request->chunked || conn->in_len > reader->start) {
+				return FALSE;
+		}
+
+		if (body_expect(reader) == ERROR) return ERROR;
+		start = timer_now();
+		do {
+				ret = splice(conn->fd, NULL, fd, NULL, reader->left, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} while (ret < 0 && errno == EINTR);
+		/* a full pipe gives EAGAIN at once, the timeout of the socket after waiting for the body */
+		if (ret < 0 && errno == EAGAIN && body_timeout > 0 && timer_now() - start >= body_timeout / 2) {
+				fprintf(stderr, "ERROR: timeout when receiving a request body.\n");
+				reader->failed = TRUE;
+				return ERROR;
+		} else if (ret < 0 && (errno == EAGAIN || errno == EPIPE)) {
+				return CONN_WOULD_BLOCK;
+		} else if (ret <= 0) {
+				fprintf(stderr, "ERROR: connection closed in the middle of a request body.\n");
+				reader->failed = TRUE;
+				return ERROR;
+		}
+
+		*len = ret;
+		reader->left -= ret;
+		reader->total += ret;
+		METRIC_ADD(conn->metrics, bytes_in, ret);
+		if (reader->left == 0) {
+				// nothing of the body was left in the buffer
+				reader->done = TRUE;
+				conn->in_request_len = reader->start;
+		}
+		return TRUE;
+}
+
+/*******************************************************************************************
+* FUNCTION: void body_finish(BodyReader * reader)
+* DESCRITPTION: Reads and discards the part of a streamed body that the answer did not need,
+* 							so that the next request can be parsed. If the body could not be read, or
+* 							the client is still waiting for the 100 Continue, the connection is closed
+* 							after the reply instead.
+* ARGS_IN: BodyReader * reader - reader of the body
+* ARGS_OUT: None
+*******************************************************************************************/
+void body_finish(BodyReader * reader) {
+		Connection * conn = reader->conn;
+		const char * data;
+		size_t len;
+
+		if (reader->request->body_streamed == FALSE) return;
+		if (reader->failed == FALSE && (reader->request->expect_continue == FALSE || conn->continue_sent == TRUE)) {
+				do {
+						if (body_read(reader, &data, &len) == ERROR) break;
+				} while (len > 0);
+		}
+		if (reader->done == FALSE) {
+				conn->in_request_len = conn->in_len;
+				conn->close_after_write = TRUE;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int env_append(char * buf, size_t * len, size_t size, char ** env, int * n,
+* 					const char * format, ...)
+* DESCRITPTION: Writes a "NAME=value" string after the ones already in a buffer and stores it in
+* 							the next position of an array of variables.
+* ARGS_IN: char * buf - buffer where the string is written
+* 				 size_t * len - bytes already in the buffer, updated
+* 				 size_t size - size of the buffer
+* 				 char ** env - array of variables
+* 				 int * n - number of variables in the array, updated
+* 				 const char * format - printf format of the variable
+* ARGS_OUT: -1 if the string does not fit in the buffer, 0 otherwise
+*******************************************************************************************/
+int env_append(char * buf, size_t * len, size_t size, char ** env, int * n, const char * format, ...) {
+		va_list args;
+		int ret;
+
+		va_start(args, format);
+		ret = vsnprintf(buf + *len, size - *len, format, args);
+		va_end(args);
+		if (ret < 0 || ret >= size - *len || *n == SCRIPT_ENV_VARS) return ERROR;
+		env[(*n)++] = buf + *len;
+		*len += ret + 1;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int script_environment(Request * request, char * path, char * server_signature,
+* 					char * buf, size_t size, char ** env)
+* DESCRITPTION: Writes the CGI variables given to a script for a request, as "NAME=value"
+* 							strings. The variables of headers that were not received are left out, as
+* 							is CONTENT_LENGTH for chunked bodies, which end when the input ends.
+* ARGS_IN: Request * request - request answered by the script
+* 				 char * path - path of the script in the file system
+* 				 char * server_signature - string containing the server's signature
+* 				 char * buf - buffer where the strings are written
+* 				 size_t size - size of the buffer
+* 				 char ** env - array of SCRIPT_ENV_VARS + 1 where the strings are stored, ended
+* 											 by NULL
+* ARGS_OUT: -1 if the variables do not fit in the buffer, 0 otherwise
+*******************************************************************************************/
+int script_environment(Request * request, char * path, char * server_signature, char * buf, size_t size, char ** env) {
+		size_t len = 0;
+		int n = 0;
+
+		if (env_append(buf, &len, size, env, &n, "GATEWAY_INTERFACE=CGI/1.1") == ERROR ||
+		    env_append(buf, &len, size, env, &n, "SERVER_SOFTWARE=%s", server_signature) == ERROR ||
+		    env_append(buf, &len, size, env, &n, "SERVER_PROTOCOL=HTTP/1.%d", request->version) == ERROR ||
+		    env_append(buf, &len, size, env, &n, "REQUEST_METHOD=%.*s", (int)request->method.len, request->method.ptr) == ERROR ||
+		    env_append(buf, &len, size, env, &n, "SCRIPT_NAME=%.*s", (int)request->path.len, request->path.ptr) == ERROR ||
+		    env_append(buf, &len, size, env, &n, "SCRIPT_FILENAME=%s", path) == ERROR ||
+		    env_append(buf, &len, size, env, &n, "QUERY_STRING=%.*s", (int)request->query.len, request->query.ptr) == ERROR) {
+				return ERROR;
+		}
+		if (request->content_length >= 0 &&
+		    env_append(buf, &len, size, env, &n, "CONTENT_LENGTH=%ld", request->content_length) == ERROR) {
+				return ERROR;
+		}
+		if (request->content_type.len &&
+		    env_append(buf, &len, size, env, &n, "CONTENT_TYPE=%.*s", (int)request->content_type.len, request->content_type.ptr) == ERROR) {
+				return ERROR;
+		}
+		if (request->host.len &&
+		    env_append(buf, &len, size, env, &n, "HTTP_HOST=%.*s", (int)request->host.len, request->host.ptr) == ERROR) {
+				return ERROR;
+		}
+
+		env[n] = NULL;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int lookup_file(char * path, FileCacheEntry ** entry, FdCacheEntry ** file)
+* DESCRITPTION: Finds a file to send. Files in the file cache are found without touching the
+* 							file system, the rest are opened once and kept opened, or known not to
+* 							exist, by the descriptor cache.
+* ARGS_IN: char * path - path of the file
+* 				 FileCacheEntry ** entry - where the entry of the file cache is written, or NULL
+* 				 FdCacheEntry ** file - where the opened file is written if it is not in the file
+* 																cache, or NULL
+* ARGS_OUT: TRUE if the file exists, with a reference to the entry found, FALSE if it does not
+* 					and -1 in case of error
+*******************************************************************************************/
+int lookup_file(char * path, FileCacheEntry ** entry, FdCacheEntry ** file) {
+		*file = NULL;
+		if ((*entry = file_cache_lookup(path)) != NULL) {
+				return TRUE;
+		}
+
+		*file = fd_cache_lookup(path);
+		if (*file == NULL && (*file = fd_cache_open(path)) == NULL) {
+				return ERROR;
+		}
+		if ((*file)->fd == -1) {
+				fd_cache_release(*file);
+				*file = NULL;
+				return FALSE;
+		}
+		return TRUE;
+}
+
+/*******************************************************************************************
+* FUNCTION: const char * precompressed_encoding(Slice path)
+* DESCRITPTION: Tells if a path is the one of a precompressed version of a file, by its suffix.
+* ARGS_IN: Slice path - path of the url
+* ARGS_OUT: the content coding of the version, NULL if it is not a precompressed file
+*******************************************************************************************/
+const char * precompressed_encoding(Slice path) {
+		for (int i = 0; i < sizeof(precompressed) / sizeof(precompressed[0]); i++) {
+				size_t len = strlen(precompressed[i].suffix);
+				if (path.len > len && memcmp(path.ptr + path.len - len, precompressed[i].suffix, len) == 0) {
+						return precompressed[i].encoding;
+				}
+		}
+		return NULL;
+}
+
+/*******************************************************************************************
+* FUNCTION: int accepts_encoding(Slice header, const char * encoding)
+* DESCRITPTION: Tells if a content coding is accepted by the value of an Accept-Encoding header,
+* 							f.e. "gzip, deflate, br;q=0.9". A coding with q=0 is refused, and "*"
+* 							stands for the codings not listed.
+* ARGS_IN: Slice header - value of the Accept-Encoding header
+* 				 const char * encoding - content coding
+* ARGS_OUT: TRUE if the coding is accepted, FALSE otherwise
+*******************************************************************************************/
+int accepts_encoding(Slice header, const char * encoding) {
+		const char * p = header.ptr, * end = header.ptr + header.len, * name, * q;
+		int star = FALSE;
+		size_t len;
+
+		while (p < end) {
+				while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+				for (name = p; p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'; p++);
+				len = p - name;
+
+				/* a weight of 0 (q=0, q=0.0...) refuses the coding */
+				int accepted = TRUE;
+				for (q = p; q < end && *q != ','; q++) {
+						if ((*q == 'q' || *q == 'Q') && q + 1 < end && q[1] == '=') {
+								const char * v = q + 2;
+								accepted = FALSE;
+								for (; v < end && *v != ',' && *v != ' ' && *v != '\t' && *v != ';'; v++) {
+										if (*v >= '1' && *v <= '9') accepted = TRUE;
+								}
+								break;
+						}
+				}
+				while (p < end && *p != ',') p++;
+
+				if (len == 1 && *name == '*') {
+						star = accepted;
+				} else if (len > 0 && slice_case_equals(name, len, encoding)) {
+						return accepted;
+				}
+		}
+		return star;
+}
+
+/*******************************************************************************************
+* FUNCTION: const char * select_precompressed(Request * request, char * path,
+* 					char * variant_path, FileCacheEntry ** entry, FdCacheEntry ** file)
+* DESCRITPTION: Looks for a precompressed version of a file (path.br, path.zst or path.gz, in
+* 							that order as the first ones are usually smaller) accepted by the client.
+* 							A version older than the file is ignored, as it was made from a previous
+* 							version of it. The versions are found through the caches like any file, so
+* 							the ones that do not exist are remembered as negative entries.
+* ARGS_IN: Request * request - request to answer
+* 				 char * path - path of the file
+* 				 char * variant_path - where the path of the version chosen is written
+* 				 FileCacheEntry ** entry - entry of the file found by lookup_file, replaced by the
+* 																	 one of the version chosen
+* 				 FdCacheEntry ** file - opened file found by lookup_file, replaced by the one of
+* 																the version chosen
+* ARGS_OUT: the content coding of the version chosen, NULL to send the file as it is
+*******************************************************************************************/
+const char * select_precompressed(Request * request, char * path, char * variant_path, FileCacheEntry ** entry, FdCacheEntry ** file) {
+		time_t mtime = *entry ? (*entry)->mtime : (*file)->mtime;
+		FileCacheEntry * variant_entry;
+		FdCacheEntry * variant_file;
+
+		if (request->accept_encoding.len == 0) return NULL;
+
+		for (int i = 0; i < sizeof(precompressed) / sizeof(precompressed[0]); i++) {
+				if (!accepts_encoding(request->accept_encoding, precompressed[i].encoding)) continue;
+				sprintf(variant_path, "%s%s", path, precompressed[i].suffix);
+				if (lookup_file(variant_path, &variant_entry, &variant_file) != TRUE) continue;
+
+				if ((variant_entry ? variant_entry->mtime : variant_file->mtime) < mtime) {
+						if (variant_entry) file_cache_release(variant_entry);
+						else fd_cache_release(variant_file);
+						continue;
+				}
+				if (*entry) file_cache_release(*entry);
+				else fd_cache_release(*file);
+				*entry = variant_entry;
+				*file = variant_file;
+				return precompressed[i].encoding;
+		}
+		return NULL;
+}
+
+/*******************************************************************************************
+* FUNCTION: int select_coding(Request * request)
+* DESCRITPTION: Chooses the coding of a reply compressed on the fly from the Accept-Encoding of
+* 							the request, gzip if it is accepted and deflate otherwise.
+* ARGS_IN: Request * request - request to answer
+* ARGS_OUT: COMPRESSION_GZIP, COMPRESSION_DEFLATE or COMPRESSION_NONE if the client accepts
+* 					none of them
+*******************************************************************************************/
+int select_coding(Request * request) {
+		if (request->accept_encoding.len == 0) return COMPRESSION_NONE;
+		if (accepts_encoding(request->accept_encoding, "gzip")) return COMPRESSION_GZIP;
+		if (accepts_encoding(request->accept_encoding, "deflate")) return COMPRESSION_DEFLATE;
+		return COMPRESSION_NONE;
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_file(Connection * conn, Request * request, char * date, char * path,
+* 					char * content_type, char * extra_headers, int coding, char * server_signature,
+* 					FileCacheEntry * entry, FdCacheEntry * file)
+* DESCRITPTION: Answers a GET of a file found with lookup_file: with a 304 if the client has it
+* 							already, with its ranges if it asked for them or with the whole file.
+* 							Small files are read into the file cache for the next requests, the rest
+* 							are sent with sendfile. A file in the file cache is sent compressed with
+* 							the coding given, which is made once and kept in the cache, unless it
+* 							does not get smaller; bigger files are sent as they are. The connection
+* 							takes the reference to the file.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+* 				 Request * request - request to answer
+* 				 char * date - string containing the date to be used as the Date header
+* 				 char * path - path of the file sent
+* 				 char * content_type - type of the file
+* 				 char * extra_headers - more headers of the file, each one ended by "\r\n"
+* 				 int coding - COMPRESSION_GZIP or COMPRESSION_DEFLATE to compress the file,
+* 											COMPRESSION_NONE to send it as it is
+* 				 char * server_signature - string containing the server's signature
+* 				 FileCacheEntry * entry - cached file, NULL to use the opened file
+* 				 FdCacheEntry * file - opened file if entry is NULL
+* ARGS_OUT: none
+*******************************************************************************************/
+void send_file(Connection * conn, Request * request, char * date, char * path, char * content_type, char * extra_headers,
+               int coding, char * server_signature, FileCacheEntry * entry, FdCacheEntry * file) {
+		char compressed_headers[SMALL_STRING_SIZE];
+		FileCacheEntry * variant;
+
+		/* a client revalidating its copy gets its answer before the file is read, unless the file
+		may be compressed, as the ETag is then the one of the compressed version */
+		if (coding == COMPRESSION_NONE && send_not_modified(conn, request, extra_headers, date, entry, file) == TRUE) {
+				return;
+		}
+
+		/* small files are kept in the cache for the next requests */
+		if (entry == NULL && (entry = file_cache_insert(path, file->fd, content_type, extra_headers, server_signature)) != NULL) {
+				fd_cache_release(file);
+				file = NULL;
+		}
+
+		if (coding != COMPRESSION_NONE) {
+				snprintf(compressed_headers, sizeof(compressed_headers), "Content-Encoding: %s\r\n%s",
+				         compress_coding_name(coding), extra_headers);
+				variant = entry ? file_cache_compressed(entry, coding, content_type, compressed_headers, server_signature) : NULL;
+				if (variant && variant->size < entry->size) {
+						file_cache_release(entry);
+						entry = variant;
+						extra_headers = compressed_headers;
+				} else if (variant) {
+						file_cache_release(variant);
+				}
+				if (send_not_modified(conn, request, extra_headers, date, entry, file) == TRUE) {
+						return;
+				}
+		}
+
+		/* the ranges of the file are sent from their offsets */
+		if (send_range(conn, request, content_type, extra_headers, date, entry, file) == TRUE) {
+				return;
+		}
+
+		if (entry) {
+				send_200_ok_cached(conn, request->version, date, entry);
+				return;
+		}
+
+		/* the request headers are sent with the length and last modified time of the cached fstat */
+		send_200_ok(conn, request->version, content_type, file->size, date, file->etag, file->last_modified, extra_headers);
+
+		/* the contents of the file are sent with sendfile by flush_connection, which releases
+		the file at the end. sendfile does not move the offset of the descriptor, so several
+		connections can share it */
+		queue_body(conn, NULL, file, 0, file->size);
+}
+
+/*******************************************************************************************
+* FUNCTION: void send_status(Connection * conn, Request * request, char * date)
+* DESCRITPTION: Sends the metrics of the server, in the text format of Prometheus or in JSON
+* 							if the query has format=json.
+* ARGS_IN: Connection * conn - connection through where the the reply will be sent
+* 				 Request * request - request of the metrics
+* 				 char * date - string containing the date to be used as the Date header
+* ARGS_OUT: None
+*******************************************************************************************/
+void send_status(Connection * conn, Request * request, char * date) {
+		char * body;
+		int json = memmem(request->query.ptr, request->query.len, "format=json", strlen("format=json")) != NULL;
+		long len;
+
+		/* the histograms make the metrics too big for the stack of the thread */
+		if ((body = malloc(METRICS_BUFFER_SIZE)) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for the metrics.\n");
+				send_500_server_error(conn, request->version, date);
+				return;
+		}
+		if ((len = metrics_format(body, METRICS_BUFFER_SIZE, json)) == ERROR) {
+				fprintf(stderr, "ERROR: metrics too long.\n");
+				send_500_server_error(conn, request->version, date);
+				free(body);
+				return;
+		}
+		send_200_ok(conn, request->version, json ? "application/json" : "text/plain; version=0.0.4", len, date, NULL, date,
+		            "Cache-Control: no-store\r\n");
+		queue_response(conn, body, len);
+		free(body);
+}
+
+/*******************************************************************************************
+* FUNCTION: int answer_http_request(Connection * conn, Request * request, BodyReader * body,
+* 					char * date, char * server_root, char * server_signature)
+* DESCRITPTION: Queues the answer to a request depending on if it is a POST, GET or OPTIONS
+* 							request.
+* ARGS_IN: Connection * conn - connection through where the reply will be sent
+* 				 Request * request - request to answer
+* 				 BodyReader * body - reader of the body of the request
+* 				 char * date - string containing the date to be used as the Date header
+* 				 char * server_root - string containing the path where the server's files are stored
+* 				 char * server_signature - string containing the server's signature, to be
+* 																used as the Server header
+* ARGS_OUT: 0
+*******************************************************************************************/
+int answer_http_request(Connection * conn, Request * request, BodyReader * body, char * date, char * server_root, char * server_signature) {
+		int ret;
+
+		METRIC_ADD(conn->metrics, requests[metrics_method(request->method.ptr, request->method.len)], 1);
+
+		/* requests that are none of the others, the replies with an error change the route too */
+		conn->route = ROUTE_ERROR;
+
+		/* the metrics of the server are not a file */
+		if (status_path[0] != '\0' && slice_equals(request->method, "GET") && slice_equals(request->path, status_path)) {
+				conn->route = ROUTE_STATIC;
+				send_status(conn, request, date);
+				clean_and_close(conn, request);
+				return OK;
+		}
+
+		/* obtain the final path concatenating the server_root and the canonical path of the request */
+		char final_file_path[MEDIUM_STRING_SIZE];
+		ret = snprintf(final_file_path, sizeof(final_file_path), "%s%.*s", server_root, (int)request->path.len, request->path.ptr);
+		if (ret < 0 || ret >= sizeof(final_file_path)) {
+				fprintf(stderr, "ERROR: sprintf failed.\n");
+				send_500_server_error(conn, request->version, date);
+				clean_and_close(conn, request);
+				return OK;
+		}
+		if (canonical_path(final_file_path + strlen(server_root)) == ERROR) {
+				send_400_bad_request(conn, request->version, date);
+				clean_and_close(conn, request);
+				return OK;
+		}
+
+		/* obtain the content type using the function designed for that, on the path of the request
+		inside final_file_path as it is '\0' terminated */
+		char content_type[SMALL_STRING_SIZE];
+		int script;
+		if((script = get_content_type(final_file_path + strlen(server_root), content_type)) == ERROR) {
+				send_400_bad_request(conn, request->version, date);
+				clean_and_close(conn, request);
+				return OK;
+		}
+
+		/* NON SCRIPT GET CASE */
+		if (slice_equals(request->method, "GET") && (script == NON_SCRIPT)) {
+			  /* get case and not a script */
+				conn->route = ROUTE_STATIC;
+
+				if(request->has_args == TRUE) {
+						/* if it has arguments then the request is incorrect, as it should be a script */
+						send_400_bad_request(conn, request->version, date);
+						clean_and_close(conn, request);
+						return OK;
+				}
+
+				/* the precompressed versions of the files are only sent when the client accepts them */
+				if (precompressed_encoding(request->path) != NULL) {
+						send_404_not_found(conn, request->version, date);
+						clean_and_close(conn, request);
+						return OK;
+				}
+
+				FileCacheEntry * entry;
+				FdCacheEntry * file;
+				long long start = metrics_clock();
+				ret = lookup_file(final_file_path, &entry, &file);
+				conn->latency[LATENCY_OPEN] = metrics_clock() - start;
+				PROBE4(file_open, conn->fd, final_file_path, ret == TRUE ? (entry ? entry->size : file->size) : -1, entry != NULL);
+				if (ret == ERROR) {
+						send_500_server_error(conn, request->version, date);
+						clean_and_close(conn, request);
+						return OK;
+				} else if (ret == FALSE) {
+						send_404_not_found(conn, request->version, date);
+						clean_and_close(conn, request);
+						return OK;
+				}
+				if (entry) METRIC_ADD(conn->metrics, cache_hits, 1);
+				else METRIC_ADD(conn->metrics, cache_misses, 1);
+
+				/* text may be sent precompressed, and the types of compression_types compressed on the
+				fly when there is no precompressed version, so their replies depend on Accept-Encoding */
+				char extra_headers[SMALL_STRING_SIZE] = "";
+				char variant_path[MEDIUM_STRING_SIZE + TINY_STRING_SIZE];
+				char * path = final_file_path;
+				int compressible = compress_type(content_type, entry ? entry->size : file->size);
+				int coding = COMPRESSION_NONE;
+				if (strncmp(content_type, "text/", strlen("text/")) == 0 || compressible) {
+						const char * encoding = NULL;
+						if (strncmp(content_type, "text/", strlen("text/")) == 0) {
+								encoding = select_precompressed(request, final_file_path, variant_path, &entry, &file);
+						}
+						if (encoding) {
+								path = variant_path;
+								sprintf(extra_headers, "Content-Encoding: %s\r\n", encoding);
+						} else if (compressible) {
+								coding = select_coding(request);
+						}
+						strcat(extra_headers, "Vary: Accept-Encoding\r\n");
+				}
+
+				send_file(conn, request, date, path, content_type, extra_headers, coding, server_signature, entry, file);
+
+
+		/* SCRIPT CASE: GET OR POST */
+		} else if ((slice_equals(request->method, "POST") || slice_equals(request->method, "GET")) &&
+		           ((script == PHP_SCRIPT) || (script == PYTHON_SCRIPT))) {
+
+				/* the file in the url is a script and the method is get or post */
+				conn->route = ROUTE_SCRIPT;
+
+				/* Obtain the last modified of the script, the file_len won't be used */
+				long file_len;
+				char last_modified[SMALL_STRING_SIZE];
+				get_content_lenght_and_last_modified(final_file_path, -1, &file_len, last_modified);
+
+				/* the output is compressed while it is sent if the client accepts it, the size is
+				not known so the minimum size of the files does not apply */
+				Compressor compressor;
+				char extra_headers[SMALL_STRING_SIZE] = "";
+				int coding = COMPRESSION_NONE;
+				if (compress_type(content_type, -1)) {
+						coding = select_coding(request);
+						if (coding != COMPRESSION_NONE && compressor_init(&compressor, coding) == ERROR) {
+								coding = COMPRESSION_NONE;
+						}
+						if (coding != COMPRESSION_NONE) {
+								sprintf(extra_headers, "Content-Encoding: %s\r\n", compress_coding_name(coding));
+						}
+						strcat(extra_headers, "Vary: Accept-Encoding\r\n");
+				}
+
+				/* run the script with the arguments of the body and then the ones in the url. Its output
+				is sent to the client while it runs, the headers go with the first bytes */
+				ScriptReply reply = {conn, request, content_type, date, last_modified, extra_headers,
+				                     coding != COMPRESSION_NONE ? &compressor : NULL, 0, FALSE};
+				ScriptInput input = {body_read, body_splice, body};
+				ScriptOutput output = {script_reply_write, script_reply_flush, script_reply_splice, &reply};
+				char env_buf[2 * CONNECTION_BUFFER_SIZE];
+				char * env[SCRIPT_ENV_VARS + 1];
+				long output_len = ERROR;
+				if (script_environment(request, final_file_path, server_signature, env_buf, sizeof(env_buf), env) == ERROR) {
+						fprintf(stderr, "ERROR: CGI variables of the script too long.\n");
+				} else {
+						METRIC_ADD(conn->metrics, scripts, 1);
+						long long start = metrics_clock();
+						PROBE3(script_start, conn->fd, final_file_path, script);
+						output_len = script_run(script, final_file_path, request->body, request->query, env, &input, &output);
+						conn->latency[LATENCY_SCRIPT] = metrics_clock() - start;
+						PROBE3(script_done, conn->fd, final_file_path, output_len);
+				}
+				if (reply.compressor) {
+						/* the end of the compressed stream, if the script wrote something or something was sent */
+						if ((output_len > 0 || reply.sent > 0) && compressor_write(&compressor, NULL, 0, Z_FINISH, script_reply_queue, &reply) == ERROR) {
+								output_len = ERROR;
+						}
+						compressor_end(&compressor);
+				}
+
+				if (reply.sent == 0) {
+						/* nothing was sent yet, so the error can still be reported */
+						if (body->too_large) {
+								send_413_payload_too_large(conn, request->version, date);
+						} else if (body->malformed) {
+								send_400_bad_request(conn, request->version, date);
+						} else {
+								fprintf(stderr, "ERROR: error when running the script!\n");
+								send_500_server_error(conn, request->version, date);
+						}
+				} else if (output_len == ERROR) {
+						/* the headers are already sent, the client can only see the reply cut */
+						fprintf(stderr, "ERROR: error when sending the output of the script!\n");
+						conn->close_after_write = TRUE;
+				} else if (request->version == 1) {
+						/* the last chunk */
+						queue_response(conn, "\r\n0\r\n\r\n", strlen("\r\n0\r\n\r\n"));
+				} else {
+						/* http/1.0 has no chunks, the end of the body is the end of the connection */
+						conn->close_after_write = TRUE;
+				}
+
+
+		/* OPTIONS CASE */
+		} else if (slice_equals(request->method, "OPTIONS")) {
+				conn->route = ROUTE_OPTIONS;
+				/* if treceived an options request answer appropiately */
+				send_200_ok_options(conn, request->version, date);
+
+		} else {
+				/* if the request is not a GET POST or OPTIONS then or the request is not
+				well formed or the server cannot understand it, either way send a bad
+				request reply */
+				send_400_bad_request(conn, request->version, date);
+		}
+
+		/* clean the Request structure and close the descriptor if connection close */
+		clean_and_close(conn, request);
+
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int request_blocks(Request * request)
+* DESCRITPTION: Tells if answering a request blocks the thread: the ones that run a script, which
+* 							waits for its interpreter and its output, and the ones whose body is
+* 							streamed, which waits for the client.
+* ARGS_IN: Request * request - request parsed
+* ARGS_OUT: TRUE if it blocks, FALSE otherwise
+*******************************************************************************************/
+int request_blocks(Request * request) {
+		char path[MEDIUM_STRING_SIZE], content_type[SMALL_STRING_SIZE];
+		int script;
+
+		if (request->body_streamed) return TRUE;
+		if (!slice_equals(request->method, "GET") && !slice_equals(request->method, "POST")) return FALSE;
+
+		/* the type is the one answer_http_request will find, a path too long is an error there */
+		if (request->path.len >= sizeof(path)) return FALSE;
+		memcpy(path, request->path.ptr, request->path.len);
+		path[request->path.len] = '\0';
+		if (canonical_path(path) == ERROR) return FALSE;
+		script = get_content_type(path, content_type);
+		return script == PYTHON_SCRIPT || script == PHP_SCRIPT;
+}
+
+/*******************************************************************************************
+* FUNCTION: int process_http_request(Connection * conn, char * server_root,
+* 					char * server_signature)
+* DESCRITPTION: Parse the request received in the connection and queue the answer depending on
+* 							if it is a POST, GET or OPTIONS request. A body too big for the input
+* 							buffer is read while the request is answered. The time of the phases
+* 							of a complete request is counted once it is answered. In epoll mode the
+* 							requests that block are left for a blocking thread.
+* ARGS_IN: Connection * conn - connection where the request was received and through where the
+* 															reply will be sent
+* 				 char * server_root - string containing the path where the server's files are stored
+* 				 char * server_signature - string containing the server's signature, to be
+* 																used as the Server header
+* ARGS_OUT: REQUEST_INCOMPLETE if the request has not been completely received, CONN_OFFLOAD
+* 					if it would block a non blocking connection that is not offloaded, -1 in case
+* 					connection has ended and 0 otherwise
+*******************************************************************************************/
+int process_http_request(Connection * conn, char * server_root, char * server_signature) {
+		int ret;
+		char date[SMALL_STRING_SIZE];
+		get_time(date);
+
+		// first of all parse the request in order to have the information correctly stored in the
+		// the data structure, which is kept in the stack as it only points into the input buffer
+		Request request_data, *request = &request_data;
+		long long start = metrics_clock();
+		ret = get_and_parse_request(conn, date, request);
+		if (ret == REQUEST_INCOMPLETE) {
+				return REQUEST_INCOMPLETE;
+		}
+		conn->latency[LATENCY_PARSE] = metrics_clock() - start;
+
+		if(ret == ERROR) {
+				// if we have not been able to parse the request close the connection once the error is sent,
+				// the rest of the input cannot be trusted
+				conn->in_request_len = conn->in_len;
+				conn->close_after_write = TRUE;
+				connection_latency(conn);
+				return END_OF_CONNECTION;
+		}
+
+		/* a thread with other connections to serve hands off the requests that would block it,
+		they are parsed again by the blocking thread */
+		if (conn->nonblocking && conn->offloaded == FALSE && request_blocks(request)) {
+				return CONN_OFFLOAD;
+		}
+
+		PROBE6(request_parsed, conn->fd, request->method.ptr, request->method.len, request->path.ptr, request->path.len,
+		       request->version);
+		BodyReader body;
+		body_reader_init(&body, conn, request);
+		ret = answer_http_request(conn, request, &body, date, server_root, server_signature);
+		body_finish(&body);
+		connection_unblock(conn);
+		connection_latency(conn);
+		return ret;
+}
+
+/*******************************************************************************************
+* FUNCTION: int handle_connection(Connection * conn, char * server_root,
+* 					char * server_signature)
+* DESCRITPTION: Runs the state machine of the connection: reads, parses and answers requests
+* 							until the socket would block or the connection ends. With blocking
+* 							sockets it only returns when the connection has ended.
+* 							A non blocking connection that is not offloaded stops before a request
+* 							with a script or a streamed body.
+* ARGS_IN: Connection * conn - connection to serve
+* 				 char * server_root - string containing the path where the server's files are stored
+* 				 char * server_signature - string containing the server's signature, to be
+* 																used as the Server header
+* ARGS_OUT: END_OF_CONNECTION in case the connection must be closed, CONN_OFFLOAD if its next
+* 					request must be answered by a blocking thread, 0 if it is waiting for the socket
+* 					to be readable or writable again
+*******************************************************************************************/
+int handle_connection(Connection * conn, char * server_root, char * server_signature) {
+		long long send_time;
+		int ret, idle;
+
+		for (;;) {
+				switch (conn->state) {
+				case CONN_STATE_READ:
+						/* wait for the rest of the request, a blocking read is ended by the timer of the
+						connection if the client takes too long */
+						idle = conn->in_len == 0 && conn->requests > 0;
+						connection_idle(conn, idle);
+						if (conn->nonblocking == FALSE) connection_watch(conn);
+						ret = read_connection(conn);
+						if (conn->nonblocking == FALSE && conn->watchdog) timer_cancel(conn->watchdog, &conn->timer);
+						if (ret == CONN_WOULD_BLOCK) {
+								connection_watch(conn);
+								return OK;
+						} else if (ret <= 0) {
+								// the client closed the connection or there was an error
+								return END_OF_CONNECTION;
+						}
+						// the time to receive a request starts with its first byte
+						if (idle) conn->request_start = timer_now();
+						if (conn->requests == 0 && conn->latency[LATENCY_FIRST_BYTE] < 0) {
+								conn->latency[LATENCY_FIRST_BYTE] = metrics_clock() - conn->accepted;
+						}
+						connection_idle(conn, FALSE);
+						conn->state = CONN_STATE_PARSE;
+						break;
+
+				case CONN_STATE_PARSE:
+						/* queue the answer to the request, if it is complete. One that would block stays in the
+						input buffer, for a blocking thread */
+						if ((ret = process_http_request(conn, server_root, server_signature)) == CONN_OFFLOAD) {
+								return CONN_OFFLOAD;
+						} else if (ret == REQUEST_INCOMPLETE) {
+								/* the replies of the batch are sent before waiting for the rest of the request */
+								conn->state = conn->out_nsegs ? CONN_STATE_WRITE : CONN_STATE_READ;
+						} else {
+								/* the request is removed from the input once it has been answered, as it pointed
+								into the buffer. The bytes after it are the next pipelined requests */
+								conn->in_len -= conn->in_request_len;
+								memmove(conn->in_buf, conn->in_buf + conn->in_request_len, conn->in_len + 1);
+								conn->in_request_len = 0;
+								conn->continue_sent = FALSE;
+								conn->requests++;
+								conn->request_start = timer_now();
+
+								/* the requests already received are answered in the same batch while there is
+								room for their replies, so that all of them are sent together */
+								if (conn->in_len == 0 || conn->close_after_write == TRUE ||
+								    conn->out_nsegs > MAX_OUT_SEGMENTS - MAX_SEGMENTS_PER_REPLY) {
+										conn->state = CONN_STATE_WRITE;
+								}
+						}
+						if (conn->state == CONN_STATE_WRITE) {
+								conn->last_progress = timer_now();
+								conn->send_start = metrics_clock();
+						}
+						break;
+
+				case CONN_STATE_WRITE:
+						/* send the answer, remembering where we stopped if the socket is full */
+						ret = flush_connection(conn);
+						if (ret == CONN_WOULD_BLOCK) {
+								connection_watch(conn);
+								return OK;
+						} else if (ret == ERROR) {
+								return END_OF_CONNECTION;
+						}
+						/* the replies of a batch are timed together, in the route of the last one */
+						send_time = metrics_clock() - conn->send_start;
+						metrics_latency(conn->metrics, conn->route, LATENCY_SEND, send_time);
+						PROBE4(response_sent, conn->fd, conn->status, conn->sent, send_time);
+						conn->sent = 0;
+						if (conn->close_after_write == TRUE) return END_OF_CONNECTION;
+						conn->idle_since = timer_now();
+						conn->state = CONN_STATE_PARSE;
+						break;
+				}
+		}
+}
@@ -0,0 +1,329 @@
+/*******************************************************************************************
+* FILE: metrics.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Counters of the threads of the server. Each thread counts in its own Metrics
+* 							structure, in its own cache lines, so the requests never take a lock nor
+* 							an atomic instruction to count, and the counters are only added up when
+* 							they are asked for, in the text format of Prometheus or in JSON. The
+* 							time of each phase of the requests goes to log-bucketed histograms, in
+* 							the style of HdrHistogram, whose percentiles are computed when they are
+* 							read.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/metrics.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+
+/* GLOBAL VARIABLES */
+Metrics * thread_metrics = NULL;
+long nthread_metrics = 0;
+/* methods and status codes counted apart, the last counter is for the rest */
+const char * metric_methods[METRIC_METHODS - 1] = {"GET", "POST", "HEAD", "OPTIONS"};
+const int metric_statuses[METRIC_STATUSES - 1] = {200, 206, 304, 400, 404, 413, 416, 431, 500};
+/* names of the routes and phases of the latency histograms, and percentiles served (in per
+mille) with their names in Prometheus and in JSON */
+const char * metric_routes[METRIC_ROUTES] = {"static", "script", "options", "error"};
+const char * latency_phases[LATENCY_PHASES] = {"first_byte", "parse", "open", "script", "send"};
+const int latency_quantiles[] = {500, 900, 990, 999};
+const char * latency_quantile_names[] = {"0.5", "0.9", "0.99", "0.999"};
+const char * latency_quantile_json[] = {"p50", "p90", "p99", "p999"};
+
+
+/*******************************************************************************************
+* FUNCTION: int metrics_init(long nthreads)
+* DESCRITPTION: Creates the counters of the threads, at zero. Must be called before the threads
+* 							are created.
+* ARGS_IN: long nthreads - number of places in the pool of threads
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int metrics_init(long nthreads) {
+		if (posix_memalign((void **) &thread_metrics, CACHE_LINE_SIZE, nthreads * sizeof(Metrics)) != 0) {
+				fprintf(stderr, "ERROR: error when allocating memory for the metrics.\n");
+				return ERROR;
+		}
+		memset(thread_metrics, 0, nthreads * sizeof(Metrics));
+		nthread_metrics = nthreads;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: Metrics * metrics_thread(int thread_num)
+* DESCRITPTION: Gives the counters of a thread of the pool.
+* ARGS_IN: int thread_num - identifier of the thread
+* ARGS_OUT: the counters of the thread
+*******************************************************************************************/
+Metrics * metrics_thread(int thread_num) {
+		return &thread_metrics[thread_num];
+}
+
+/*******************************************************************************************
+* FUNCTION: int metrics_method(const char * method, size_t len)
+* DESCRITPTION: Gives the position of a method in the requests counters.
+* ARGS_IN: const char * method - method of the request, not '\0' terminated
+* 				 size_t len - length of the method
+* ARGS_OUT: the position, the last one for the methods not counted apart
+*******************************************************************************************/
+int metrics_method(const char * method, size_t len) {
+		int i;
+
+		for (i = 0; i < METRIC_METHODS - 1; i++) {
+				if (strlen(metric_methods[i]) == len && memcmp(metric_methods[i], method, len) == 0) break;
+		}
+		return i;
+}
+
+/*******************************************************************************************
+* FUNCTION: int metrics_status(int status)
+* DESCRITPTION: Gives the position of a status code in the responses counters.
+* ARGS_IN: int status - status code of a reply
+* ARGS_OUT: the position, the last one for the codes not counted apart
+*******************************************************************************************/
+int metrics_status(int status) {
+		int i;
+
+		for (i = 0; i < METRIC_STATUSES - 1 && metric_statuses[i] != status; i++);
+		return i;
+}
+
+/*******************************************************************************************
+* FUNCTION: long long metrics_clock()
+* DESCRITPTION: Gives the current time with the precision of the latency histograms.
+* ARGS_IN: None
+* ARGS_OUT: microseconds of a monotonic clock
+*******************************************************************************************/
+long long metrics_clock() {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*******************************************************************************************
+* FUNCTION: int latency_bucket(long long us)
+* DESCRITPTION: Gives the bucket of a latency histogram of a value. The values below
+* 							2^LATENCY_SUB_BITS have a bucket each, and every power of two above is
+* 							split in 2^LATENCY_SUB_BITS buckets by the bits after the highest one.
+* ARGS_IN: long long us - microseconds
+* ARGS_OUT: the bucket, the last one for the values too big
+*******************************************************************************************/
+int latency_bucket(long long us) {
+		int exponent, bucket;
+
+		if (us < (1 << LATENCY_SUB_BITS)) return us < 0 ? 0 : us;
+		exponent = 63 - __builtin_clzll(us);
+		bucket = ((exponent - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+		         ((us >> (exponent - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1));
+		return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*******************************************************************************************
+* FUNCTION: long long latency_value(int bucket)
+* DESCRITPTION: Gives the highest value of a bucket of a latency histogram.
+* ARGS_IN: int bucket - bucket
+* ARGS_OUT: microseconds
+*******************************************************************************************/
+long long latency_value(int bucket) {
+		int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+
+		if (shift < 0) return bucket;
+		return (((long long) (bucket & ((1 << LATENCY_SUB_BITS) - 1)) + (1 << LATENCY_SUB_BITS) + 1) << shift) - 1;
+}
+
+/*******************************************************************************************
+* FUNCTION: void metrics_latency(Metrics * metrics, int route, int phase, long long us)
+* DESCRITPTION: Counts the time taken by a phase of a request in the histograms of a thread.
+* ARGS_IN: Metrics * metrics - counters of the thread that served the request
+* 				 int route - ROUTE_STATIC, ROUTE_SCRIPT, ROUTE_OPTIONS or ROUTE_ERROR
+* 				 int phase - one of the LATENCY_ phases
+* 				 long long us - microseconds taken by the phase
+* ARGS_OUT: None
+*******************************************************************************************/
+void metrics_latency(Metrics * metrics, int route, int phase, long long us) {
+		METRIC_ADD(metrics, latency[route][phase][latency_bucket(us)], 1);
+		METRIC_ADD(metrics, latency_sum[route][phase], us);
+}
+
+/*******************************************************************************************
+* FUNCTION: long latency_merge(int route, int phase, long * histogram, long * sum)
+* DESCRITPTION: Adds up the latency histograms of a phase of a route of every thread.
+* ARGS_IN: int route - route
+* 				 int phase - phase
+* ARGS_OUT: long * histogram - LATENCY_BUCKETS counters where the histogram is written
+* 					 long * sum - where the sum of the values is written
+* 					 the number of values counted
+*******************************************************************************************/
+long latency_merge(int route, int phase, long * histogram, long * sum) {
+		long count = 0;
+		int i;
+
+		memset(histogram, 0, LATENCY_BUCKETS * sizeof(long));
+		*sum = 0;
+		for (long t = 0; t < nthread_metrics; t++) {
+				for (i = 0; i < LATENCY_BUCKETS; i++) {
+						histogram[i] += __atomic_load_n(&thread_metrics[t].latency[route][phase][i], __ATOMIC_RELAXED);
+				}
+				*sum += __atomic_load_n(&thread_metrics[t].latency_sum[route][phase], __ATOMIC_RELAXED);
+		}
+		for (i = 0; i < LATENCY_BUCKETS; i++) count += histogram[i];
+		return count;
+}
+
+/*******************************************************************************************
+* FUNCTION: long long latency_quantile(long * histogram, long count, int per_mille)
+* DESCRITPTION: Gives a percentile of a latency histogram, as the highest value of the bucket
+* 							where it falls.
+* ARGS_IN: long * histogram - histogram, as written by latency_merge
+* 				 long count - number of values of the histogram, more than 0
+* 				 int per_mille - percentile, in per mille
+* ARGS_OUT: microseconds
+*******************************************************************************************/
+long long latency_quantile(long * histogram, long count, int per_mille) {
+		long rank = (count * per_mille + 999) / 1000, seen = 0;
+		int i;
+
+		if (rank < 1) rank = 1;
+		for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+				if ((seen += histogram[i]) >= rank) break;
+		}
+		return latency_value(i);
+}
+
+/*******************************************************************************************
+* FUNCTION: long metrics_sum(size_t offset)
+* DESCRITPTION: Adds up a counter of every thread.
+* ARGS_IN: size_t offset - position of the counter inside the Metrics structure
+* ARGS_OUT: the total
+*******************************************************************************************/
+long metrics_sum(size_t offset) {
+		long total = 0;
+
+		for (long i = 0; i < nthread_metrics; i++) {
+				total += __atomic_load_n((long *)((char *) &thread_metrics[i] + offset), __ATOMIC_RELAXED);
+		}
+		return total;
+}
+
+/*******************************************************************************************
+* FUNCTION: int metrics_printf(char * buf, size_t size, long * len, const char * format, ...)
+* DESCRITPTION: Appends formatted text to the output of metrics_format.
+* ARGS_IN: char * buf - output
+* 				 size_t size - size of buf
+* 				 long * len - length of the output, moved forward
+* 				 const char * format - printf format
+* 				 ... - arguments of the format
+* ARGS_OUT: -1 if the text does not fit, 0 otherwise
+*******************************************************************************************/
+int metrics_printf(char * buf, size_t size, long * len, const char * format, ...) {
+		va_list args;
+		int n;
+
+		va_start(args, format);
+		n = vsnprintf(buf + *len, size - *len, format, args);
+		va_end(args);
+		if (n < 0 || n >= size - *len) return ERROR;
+		*len += n;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: long metrics_format(char * buf, size_t size, int json)
+* DESCRITPTION: Writes the counters of every thread added up, and the percentiles of their
+* 							latency histograms merged, in the text format of Prometheus or in JSON.
+* 							The counters are read while the threads write them, without stopping
+* 							them, so the totals may be a few requests behind each other.
+* ARGS_IN: char * buf - where the text is written
+* 				 size_t size - size of buf
+* 				 int json - TRUE for JSON, FALSE for Prometheus
+* ARGS_OUT: the length of the text, -1 if it does not fit
+*******************************************************************************************/
+long metrics_format(char * buf, size_t size, int json) {
+		/* counters with a single value: name in JSON, name, type and help in Prometheus */
+		struct { size_t offset; const char * json; const char * name; const char * type; const char * help; } values[] = {
+				{offsetof(Metrics, bytes_in), "bytes_in", "server_received_bytes_total", "counter", "Bytes received from the clients."},
+				{offsetof(Metrics, bytes_out), "bytes_out", "server_sent_bytes_total", "counter", "Bytes sent to the clients."},
+				{offsetof(Metrics, connections), "connections", "server_connections_total", "counter", "Connections accepted."},
+				{offsetof(Metrics, active), "active_connections", "server_connections_active", "gauge", "Connections open."},
+				{offsetof(Metrics, idle), "idle_connections", "server_connections_idle", "gauge", "Connections waiting for their next request."},
+				{offsetof(Metrics, cache_hits), "cache_hits", "server_file_cache_hits_total", "counter", "Files sent from the file cache."},
+				{offsetof(Metrics, cache_misses), "cache_misses", "server_file_cache_misses_total", "counter", "Files not found in the file cache."},
+				{offsetof(Metrics, scripts), "scripts", "server_scripts_total", "counter", "Scripts run."},
+		};
+		long len = 0, histogram[LATENCY_BUCKETS], count, sum;
+		int i, route, phase, first, ret = OK;
+		const int nquantiles = sizeof(latency_quantiles) / sizeof(latency_quantiles[0]);
+
+		if (json) {
+				ret |= metrics_printf(buf, size, &len, "{\"requests\":{");
+				for (i = 0; i < METRIC_METHODS; i++) {
+						ret |= metrics_printf(buf, size, &len, "%s\"%s\":%ld", i ? "," : "", i < METRIC_METHODS - 1 ? metric_methods[i] : "other",
+						                      metrics_sum(offsetof(Metrics, requests) + i * sizeof(long)));
+				}
+				ret |= metrics_printf(buf, size, &len, "},\"responses\":{");
+				for (i = 0; i < METRIC_STATUSES; i++) {
+						if (i < METRIC_STATUSES - 1) ret |= metrics_printf(buf, size, &len, "%s\"%d\":", i ? "," : "", metric_statuses[i]);
+						else ret |= metrics_printf(buf, size, &len, ",\"other\":");
+						ret |= metrics_printf(buf, size, &len, "%ld", metrics_sum(offsetof(Metrics, responses) + i * sizeof(long)));
+				}
+				ret |= metrics_printf(buf, size, &len, "}");
+				for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+						ret |= metrics_printf(buf, size, &len, ",\"%s\":%ld", values[i].json, metrics_sum(values[i].offset));
+				}
+				/* the percentiles in microseconds of the phases each route has gone through */
+				ret |= metrics_printf(buf, size, &len, ",\"latency\":{");
+				for (route = 0; route < METRIC_ROUTES; route++) {
+						ret |= metrics_printf(buf, size, &len, "%s\"%s\":{", route ? "," : "", metric_routes[route]);
+						for (phase = 0, first = TRUE; phase < LATENCY_PHASES; phase++) {
+								if ((count = latency_merge(route, phase, histogram, &sum)) == 0) continue;
+								ret |= metrics_printf(buf, size, &len, "%s\"%s\":{\"count\":%ld,\"sum\":%ld", first ? "" : ",",
+								                      latency_phases[phase], count, sum);
+								for (i = 0; i < nquantiles; i++) {
+										ret |= metrics_printf(buf, size, &len, ",\"%s\":%lld", latency_quantile_json[i],
+										                      latency_quantile(histogram, count, latency_quantiles[i]));
+								}
+								ret |= metrics_printf(buf, size, &len, "}");
+								first = FALSE;
+						}
+						ret |= metrics_printf(buf, size, &len, "}");
+				}
+				ret |= metrics_printf(buf, size, &len, "}}\n");
+				return ret == OK ? len : ERROR;
+		}
+
+		ret |= metrics_printf(buf, size, &len, "# HELP server_requests_total Requests received, by method.\n"
+		                                       "# TYPE server_requests_total counter\n");
+		for (i = 0; i < METRIC_METHODS; i++) {
+				ret |= metrics_printf(buf, size, &len, "server_requests_total{method=\"%s\"} %ld\n",
+				                      i < METRIC_METHODS - 1 ? metric_methods[i] : "other",
+				                      metrics_sum(offsetof(Metrics, requests) + i * sizeof(long)));
+		}
+		ret |= metrics_printf(buf, size, &len, "# HELP server_responses_total Replies sent, by status code.\n"
+		                                       "# TYPE server_responses_total counter\n");
+		for (i = 0; i < METRIC_STATUSES; i++) {
+				if (i < METRIC_STATUSES - 1) ret |= metrics_printf(buf, size, &len, "server_responses_total{code=\"%d\"} ", metric_statuses[i]);
+				else ret |= metrics_printf(buf, size, &len, "server_responses_total{code=\"other\"} ");
+				ret |= metrics_printf(buf, size, &len, "%ld\n", metrics_sum(offsetof(Metrics, responses) + i * sizeof(long)));
+		}
+		for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+				ret |= metrics_printf(buf, size, &len, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", values[i].name, values[i].help,
+				                      values[i].name, values[i].type, values[i].name, metrics_sum(values[i].offset));
+		}
+		ret |= metrics_printf(buf, size, &len, "# HELP server_request_phase_seconds Time taken by each phase of the requests, by route.\n"
+		                                       "# TYPE server_request_phase_seconds summary\n");
+		for (route = 0; route < METRIC_ROUTES; route++) {
+				for (phase = 0; phase < LATENCY_PHASES; phase++) {
+						if ((count = latency_merge(route, phase, histogram, &sum)) == 0) continue;
+						for (i = 0; i < nquantiles; i++) {
+								ret |= metrics_printf(buf, size, &len, "server_request_phase_seconds{route=\"%s\",phase=\"%s\",quantile=\"%s\"} %.6f\n",
+								                      metric_routes[route], latency_phases[phase], latency_quantile_names[i],
+								                      latency_quantile(histogram, count, latency_quantiles[i]) / 1e6);
+						}
+						ret |= metrics_printf(buf, size, &len, "server_request_phase_seconds_sum{route=\"%s\",phase=\"%s\"} %.6f\n"
+						                                       "server_request_phase_seconds_count{route=\"%s\",phase=\"%s\"} %ld\n",
+						                      metric_routes[route], latency_phases[phase], sum / 1e6,
+						                      metric_routes[route], latency_phases[phase], count);
+				}
+		}
+		return ret == OK ? len : ERROR;
+}
@@ -0,0 +1,753 @@
+/*******************************************************************************************
+* FILE: scripts.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Execution of the python and php scripts requested to the server. Instead of
+* 							starting a shell and a new interpreter for every request, each type of
+* 							script has a pool of persistent interpreters running the programs of the
+* 							workers directory, which receive the scripts to run through a unix socket
+* 							using a small protocol of records in the style of FastCGI. The requests
+* 							of all the connections are multiplexed over the interpreters of the pool,
+* 							and each record carries the id of its request so that a reply that does
+* 							not belong to the request is detected. Interpreters are replaced after a
+* 							number of scripts or when they die. With a pool of size 0 each script is
+* 							run by a new interpreter, started without a shell. In both cases the
+* 							script gets the CGI variables of the request and the body as its standard
+* 							input, and the output is given to the http module as it is produced, so
+* 							that it reaches the client while the script is still running.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/scripts.h"
+#include "../includes/probes.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char ** environ;
+
+
+/* structure that stores one persistent interpreter of a pool */
+typedef struct {
+		/* process of the interpreter, 0 if it is not running */
+		pid_t pid;
+		/* end of the socket through where the server talks with the interpreter */
+		int fd;
+		/* scripts run since it was started */
+		long requests;
+		/* boolean representing if a thread is using it */
+		int busy;
+} ScriptWorker;
+
+/* structure that stores the pool of interpreters of one type of script */
+typedef struct {
+		/* program of the interpreter and the worker program it runs */
+		char * interpreter;
+		char * runner;
+		ScriptWorker * workers;
+		int size;
+		/* protects the busy field of the workers, threads wait in idle for a free one */
+		pthread_mutex_t lock;
+		pthread_cond_t idle;
+		long requests;
+		long started;
+} ScriptPool;
+
+/* GLOBAL VARIABLES */
+/* pools of python and php interpreters */
+static ScriptPool pools[2];
+/* number of scripts run by an interpreter before it is replaced, 0 for never */
+static long worker_max_requests = 0;
+/* id of the last request sent to an interpreter */
+static unsigned short last_request_id = 0;
+
+
+/*******************************************************************************************
+* FUNCTION: void script_pool_init(int workers, long max_requests)
+* DESCRITPTION: Initializes the pools of persistent interpreters, one for python and one for
+* 							php. The interpreters are started the first time they are needed. Must be
+* 							called before the threads are created.
+* ARGS_IN: int workers - number of interpreters of each pool, 0 starts one for every script
+* 				 long max_requests - number of scripts run by an interpreter before it is replaced
+* 														 by a new one, 0 never replaces them
+* ARGS_OUT: None
+*******************************************************************************************/
+void script_pool_init(int workers, long max_requests) {
+		char * interpreters[] = {"python", "php"};
+		char * runners[] = {PYTHON_WORKER, PHP_WORKER};
+
+		worker_max_requests = max_requests;
+		for (int i = 0; i < 2; i++) {
+				memset(&pools[i], 0, sizeof(ScriptPool));
+				pools[i].interpreter = interpreters[i];
+				pools[i].runner = runners[i];
+				pools[i].size = MAX(workers, 0);
+				if (pools[i].size && (pools[i].workers = calloc(pools[i].size, sizeof(ScriptWorker))) == NULL) {
+						fprintf(stderr, "ERROR: error when allocating memory for the script workers.\n");
+						exit(EXIT_FAILURE);
+				}
+				pthread_mutex_init(&pools[i].lock, NULL);
+				pthread_cond_init(&pools[i].idle, NULL);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int write_all(int fd, const char * data, size_t len)
+* DESCRITPTION: Writes all the bytes in a socket, retrying after partial writes.
+* ARGS_IN: int fd - socket descriptor
+* 				 const char * data - bytes to write
+* 				 size_t len - number of bytes
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int write_all(int fd, const char * data, size_t len) {
+		ssize_t ret;
+
+		while (len > 0) {
+				ret = send(fd, data, len, MSG_NOSIGNAL);
+				if (ret < 0) {
+						if (errno == EINTR) continue;
+						return ERROR;
+				}
+				data += ret;
+				len -= ret;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int read_all(int fd, char * data, size_t len, ScriptOutput * output)
+* DESCRITPTION: Reads exactly len bytes from a socket. With data NULL the bytes are discarded.
+* 							Before waiting for bytes that have not arrived yet, the output queued is
+* 							flushed, so that the client gets it while the script keeps running, but
+* 							the output of a script that has already ended leaves in a single write.
+* ARGS_IN: int fd - socket descriptor
+* 				 char * data - where the bytes are written, or NULL
+* 				 size_t len - number of bytes
+* 				 ScriptOutput * output - output to flush before waiting
+* ARGS_OUT: -1 in case of error or if the socket was closed, 0 otherwise
+*******************************************************************************************/
+int read_all(int fd, char * data, size_t len, ScriptOutput * output) {
+		char discard[MEDIUM_STRING_SIZE];
+		int flags = MSG_DONTWAIT;
+		ssize_t ret;
+
+		while (len > 0) {
+				ret = recv(fd, data ? data : discard, data ? len : MIN(len, sizeof(discard)), flags);
+				if (ret < 0) {
+						if (errno == EINTR) continue;
+						if (errno == EAGAIN || errno == EWOULDBLOCK) {
+								if (output->flush(output->arg) == ERROR) return ERROR;
+								flags = 0;
+								continue;
+						}
+						return ERROR;
+				} else if (ret == 0) {
+						return ERROR;
+				}
+				if (data) data += ret;
+				len -= ret;
+				flags = MSG_DONTWAIT;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int append_record(char * buf, size_t * len, size_t size, int type,
+* 					unsigned short id, const char * data, size_t data_len)
+* DESCRITPTION: Writes a record of the protocol of the workers at the end of a buffer: a header
+* 							with the version, the type, the id of the request and the length of the
+* 							content, in network order, followed by the content.
+* ARGS_IN: char * buf - buffer where the record is written
+* 				 size_t * len - bytes already in the buffer, updated
+* 				 size_t size - size of the buffer
+* 				 int type - type of the record
+* 				 unsigned short id - id of the request
+* 				 const char * data - content of the record
+* 				 size_t data_len - length of the content
+* ARGS_OUT: -1 if the record does not fit in the buffer, 0 otherwise
+*******************************************************************************************/
+int append_record(char * buf, size_t * len, size_t size, int type, unsigned short id, const char * data, size_t data_len) {
+		uint32_t length = htonl(data_len);
+		uint16_t rid = htons(id);
+
+		if (*len + SCRIPT_RECORD_HEADER_SIZE + data_len > size) return ERROR;
+		buf[*len] = SCRIPT_RECORD_VERSION;
+		buf[*len + 1] = type;
+		memcpy(buf + *len + 2, &rid, sizeof(rid));
+		memcpy(buf + *len + 4, &length, sizeof(length));
+		memcpy(buf + *len + SCRIPT_RECORD_HEADER_SIZE, data, data_len);
+		*len += SCRIPT_RECORD_HEADER_SIZE + data_len;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int append_args(char * buf, size_t * len, size_t size, unsigned short id, Slice s)
+* DESCRITPTION: Writes an ARG record for each word of a slice, splitted by spaces, tabs and
+* 							new lines as the shell did when the scripts were run with popen, but without
+* 							interpreting any of its characters.
+* ARGS_IN: char * buf - buffer where the records are written
+* 				 size_t * len - bytes already in the buffer, updated
+* 				 size_t size - size of the buffer
+* 				 unsigned short id - id of the request
+* 				 Slice s - arguments to split
+* ARGS_OUT: -1 if the records do not fit in the buffer, 0 otherwise
+*******************************************************************************************/
+int append_args(char * buf, size_t * len, size_t size, unsigned short id, Slice s) {
+		size_t start = 0, end;
+
+		while (start < s.len) {
+				if (strchr(" \t\n", s.ptr[start])) {
+						start++;
+						continue;
+				}
+				for (end = start; end < s.len && !strchr(" \t\n", s.ptr[end]); end++);
+				if (append_record(buf, len, size, SCRIPT_RECORD_ARG, id, s.ptr + start, end - start) == ERROR) return ERROR;
+				start = end;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int spawn_interpreter(char ** argv, char ** envp, int in_fd, int out_fd,
+* 					int channel_fd, pid_t * pid)
+* DESCRITPTION: Starts an interpreter without a shell, with the descriptors given as its
+* 							standard input and output. It is put in its own process group so that the
+* 							SIGINT of the terminal only reaches the server, and it does not inherit the
+* 							signals blocked and ignored by the server.
+* ARGS_IN: char ** argv - program and arguments, the program is searched in the PATH
+* 				 char ** envp - environment of the interpreter
+* 				 int in_fd - standard input, -1 for /dev/null
+* 				 int out_fd - standard output, -1 to keep the one of the server
+* 				 int channel_fd - descriptor given as SCRIPT_WORKER_FD, -1 for none
+* 				 pid_t * pid - where the process id is written
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int spawn_interpreter(char ** argv, char ** envp, int in_fd, int out_fd, int channel_fd, pid_t * pid) {
+		posix_spawn_file_actions_t actions;
+		posix_spawnattr_t attr;
+		sigset_t mask, defaults;
+		int fds[3] = {in_fd, out_fd, channel_fd}, targets[3] = {STDIN_FILENO, STDOUT_FILENO, SCRIPT_WORKER_FD};
+		int dups[3] = {-1, -1, -1}, ret;
+
+		posix_spawn_file_actions_init(&actions);
+		if (in_fd == -1) posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		for (int i = 0; i < 3; i++) {
+				if (fds[i] == -1) continue;
+				// dup2 onto the same descriptor would keep the close on exec flag
+				if (fds[i] == targets[i]) fds[i] = dups[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, SCRIPT_WORKER_FD + 1);
+				posix_spawn_file_actions_adddup2(&actions, fds[i], targets[i]);
+		}
+
+		/* the server blocks SIGINT in its threads and ignores SIGPIPE, the interpreter must not inherit it */
+		sigemptyset(&mask);
+		sigemptyset(&defaults);
+		sigaddset(&defaults, SIGPIPE);
+		posix_spawnattr_init(&attr);
+		posix_spawnattr_setsigmask(&attr, &mask);
+		posix_spawnattr_setsigdefault(&attr, &defaults);
+		posix_spawnattr_setpgroup(&attr, 0);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+		ret = posix_spawnp(pid, argv[0], &actions, &attr, argv, envp);
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		for (int i = 0; i < 3; i++) {
+				if (dups[i] != -1) Close(dups[i]);
+		}
+		if (ret != 0) {
+				fprintf(stderr, "ERROR: cannot start %s: %s\n", argv[0], strerror(ret));
+				return ERROR;
+		}
+		PROBE2(interpreter_spawn, *pid, argv[0]);
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int worker_start(ScriptPool * pool, ScriptWorker * worker)
+* DESCRITPTION: Starts an interpreter running the worker program of the pool. The worker
+* 							receives its end of the socket as descriptor 3 and its standard input is
+* 							/dev/null.
+* ARGS_IN: ScriptPool * pool - pool of the worker
+* 				 ScriptWorker * worker - worker to start
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int worker_start(ScriptPool * pool, ScriptWorker * worker) {
+		char * argv[] = {pool->interpreter, pool->runner, NULL};
+		int sv[2], ret;
+		pid_t pid;
+
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+				perror("socketpair");
+				return ERROR;
+		}
+
+		ret = spawn_interpreter(argv, environ, -1, -1, sv[1], &pid);
+		Close(sv[1]);
+		if (ret == ERROR) {
+				Close(sv[0]);
+				return ERROR;
+		}
+
+		worker->pid = pid;
+		worker->fd = sv[0];
+		worker->requests = 0;
+		__atomic_add_fetch(&pool->started, 1, __ATOMIC_RELAXED);
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: void worker_stop(ScriptWorker * worker)
+* DESCRITPTION: Stops an interpreter and waits for it. A worker that is not running a script
+* 							would end by itself when its socket is closed, but one that failed may be
+* 							stuck, so it is killed.
+* ARGS_IN: ScriptWorker * worker - worker to stop
+* ARGS_OUT: None
+*******************************************************************************************/
+void worker_stop(ScriptWorker * worker) {
+		int status = 0;
+
+		Close(worker->fd);
+		kill(worker->pid, SIGKILL);
+		while (waitpid(worker->pid, &status, 0) < 0 && errno == EINTR);
+		PROBE2(interpreter_exit, worker->pid, status);
+		worker->pid = 0;
+		worker->fd = -1;
+}
+
+/*******************************************************************************************
+* FUNCTION: ScriptWorker * worker_acquire(ScriptPool * pool)
+* DESCRITPTION: Takes a free worker of the pool, waiting till there is one, and starts its
+* 							interpreter if it is not running.
+* ARGS_IN: ScriptPool * pool - pool of interpreters
+* ARGS_OUT: the worker, to be given back with worker_release, or NULL in case of error
+*******************************************************************************************/
+ScriptWorker * worker_acquire(ScriptPool * pool) {
+		ScriptWorker * worker = NULL;
+
+		Pthread_mutex_lock(&pool->lock);
+		while (worker == NULL) {
+				for (int i = 0; i < pool->size && worker == NULL; i++) {
+						if (pool->workers[i].busy == FALSE) worker = &pool->workers[i];
+				}
+				if (worker == NULL) pthread_cond_wait(&pool->idle, &pool->lock);
+		}
+		worker->busy = TRUE;
+		Pthread_mutex_unlock(&pool->lock);
+
+		/* the interpreter is started out of the lock, it takes a while */
+		if (worker->pid == 0 && worker_start(pool, worker) == ERROR) {
+				Pthread_mutex_lock(&pool->lock);
+				worker->busy = FALSE;
+				pthread_cond_signal(&pool->idle);
+				Pthread_mutex_unlock(&pool->lock);
+				return NULL;
+		}
+		return worker;
+}
+
+/*******************************************************************************************
+* FUNCTION: void worker_release(ScriptPool * pool, ScriptWorker * worker, int stop)
+* DESCRITPTION: Gives a worker back to the pool, stopping its interpreter if it failed, if it
+* 							is going to end by itself or if it has run worker_max_requests scripts, so
+* 							that a new one is started the next time.
+* ARGS_IN: ScriptPool * pool - pool of interpreters
+* 				 ScriptWorker * worker - worker to give back
+* 				 int stop - TRUE if the interpreter must be stopped
+* ARGS_OUT: None
+*******************************************************************************************/
+void worker_release(ScriptPool * pool, ScriptWorker * worker, int stop) {
+		if (stop || (worker_max_requests > 0 && worker->requests >= worker_max_requests)) {
+				worker_stop(worker);
+		}
+
+		Pthread_mutex_lock(&pool->lock);
+		worker->busy = FALSE;
+		pthread_cond_signal(&pool->idle);
+		Pthread_mutex_unlock(&pool->lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: int worker_read_record(ScriptWorker * worker, unsigned short id,
+* 					ScriptOutput * output, long * total, int * keep)
+* DESCRITPTION: Reads a record sent by an interpreter. The output of STDOUT records is given to
+* 							the http module in pieces of LARGE_STRING_SIZE bytes.
+* ARGS_IN: ScriptWorker * worker - worker that runs the script
+* 				 unsigned short id - id of the request
+* 				 ScriptOutput * output - where the output of the script is sent
+* 				 long * total - bytes of output till now, updated
+* 				 int * keep - where it is written, on the END record, if the interpreter keeps running
+* ARGS_OUT: -1 in case of error, TRUE if it was the END record and FALSE otherwise
+*******************************************************************************************/
+int worker_read_record(ScriptWorker * worker, unsigned short id, ScriptOutput * output, long * total, int * keep) {
+		char header[SCRIPT_RECORD_HEADER_SIZE], data[LARGE_STRING_SIZE];
+		uint32_t length, status[2];
+
+		if (read_all(worker->fd, header, sizeof(header), output) == ERROR) {
+				fprintf(stderr, "ERROR: a script worker ended while running a script.\n");
+				return ERROR;
+		}
+		memcpy(&length, header + 4, sizeof(length));
+		length = ntohl(length);
+		if ((((unsigned char)header[2] << 8) | (unsigned char)header[3]) != id) {
+				fprintf(stderr, "ERROR: reply of another request received from a worker.\n");
+				return ERROR;
+		}
+
+		if (header[1] == SCRIPT_RECORD_STDOUT) {
+				while (length > 0) {
+						size_t take = MIN(length, sizeof(data));
+						// if the client is gone the script is stopped together with its interpreter
+						if (read_all(worker->fd, data, take, output) == ERROR || output->write(output->arg, data, take) == ERROR) {
+								return ERROR;
+						}
+						length -= take;
+						*total += take;
+				}
+				return FALSE;
+		} else if (header[1] == SCRIPT_RECORD_END && length == sizeof(status)) {
+				if (read_all(worker->fd, (char *) status, sizeof(status), output) == ERROR) return ERROR;
+				*keep = ntohl(status[1]) != 0;
+				return TRUE;
+		}
+		return read_all(worker->fd, NULL, length, output) == ERROR ? ERROR : FALSE;
+}
+
+/*******************************************************************************************
+* FUNCTION: long worker_run(ScriptWorker * worker, char * path, Slice body, Slice query,
+* 					char ** env, ScriptInput * input, ScriptOutput * output, int * keep)
+* DESCRITPTION: Sends a script to run to an interpreter and gives its output to the http module
+* 							as the STDOUT records arrive, till the END record. The body of the request
+* 							is sent in STDIN records as it is received, ending with an empty one, and
+* 							several records go in each write. When the interpreter does not take more
+* 							input its output is read meanwhile, so that neither waits for the other.
+* 							Once the script ends the rest of the input is not needed, and only the
+* 							empty STDIN record is sent for the interpreter to know that it is over.
+* ARGS_IN: ScriptWorker * worker - worker that runs the script
+* 				 char * path - path of the script
+* 				 Slice body - body of the request if it fits in the input buffer, passed as arguments
+* 				 Slice query - arguments in the url, passed as arguments after the body
+* 				 char ** env - CGI variables of the request, sent in PARAM records
+* 				 ScriptInput * input - from where the body of the request is read
+* 				 ScriptOutput * output - where the output of the script is sent
+* 				 int * keep - where it is written if the interpreter keeps running after the script
+* ARGS_OUT: number of bytes of the output or -1 in case of error
+*******************************************************************************************/
+long worker_run(ScriptWorker * worker, char * path, Slice body, Slice query, char ** env, ScriptInput * input, ScriptOutput * output, int * keep) {
+		char request[4 * CONNECTION_BUFFER_SIZE + MEDIUM_STRING_SIZE];
+		unsigned short id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+		int input_done = FALSE, ret = FALSE;
+		size_t len = 0, sent = 0, piece_len;
+		const char * piece;
+		struct pollfd pfd;
+		long total = 0;
+		ssize_t wret;
+
+		/* the script, its variables and its arguments */
+		int fits = append_record(request, &len, sizeof(request), SCRIPT_RECORD_BEGIN, id, path, strlen(path)) == OK;
+		for (int i = 0; fits && env[i]; i++) {
+				fits = append_record(request, &len, sizeof(request), SCRIPT_RECORD_PARAM, id, env[i], strlen(env[i])) == OK;
+		}
+		if (!fits || append_args(request, &len, sizeof(request), id, body) == ERROR ||
+		    append_args(request, &len, sizeof(request), id, query) == ERROR) {
+				fprintf(stderr, "ERROR: arguments of the script too long.\n");
+				*keep = TRUE;
+				return ERROR;
+		}
+
+		while (ret == FALSE) {
+				/* more of the body is added while nothing of the records waiting has been sent */
+				if (sent == len) len = sent = 0;
+				while (input_done == FALSE && sent == 0 &&
+				       len + SCRIPT_RECORD_HEADER_SIZE + CONNECTION_BUFFER_SIZE <= sizeof(request)) {
+						if (input->read(input->arg, &piece, &piece_len) == ERROR) return ERROR;
+						append_record(request, &len, sizeof(request), SCRIPT_RECORD_STDIN, id, piece, piece_len);
+						input_done = piece_len == 0;
+				}
+
+				if (sent < len) {
+						wret = send(worker->fd, request + sent, len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+						if (wret > 0) {
+								sent += wret;
+								continue;
+						} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+								perror("ERROR: cannot send the script to the worker");
+								return ERROR;
+						}
+						// the interpreter does not take more input, wait reading its output meanwhile
+						pfd.fd = worker->fd;
+						pfd.events = POLLIN | POLLOUT;
+						if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+								perror("poll");
+								return ERROR;
+						}
+						if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) == 0) continue;
+				}
+
+				if ((ret = worker_read_record(worker, id, output, &total, keep)) == ERROR) return ERROR;
+		}
+
+		/* the script ended, the interpreter still reads its input till the empty STDIN record */
+		if (*keep && (input_done == FALSE || sent < len)) {
+				if (write_all(worker->fd, request + sent, len - sent) == ERROR) {
+						*keep = FALSE;
+				} else if (input_done == FALSE) {
+						len = 0;
+						append_record(request, &len, sizeof(request), SCRIPT_RECORD_STDIN, id, NULL, 0);
+						if (write_all(worker->fd, request, len) == ERROR) *keep = FALSE;
+				}
+		}
+		return total;
+}
+
+/*******************************************************************************************
+* FUNCTION: char ** spawn_arguments(char * interpreter, char * path, Slice body, Slice query)
+* DESCRITPTION: Builds the arguments of an interpreter started for a script: the interpreter,
+* 							the script and the words of the body and then the ones of the url, split
+* 							as append_args does. The array and the strings are in the same block.
+* ARGS_IN: char * interpreter - program of the interpreter
+* 				 char * path - path of the script
+* 				 Slice body - body of the request if it fits in the input buffer
+* 				 Slice query - arguments in the url after the '?'
+* ARGS_OUT: the arguments ended by NULL, to be freed with free, or NULL in case of error
+*******************************************************************************************/
+char ** spawn_arguments(char * interpreter, char * path, Slice body, Slice query) {
+		Slice parts[2] = {body, query};
+		// a slice of n bytes has at most (n + 1) / 2 words, and its words and their '\0' take n + 1
+		size_t max_args = (body.len + 1) / 2 + (query.len + 1) / 2 + 3;
+		char ** argv = malloc(max_args * sizeof(char *) + body.len + query.len + 2);
+		char * p;
+		int n = 0;
+
+		if (argv == NULL) {
+				perror("malloc");
+				return NULL;
+		}
+		p = (char *) (argv + max_args);
+		argv[n++] = interpreter;
+		argv[n++] = path;
+		for (int i = 0; i < 2; i++) {
+				size_t start = 0, end;
+				while (start < parts[i].len) {
+						if (strchr(" \t\n", parts[i].ptr[start])) {
+								start++;
+								continue;
+						}
+						for (end = start; end < parts[i].len && !strchr(" \t\n", parts[i].ptr[end]); end++);
+						argv[n++] = p;
+						memcpy(p, parts[i].ptr + start, end - start);
+						p += end - start;
+						*p++ = '\0';
+						start = end;
+				}
+		}
+		argv[n] = NULL;
+		return argv;
+}
+
+/*******************************************************************************************
+* FUNCTION: int spawn_feed_input(int fd, ScriptInput * input, const char ** piece,
+* 					size_t * piece_len)
+* DESCRITPTION: Writes the next part of the body to the standard input of a script without
+* 							blocking on the pipe. The body is moved from the socket with splice when
+* 							possible, otherwise the pieces given by the input are written, keeping the
+* 							part of the piece that did not fit for the next call.
+* ARGS_IN: int fd - non blocking pipe to the standard input of the script
+* 				 ScriptInput * input - from where the body of the request is read
+* 				 const char ** piece - rest of the last piece, updated
+* 				 size_t * piece_len - length of the rest of the last piece, updated
+* ARGS_OUT: -1 in case of error, TRUE at the end of the body and FALSE otherwise
+*******************************************************************************************/
+int spawn_feed_input(int fd, ScriptInput * input, const char ** piece, size_t * piece_len) {
+		ssize_t ret;
+		size_t moved;
+
+		if (*piece_len == 0) {
+				ret = input->splice(input->arg, fd, &moved);
+				if (ret == ERROR) return ERROR;
+				if (ret == TRUE) return moved == 0;
+				if (ret == CONN_WOULD_BLOCK) return FALSE;
+				if (input->read(input->arg, piece, piece_len) == ERROR) return ERROR;
+				if (*piece_len == 0) return TRUE;
+		}
+
+		ret = write(fd, *piece, *piece_len);
+		if (ret > 0) {
+				*piece += ret;
+				*piece_len -= ret;
+		}
+		// a script that closed its input is seen by poll, the body is then discarded
+		return FALSE;
+}
+
+/*******************************************************************************************
+* FUNCTION: long script_run_spawn(int type, char * path, Slice body, Slice query, char ** env,
+* 					ScriptInput * input, ScriptOutput * output)
+* DESCRITPTION: Runs a script starting a new interpreter for it, without a shell, so none of
+* 							the characters of the request are interpreted. The CGI variables are added
+* 							to the environment of the server, and the body is written to the standard
+* 							input of the script while its output is moved from the pipe to the client
+* 							with splice, never going through userspace, as soon as the script writes it.
+* 							The body is also moved with splice from the socket when it is not chunked.
+* ARGS_IN: int type - PYTHON_SCRIPT or PHP_SCRIPT
+* 				 char * path - path of the script
+* 				 Slice body - body of the request if it fits in the input buffer
+* 				 Slice query - arguments in the url after the '?'
+* 				 char ** env - CGI variables of the request
+* 				 ScriptInput * input - from where the body of the request is read
+* 				 ScriptOutput * output - where the output of the script is sent
+* ARGS_OUT: number of bytes of the output or -1 in case of error
+*******************************************************************************************/
+long script_run_spawn(int type, char * path, Slice body, Slice query, char ** env, ScriptInput * input, ScriptOutput * output) {
+		int in[2], out[2], avail, n_env = 0, n_environ = 0, ret, status = 0;
+		struct pollfd pfd[2];
+		const char * piece = NULL;
+		size_t piece_len = 0;
+		long total = 0;
+		char ** argv, ** envp;
+		pid_t pid;
+
+		/* the variables of the request go first, getenv returns the first one found */
+		while (env[n_env]) n_env++;
+		while (environ[n_environ]) n_environ++;
+		if ((envp = malloc((n_env + n_environ + 1) * sizeof(char *))) == NULL) {
+				perror("malloc");
+				return ERROR;
+		}
+		memcpy(envp, env, n_env * sizeof(char *));
+		memcpy(envp + n_env, environ, (n_environ + 1) * sizeof(char *));
+		if ((argv = spawn_arguments(type == PHP_SCRIPT ? "php" : "python", path, body, query)) == NULL) {
+				free(envp);
+				return ERROR;
+		}
+
+		if (pipe2(in, O_CLOEXEC) < 0) {
+				perror("pipe2");
+				free(argv);
+				free(envp);
+				return ERROR;
+		}
+		if (pipe2(out, O_CLOEXEC) < 0) {
+				perror("pipe2");
+				Close(in[0]);
+				Close(in[1]);
+				free(argv);
+				free(envp);
+				return ERROR;
+		}
+		ret = spawn_interpreter(argv, envp, in[0], out[1], -1, &pid);
+		Close(in[0]);
+		Close(out[1]);
+		free(argv);
+		free(envp);
+		if (ret == ERROR) {
+				Close(in[1]);
+				Close(out[0]);
+				return ERROR;
+		}
+		fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+		/* wait for output and send all the bytes in the pipe, till the script closes it, writing
+		the body to its input meanwhile */
+		pfd[0].fd = out[0];
+		pfd[0].events = POLLIN;
+		pfd[1].fd = in[1];
+		pfd[1].events = POLLOUT;
+		for (;;) {
+				if (poll(pfd, 2, -1) < 0) {
+						if (errno == EINTR) continue;
+						perror("poll");
+						total = ERROR;
+						break;
+				}
+
+				if (pfd[1].revents & POLLERR) {
+						// the script closed its input, the rest of the body is not needed
+						Close(pfd[1].fd);
+						pfd[1].fd = -1;
+				} else if (pfd[1].revents & POLLOUT) {
+						if ((ret = spawn_feed_input(pfd[1].fd, input, &piece, &piece_len)) == ERROR) {
+								total = ERROR;
+								break;
+						} else if (ret == TRUE) {
+								Close(pfd[1].fd);
+								pfd[1].fd = -1;
+						}
+				}
+
+				if (pfd[0].revents == 0) continue;
+				if (ioctl(pfd[0].fd, FIONREAD, &avail) < 0) {
+						perror("ioctl");
+						total = ERROR;
+						break;
+				}
+				if (avail == 0) break;
+				if (output->splice(output->arg, pfd[0].fd, avail) == ERROR) {
+						total = ERROR;
+						break;
+				}
+				total += avail;
+		}
+
+		if (pfd[1].fd != -1) Close(pfd[1].fd);
+		Close(out[0]);
+		if (total == ERROR) kill(pid, SIGKILL);
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+		PROBE2(interpreter_exit, pid, status);
+		return total;
+}
+
+/*******************************************************************************************
+* FUNCTION: long script_run(int type, char * path, Slice body, Slice query, char ** env,
+* 					ScriptInput * input, ScriptOutput * output)
+* DESCRITPTION: Runs a script with the arguments of the request, the ones of the body and then
+* 							the ones of the url, splitted by spaces as the shell would do, sending its
+* 							output while it runs. The body is also given as the standard input of the
+* 							script as it is received, and the CGI variables as its environment. Waits
+* 							for a free interpreter of the pool if all are busy.
+* ARGS_IN: int type - PYTHON_SCRIPT or PHP_SCRIPT
+* 				 char * path - path of the script
+* 				 Slice body - body of the request if it fits in the input buffer
+* 				 Slice query - arguments in the url after the '?'
+* 				 char ** env - CGI variables of the request, "NAME=value" strings ended by NULL
+* 				 ScriptInput * input - from where the body of the request is read
+* 				 ScriptOutput * output - where the output of the script is sent
+* ARGS_OUT: number of bytes of the output or -1 in case of error
+*******************************************************************************************/
+long script_run(int type, char * path, Slice body, Slice query, char ** env, ScriptInput * input, ScriptOutput * output) {
+		ScriptPool * pool = &pools[type == PHP_SCRIPT ? 1 : 0];
+		ScriptWorker * worker;
+		int keep = FALSE;
+		long ret;
+
+		if (pool->size == 0) {
+				return script_run_spawn(type, path, body, query, env, input, output);
+		}
+
+		if ((worker = worker_acquire(pool)) == NULL) {
+				return ERROR;
+		}
+		ret = worker_run(worker, path, body, query, env, input, output, &keep);
+		if (ret != ERROR) {
+				worker->requests++;
+				__atomic_add_fetch(&pool->requests, 1, __ATOMIC_RELAXED);
+		}
+		worker_release(pool, worker, keep == FALSE);
+		return ret;
+}
+
+/*******************************************************************************************
+* FUNCTION: void script_pool_stats(long * requests, long * started)
+* DESCRITPTION: Adds up the counters of both pools.
+* ARGS_IN: long * requests - where the number of scripts run by the interpreters is written
+* 				 long * started - where the number of interpreters started is written
+* ARGS_OUT: None
+*******************************************************************************************/
+void script_pool_stats(long * requests, long * started) {
+		*requests = *started = 0;
+		for (int i = 0; i < 2; i++) {
+				*requests += __atomic_load_n(&pools[i].requests, __ATOMIC_RELAXED);
+				*started += __atomic_load_n(&pools[i].started, __ATOMIC_RELAXED);
+		}
+}
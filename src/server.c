@@ -7,18 +7,60 @@
 /* All defines, data structure definition and constant definition is stored in utils.h */
 #include "../includes/utils.h"
 #include "../includes/http.h"
+#include "../includes/cache.h"
+#include "../includes/compress.h"
+#include "../includes/metrics.h"
+#include "../includes/scripts.h"
+#include "../includes/timer.h"
+#include "../includes/workqueue.h"
 #include "../srclib/picohttpparser.h"
+#include <linux/filter.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 /* GLOBAL VARIABLES */
 /* Server configuration */
 ServerConfiguration server_config;
 
-/* Socket descriptor of the connection */
-int sockfd;
+/* Listening socket of each thread: the same one for every thread in shared listener mode,
+or one SO_REUSEPORT socket per thread in reuseport mode. In acceptor mode only the acceptor
+thread uses the first one */
+int *listen_sockets;
+/* boolean representing if the connections are accepted by the acceptor thread and given to
+the workers through their work queues */
+int acceptor_mode = FALSE;
 
 /* Thread management */
+long nthreads; /* places in the pool: max_workers, or one per CPU with cpu_affinity */
+int *thread_cpus = NULL; /* CPU where each thread is pinned with cpu_affinity */
 pthread_mutex_t mutex; /* mutex to manage concurrent access to the critical zone */
 Thread *threadPool; /* Thread pool array */
+/* boolean representing if the pool grows and shrinks between min_workers and max_workers */
+int pool_scaling = FALSE;
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER; /* protects the places of the pool */
+long live_threads = 0; /* threads of the pool running */
+long used_threads = 0; /* places of the pool that have had a thread */
+long idle_threads = 0; /* threads of the pool waiting for a connection */
+
+/* connections open, never above max_connections. The acceptor waits in the condition
+for one to be closed when there are max_connections */
+long open_connections = 0;
+pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t connections_cond = PTHREAD_COND_INITIALIZER;
+
+/* connections of epoll mode whose next request would block the event loop of their thread (a
+script or a streamed body), waiting for a blocking thread to answer it. The blocking threads
+give them back to their threads through the list and the eventfd of their Thread structure */
+Connection * blocking_head = NULL;
+Connection * blocking_tail = NULL;
+/* protects the queue of the blocking threads and the lists of the connections given back */
+pthread_mutex_t blocking_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t blocking_cond = PTHREAD_COND_INITIALIZER;
+
+/* timers of the connections waiting for their clients in threads mode, shared by all the
+threads and expired by the watchdog thread */
+TimerWheel watchdog;
 
 
 /*******************************************************************************************
@@ -35,10 +77,57 @@ ServerConfiguration get_server_configuration() {
 	cfg_opt_t options[] = {
 		CFG_SIMPLE_STR("server_root", &server_config.server_root),                                                                                                                                                                                                                                                 // global variable
 		CFG_SIMPLE_INT("max_clients", &server_config.max_clients),
+		CFG_SIMPLE_INT("listen_backlog", &server_config.listen_backlog),
+		CFG_SIMPLE_INT("min_workers", &server_config.min_workers),
+		CFG_SIMPLE_INT("max_workers", &server_config.max_workers),
+		CFG_SIMPLE_INT("worker_idle_timeout", &server_config.worker_idle_timeout),
+		CFG_SIMPLE_INT("blocking_workers", &server_config.blocking_workers),
+		CFG_SIMPLE_INT("max_connections", &server_config.max_connections),
+		CFG_SIMPLE_INT("thread_stack_size", &server_config.thread_stack_size),
 		CFG_SIMPLE_INT("listen_port", &server_config.listen_port),
 		CFG_SIMPLE_STR("server_signature", &server_config.server_signature),                                                                                                                                                                                                                                                 // global variable
+		CFG_SIMPLE_STR("server_mode", &server_config.server_mode),
+		CFG_SIMPLE_STR("listener_mode", &server_config.listener_mode),
+		CFG_SIMPLE_INT("cpu_affinity", &server_config.cpu_affinity),
+		CFG_SIMPLE_INT("file_cache_size", &server_config.file_cache_size),
+		CFG_SIMPLE_INT("file_cache_max_file", &server_config.file_cache_max_file),
+		CFG_SIMPLE_INT("fd_cache_entries", &server_config.fd_cache_entries),
+		CFG_SIMPLE_INT("fd_cache_ttl", &server_config.fd_cache_ttl),
+		CFG_SIMPLE_INT("script_workers", &server_config.script_workers),
+		CFG_SIMPLE_INT("script_worker_max_requests", &server_config.script_worker_max_requests),
+		CFG_SIMPLE_INT("max_body_size", &server_config.max_body_size),
+		CFG_SIMPLE_INT("compression_level", &server_config.compression_level),
+		CFG_SIMPLE_INT("compression_min_size", &server_config.compression_min_size),
+		CFG_SIMPLE_STR("compression_types", &server_config.compression_types),
+		CFG_SIMPLE_INT("header_timeout", &server_config.header_timeout),
+		CFG_SIMPLE_INT("body_timeout", &server_config.body_timeout),
+		CFG_SIMPLE_INT("keepalive_timeout", &server_config.keepalive_timeout),
+		CFG_SIMPLE_INT("write_timeout", &server_config.write_timeout),
+		CFG_SIMPLE_STR("status_path", &server_config.status_path),
 		CFG_END()
 	};
+	/* default values for the optional fields, libconfuse takes them from the variables */
+	server_config.worker_idle_timeout = 10;
+	server_config.blocking_workers = 8;
+	server_config.max_connections = 4096;
+	server_config.thread_stack_size = 256 * 1024;
+	server_config.server_mode = strdup("threads");
+	server_config.listener_mode = strdup("shared");
+	server_config.file_cache_size = 32 * 1024 * 1024;
+	server_config.file_cache_max_file = 1024 * 1024;
+	server_config.fd_cache_entries = 1024;
+	server_config.fd_cache_ttl = 60;
+	server_config.script_workers = 4;
+	server_config.script_worker_max_requests = 1000;
+	server_config.max_body_size = 16 * 1024 * 1024;
+	server_config.compression_level = 0;
+	server_config.compression_min_size = 1024;
+	server_config.compression_types = strdup("text/html text/plain text/css application/javascript application/json image/svg+xml");
+	server_config.header_timeout = 10;
+	server_config.body_timeout = 30;
+	server_config.keepalive_timeout = 5;
+	server_config.write_timeout = 30;
+	server_config.status_path = strdup("/server-status");
 	cfg_t* cfg;
 	if ((cfg  = cfg_init(options, 0)) == NULL) {
 		fprintf(stderr, "ERROR: error when using cfg_init.");
@@ -52,12 +141,54 @@ ServerConfiguration get_server_configuration() {
 	}
 	cfg_free(cfg);
 
+	if (strcmp(server_config.server_mode, "threads") != 0 && strcmp(server_config.server_mode, "epoll") != 0) {
+		fprintf(stderr, "ERROR: server_mode must be threads or epoll.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (strcmp(server_config.listener_mode, "shared") != 0 && strcmp(server_config.listener_mode, "reuseport") != 0 &&
+	    strcmp(server_config.listener_mode, "acceptor") != 0) {
+		fprintf(stderr, "ERROR: listener_mode must be shared, reuseport or acceptor.\n");
+		exit(EXIT_FAILURE);
+	}
+	acceptor_mode = (strcmp(server_config.listener_mode, "acceptor") == 0);
+	if (server_config.cpu_affinity && strcmp(server_config.listener_mode, "reuseport") != 0) {
+		fprintf(stderr, "ERROR: cpu_affinity needs listener_mode = reuseport.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* max_clients was the backlog and the number of threads, a configuration that only has it
+	keeps a fixed pool of max_clients threads */
+	if (server_config.listen_backlog <= 0) {
+		server_config.listen_backlog = (server_config.max_clients > 0) ? server_config.max_clients : 128;
+	}
+	if (server_config.max_workers <= 0) {
+		server_config.max_workers = (server_config.max_clients > 0) ? server_config.max_clients : 64;
+	}
+	if (server_config.min_workers <= 0) {
+		server_config.min_workers = (server_config.max_clients > 0) ? server_config.max_workers : 4;
+	}
+	if (server_config.max_connections <= 0 || server_config.worker_idle_timeout <= 0 || server_config.blocking_workers <= 0) {
+		fprintf(stderr, "ERROR: max_connections, worker_idle_timeout and blocking_workers must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+	/* in threads mode each thread serves one connection */
+	if (strcmp(server_config.server_mode, "threads") == 0) {
+		server_config.max_workers = MIN(server_config.max_workers, server_config.max_connections);
+	}
+	server_config.min_workers = MIN(server_config.min_workers, server_config.max_workers);
+	/* reuseport sockets can not come and go without losing the connections of their backlog, and
+	the threads of epoll mode keep their connections */
+	pool_scaling = (strcmp(server_config.server_mode, "threads") == 0 && strcmp(server_config.listener_mode, "reuseport") != 0 &&
+	                server_config.min_workers < server_config.max_workers);
+
 	return server_config;
 }
 
 /*******************************************************************************************
 * FUNCTION: int initiate_server()
-* DESCRITPTION: Initializes the socket, makes it reusable, binds it and starts to listen.
+* DESCRITPTION: Initializes the socket, makes it reusable, binds it and starts to listen. In
+* 							reuseport listener mode the socket is opened with SO_REUSEPORT so that
+* 							several of them can listen in the same port.
 * ARGS_IN: None
 * ARGS_OUT: The executions ends in case of error, otherwise the file descriptor of the
 *						socket is returned.
@@ -73,15 +204,134 @@ int initiate_server() {
 		serv_addr.sin_port = htons(server_config.listen_port);
 
 		/* open the socket, bind and listen */
-		fd = Socket(FAM, SOCK, 0);
+		/* not inherited by the interpreters of the scripts */
+		fd = Socket(FAM, SOCK | SOCK_CLOEXEC, 0);
 		/* so that the port can be reused inmediately */
 		Setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+		/* so that the kernel spreads the connections between the sockets of the threads */
+		if (strcmp(server_config.listener_mode, "reuseport") == 0) {
+				Setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+		}
 		Bind(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-		Listen(fd, server_config.max_clients);
+		Listen(fd, server_config.listen_backlog);
+
+		/* in epoll mode the threads accept till the socket would block, the acceptor thread
+		blocks in accept */
+		if (strcmp(server_config.server_mode, "epoll") == 0 && acceptor_mode == FALSE) {
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+		}
 
 		return fd;
 	}
 
+/*******************************************************************************************
+* FUNCTION: long cpus_init(int ** cpusp)
+* DESCRITPTION: Lists the CPUs where the server is allowed to run, one thread is pinned to each
+* 							of them with cpu_affinity.
+* ARGS_IN: int ** cpusp - pointer to the array of CPUs to be allocated and filled
+* ARGS_OUT: The number of CPUs, the execution ends in case of error.
+*******************************************************************************************/
+long cpus_init(int ** cpusp) {
+		cpu_set_t set;
+		long n = 0;
+
+		if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+				perror("sched_getaffinity");
+				exit(EXIT_FAILURE);
+		}
+		if ((*cpusp = calloc(CPU_COUNT(&set), sizeof(int))) == NULL) {
+				fprintf(stderr, "Error when alocating memory for the CPUs.\n");
+				exit(EXIT_FAILURE);
+		}
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &set)) (*cpusp)[n++] = cpu;
+		}
+		return n;
+}
+
+/*******************************************************************************************
+* FUNCTION: void pin_thread(int thread_num)
+* DESCRITPTION: Pins the calling thread to its CPU, so that the connections it serves stay in
+* 							the caches of that CPU.
+* ARGS_IN: int thread_num - identifier of the thread
+* ARGS_OUT: None
+*******************************************************************************************/
+void pin_thread(int thread_num) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(thread_cpus[thread_num], &set);
+		if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+				perror("pthread_setaffinity_np");
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void steer_connections(int fd, long nthreads)
+* DESCRITPTION: Attaches to the group of reuseport sockets a classic BPF program that gives
+* 							each new connection to the socket of the thread pinned to the CPU that
+* 							received it (the CPU of the softirq, the one of SO_INCOMING_CPU), so the
+* 							socket, its connection and the thread share the caches. The program
+* 							compares the CPU with the one of each thread, socket i being the one of
+* 							thread i; a CPU without a thread gets an invalid index, and the kernel
+* 							then picks the socket by the hash of the connection.
+* ARGS_IN: int fd - any socket of the group, already listening
+* 				 long nthreads - number of threads and sockets
+* ARGS_OUT: None
+*******************************************************************************************/
+void steer_connections(int fd, long nthreads) {
+		struct sock_filter * code;
+		struct sock_fprog prog;
+		long n = 0;
+
+		if ((code = calloc(2 * nthreads + 2, sizeof(struct sock_filter))) == NULL) {
+				fprintf(stderr, "Error when alocating memory for the steering program.\n");
+				return;
+		}
+		/* A = CPU that received the connection */
+		code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+		/* if A == cpu of thread i return i */
+		for (long i = 0; i < nthreads; i++) {
+				code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, thread_cpus[i], 0, 1);
+				code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+		}
+		code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+		prog.len = n;
+		prog.filter = code;
+		if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+				perror("WARNING: SO_ATTACH_REUSEPORT_CBPF, connections are spread by hash");
+		}
+		free(code);
+}
+
+/*******************************************************************************************
+* FUNCTION: void listeners_init(long nthreads, int ** listenersp)
+* DESCRITPTION: Opens the listening sockets of the threads. In shared listener mode all the
+* 							threads share one socket and accept under the mutex, in reuseport mode
+* 							each thread gets its own socket and no lock is needed. With cpu_affinity
+* 							the connections are steered to the socket of the thread of their CPU.
+* ARGS_IN: long nthreads - number of threads in the pool
+*					 int ** listenersp - pointer to the array of sockets to be allocated and filled
+* ARGS_OUT: None
+*******************************************************************************************/
+void listeners_init(long nthreads, int ** listenersp) {
+		if((*listenersp = calloc(nthreads, sizeof(int))) == NULL) {
+				fprintf(stderr, "Error when alocating memory for listening sockets.\n");
+				exit(EXIT_FAILURE);
+		}
+
+		for(int i = 0; i < nthreads; i++) {
+				if (i == 0 || strcmp(server_config.listener_mode, "reuseport") == 0) {
+						(*listenersp)[i] = initiate_server();
+				} else {
+						(*listenersp)[i] = (*listenersp)[0];
+				}
+		}
+
+		/* the sockets are in the group in the order they started to listen */
+		if (server_config.cpu_affinity) steer_connections((*listenersp)[0], nthreads);
+}
+
 /*******************************************************************************************
 * FUNCTION: int accept_connection(int fd)
 * DESCRITPTION: Accepts a connection using the socket descriptor passed as parameter.
@@ -89,40 +339,217 @@ int initiate_server() {
 * ARGS_OUT: Returns the file descriptor of the connection or -1 in case of error.
 *******************************************************************************************/
 int accept_connection(int fd) {
-		struct sockaddr conection;
-		socklen_t len = sizeof(conection);
-		return Accept(fd, &conection, &len);
+		int desc;
+		/* the descriptor is not inherited by the scripts started by the server */
+		while ((desc = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0 && errno == EINTR);
+		if (desc < 0) {
+				perror("accept error");
+		}
+		return desc;
+}
+
+/*******************************************************************************************
+* FUNCTION: void connection_leave()
+* DESCRITPTION: Discounts a connection that has been closed, waking the acceptor if it was
+* 							waiting for it.
+* ARGS_IN: None
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_leave() {
+		if (__atomic_sub_fetch(&open_connections, 1, __ATOMIC_SEQ_CST) == server_config.max_connections - 1) {
+				Pthread_mutex_lock(&connections_mutex);
+				pthread_cond_broadcast(&connections_cond);
+				Pthread_mutex_unlock(&connections_mutex);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int connection_admit()
+* DESCRITPTION: Counts a new connection if there are less than max_connections open.
+* ARGS_IN: None
+* ARGS_OUT: TRUE if the connection can be accepted, FALSE otherwise
+*******************************************************************************************/
+int connection_admit() {
+		if (__atomic_add_fetch(&open_connections, 1, __ATOMIC_SEQ_CST) <= server_config.max_connections) return TRUE;
+		connection_leave();
+		return FALSE;
+}
+
+/*******************************************************************************************
+* FUNCTION: void connection_wait()
+* DESCRITPTION: Waits till there are less than max_connections open.
+* ARGS_IN: None
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_wait() {
+		Pthread_mutex_lock(&connections_mutex);
+		while (__atomic_load_n(&open_connections, __ATOMIC_SEQ_CST) >= server_config.max_connections) {
+				pthread_cond_wait(&connections_cond, &connections_mutex);
+		}
+		Pthread_mutex_unlock(&connections_mutex);
+}
+
+/*******************************************************************************************
+* FUNCTION: void connection_close(Connection * conn)
+* DESCRITPTION: Closes and frees a connection of epoll mode.
+* ARGS_IN: Connection * conn - connection to close
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_close(Connection * conn) {
+		connection_release(conn);
+		free(conn);
+		connection_leave();
+}
+
+/*******************************************************************************************
+* FUNCTION: int pool_grow(void * (*func)(void *))
+* DESCRITPTION: Starts a thread in the first free place of the pool, if it is not full. A
+* 							thread that can not be created is not fatal once the server runs.
+* ARGS_IN: void * (*func)(void *) - function executed by the thread, which receives its place
+* ARGS_OUT: -1 if the pool is full or the thread could not be created, 0 otherwise
+*******************************************************************************************/
+int pool_grow(void * (*func)(void *)) {
+		int n, slot = -1;
+
+		Pthread_mutex_lock(&pool_mutex);
+		if (live_threads < nthreads) {
+				for (slot = 0; threadPool[slot].running; slot++);
+				threadPool[slot].running = TRUE;
+				live_threads++;
+				used_threads = MAX(used_threads, slot + 1);
+		}
+		Pthread_mutex_unlock(&pool_mutex);
+		if (slot < 0) return ERROR;
+
+		/* the acceptor gives it connections from now on */
+		if (acceptor_mode) work_open(slot);
+		if ((n = pthread_create(&threadPool[slot].thread_tid, NULL, func, (void *)(intptr_t) slot)) != 0) {
+				errno = n;
+				perror("pthread_create error");
+				if (acceptor_mode) work_close(slot);
+				Pthread_mutex_lock(&pool_mutex);
+				threadPool[slot].running = FALSE;
+				live_threads--;
+				Pthread_mutex_unlock(&pool_mutex);
+				return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int pool_leave(int thread_num)
+* DESCRITPTION: Lets a thread that has been idle for worker_idle_timeout leave the pool, if
+* 							there are more than min_workers. In acceptor mode it can not leave till it
+* 							has served the connections of its work queue.
+* ARGS_IN: int thread_num - identifier of the thread
+* ARGS_OUT: TRUE if the thread must end, FALSE if it stays
+*******************************************************************************************/
+int pool_leave(int thread_num) {
+		int ret = FALSE;
+
+		Pthread_mutex_lock(&pool_mutex);
+		if (live_threads > server_config.min_workers && (!acceptor_mode || work_close(thread_num) == OK)) {
+				threadPool[thread_num].running = FALSE;
+				live_threads--;
+				ret = TRUE;
+		}
+		Pthread_mutex_unlock(&pool_mutex);
+		return ret;
+}
+
+/*******************************************************************************************
+* FUNCTION: int accept_idle(int fd, int * expired)
+* DESCRITPTION: Accepts a connection from the shared socket for a thread of a pool that
+* 							scales, waiting for the mutex and then for the connection no longer than
+* 							worker_idle_timeout in all, so that every idle thread gives up at the
+* 							same time and not one after the other.
+* ARGS_IN: int fd - shared listening socket
+* 				 int * expired - set to TRUE if the thread gave up
+* ARGS_OUT: Returns the file descriptor of the connection or -1.
+*******************************************************************************************/
+int accept_idle(int fd, int * expired) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		struct timespec deadline, now;
+		int n, connfd = -1;
+
+		*expired = FALSE;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += server_config.worker_idle_timeout;
+		if ((n = pthread_mutex_clocklock(&mutex, CLOCK_MONOTONIC, &deadline)) != 0) {
+				*expired = (n == ETIMEDOUT);
+				return -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		n = MAX(0, (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000);
+		while ((n = poll(&pfd, 1, n)) < 0 && errno == EINTR) n = 0;
+		if (n == 0) *expired = TRUE;
+		else connfd = accept_connection(fd);
+		Pthread_mutex_unlock(&mutex);
+		return connfd;
 }
 
 /*******************************************************************************************
 * FUNCTION: void* thread_main(void *arg)
 * DESCRITPTION: Function executed by each thread. Each thread waits in the mutex till
-* 							another one unlocks the mutex because it has accepted a connection.
+* 							another one unlocks the mutex because it has accepted a connection. In
+* 							reuseport listener mode each thread accepts from its own socket without
+* 							the mutex. When the pool scales, the last idle thread that gets a
+* 							connection starts another one, and a thread without connections for
+* 							worker_idle_timeout leaves.
 * ARGS_IN: void * arg - an int pointer to the thread_num of the current thread
 * ARGS_OUT: None
 *******************************************************************************************/
 void* thread_main(void *arg) {
-		int connfd;
+		int connfd, idle, expired, thread_num = (intptr_t) arg;
+		int shared = (strcmp(server_config.listener_mode, "shared") == 0);
+		int timeout = pool_scaling ? server_config.worker_idle_timeout * 1000 : -1;
+		Connection conn;
 
 		/* Threads are detacched because main thread cannot join them,
 		   as they are caught up in the mutex and the accept */
 		Pthread_detach(pthread_self());
+		if (server_config.cpu_affinity) pin_thread(thread_num);
 
-		/* each thread accepts connections forever */
+		/* each thread accepts connections till it leaves the pool */
 		for (;;) {
-				/* the socket must be protected with a mutex because it is a global variable */
-				Pthread_mutex_lock(&mutex);
-				connfd = accept_connection(sockfd);
-				Pthread_mutex_unlock(&mutex);
+				__atomic_add_fetch(&idle_threads, 1, __ATOMIC_SEQ_CST);
+				if (acceptor_mode) {
+						/* the acceptor thread accepts for every thread, an idle one steals the connections
+						given to the busy ones */
+						connfd = work_next(thread_num, timeout);
+						expired = (connfd < 0);
+				} else {
+						/* a shared socket must be protected with a mutex because it is a global variable */
+						if (pool_scaling) {
+								connfd = accept_idle(listen_sockets[thread_num], &expired);
+						} else {
+								if (shared) Pthread_mutex_lock(&mutex);
+								connfd = accept_connection(listen_sockets[thread_num]);
+								if (shared) Pthread_mutex_unlock(&mutex);
+						}
+						/* not more than max_connections, as there are not more threads */
+						if (connfd >= 0) __atomic_add_fetch(&open_connections, 1, __ATOMIC_SEQ_CST);
+				}
+				idle = __atomic_sub_fetch(&idle_threads, 1, __ATOMIC_SEQ_CST);
 
-				/* thread_count attribute of the thread counts the number of connections stablished by the client
-				by the current thread */
-				threadPool[(intptr_t) arg].thread_count++;
+				if (pool_scaling) {
+						/* the idle timeout has expired */
+						if (expired) {
+								if (pool_leave(thread_num)) return NULL;
+								continue;
+						}
+						/* another thread waits for the next connection */
+						if (idle == 0) pool_grow(thread_main);
+				}
 
 				if(connfd >= 0) {
-						/* connetion is persistent so while the process_http_request does not send an END_OF_CONNECTION, keep answering
+						/* connetion is persistent so while the handle_connection does not send an END_OF_CONNECTION, keep answering
 						all the requests carried out by the client */
-						while(process_http_request(connfd, server_config.server_root, server_config.server_signature) != END_OF_CONNECTION);
+						connection_init(&conn, connfd, FALSE, &watchdog, metrics_thread(thread_num));
+						while(handle_connection(&conn, server_config.server_root, server_config.server_signature) != END_OF_CONNECTION);
+						connection_release(&conn);
+						connection_leave();
 
 				} else {
 						fprintf(stderr, "ERROR: invalid connection.\n");
@@ -130,32 +557,450 @@ void* thread_main(void *arg) {
 		}
 	}
 
+/*******************************************************************************************
+* FUNCTION: int epoll_add_connection(int epfd, Connection * conn)
+* DESCRITPTION: Adds a non blocking connection to the epoll instance of a thread, edge triggered.
+* 							The socket is reported at once if it is already readable or writable.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 Connection * conn - connection to add
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int epoll_add_connection(int epfd, Connection * conn) {
+		struct epoll_event ev;
+
+		/* the same registration waits for both directions, the state of the connection
+		decides what to do when it is woken up */
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+				perror("epoll_ctl error");
+				return ERROR;
+		}
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: void watchdog_expired(Timer * timer)
+* DESCRITPTION: Ends a connection of threads mode that has waited too long for its client. The
+* 							socket is only shut down, the read where its thread is blocked returns and
+* 							the thread closes it.
+* ARGS_IN: Timer * timer - timer of the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void watchdog_expired(Timer * timer) {
+		shutdown(((Connection *) timer->data)->fd, SHUT_RDWR);
+}
+
+/*******************************************************************************************
+* FUNCTION: void* watchdog_main(void *arg)
+* DESCRITPTION: Function executed by the watchdog thread in threads mode, which expires the
+* 							timers of the connections every tick.
+* ARGS_IN: void * arg - not used
+* ARGS_OUT: None
+*******************************************************************************************/
+void* watchdog_main(void *arg) {
+		Pthread_detach(pthread_self());
+
+		for (;;) {
+				usleep(TIMER_TICK_MS * 1000);
+				timer_expire(&watchdog, timer_now(), watchdog_expired);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void connection_expired(Timer * timer)
+* DESCRITPTION: Closes a connection of epoll mode that has waited too long for its client.
+* ARGS_IN: Timer * timer - timer of the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_expired(Timer * timer) {
+		connection_close(timer->data);
+}
+
+/*******************************************************************************************
+* FUNCTION: void register_connection(int epfd, int connfd, int thread_num, TimerWheel * wheel)
+* DESCRITPTION: Registers a non blocking connection in the epoll instance of the thread, edge
+* 							triggered.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 int connfd - socket descriptor of the connection
+* 				 int thread_num - identifier of the thread that serves the connection
+* 				 TimerWheel * wheel - timers of the connections of the thread
+* ARGS_OUT: None
+*******************************************************************************************/
+void register_connection(int epfd, int connfd, int thread_num, TimerWheel * wheel) {
+		Connection * conn;
+
+		if ((conn = malloc(sizeof(Connection))) == NULL) {
+				fprintf(stderr, "ERROR: error when allocating memory for a connection.\n");
+				Close(connfd);
+				connection_leave();
+				return;
+		}
+		connection_init(conn, connfd, TRUE, wheel, metrics_thread(thread_num));
+		conn->owner = thread_num;
+		if (epoll_add_connection(epfd, conn) == ERROR) {
+				connection_close(conn);
+				return;
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: int accept_pending_connections(int epfd, int thread_num, TimerWheel * wheel)
+* DESCRITPTION: Accepts every connection waiting in the non blocking listening socket of the
+* 							thread and registers them in the epoll instance of the thread, while there
+* 							are less than max_connections open.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 int thread_num - identifier of the thread accepting the connections
+* 				 TimerWheel * wheel - timers of the connections of the thread
+* ARGS_OUT: TRUE if it stopped because of max_connections, FALSE otherwise
+*******************************************************************************************/
+int accept_pending_connections(int epfd, int thread_num, TimerWheel * wheel) {
+		int connfd;
+
+		for (;;) {
+				if (!connection_admit()) return TRUE;
+				connfd = accept4(listen_sockets[thread_num], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (connfd < 0) {
+						connection_leave();
+						if (errno == EINTR) continue;
+						// EAGAIN means every pending connection has been accepted (or another thread got it)
+						if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept4 error");
+						return FALSE;
+				}
+				register_connection(epfd, connfd, thread_num, wheel);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void take_pending_connections(int epfd, int thread_num, TimerWheel * wheel)
+* DESCRITPTION: Registers in the epoll instance of the thread every connection of its work
+* 							queue, and those of the queues of the other threads, which are busy if
+* 							they have not taken them yet.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 int thread_num - identifier of the thread taking the connections
+* 				 TimerWheel * wheel - timers of the connections of the thread
+* ARGS_OUT: None
+*******************************************************************************************/
+void take_pending_connections(int epfd, int thread_num, TimerWheel * wheel) {
+		int connfd;
+
+		while ((connfd = work_take(thread_num)) >= 0) {
+				register_connection(epfd, connfd, thread_num, wheel);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void* acceptor_main(void *arg)
+* DESCRITPTION: Function executed by the acceptor thread in acceptor listener mode, which
+* 							accepts every connection and gives it to a worker. With max_connections
+* 							open it waits for one to be closed, and the new ones wait in the backlog.
+* ARGS_IN: void * arg - not used
+* ARGS_OUT: None
+*******************************************************************************************/
+void* acceptor_main(void *arg) {
+		int connfd, flags = SOCK_CLOEXEC;
+
+		Pthread_detach(pthread_self());
+
+		/* the sockets of epoll mode are born non blocking */
+		if (strcmp(server_config.server_mode, "epoll") == 0) flags |= SOCK_NONBLOCK;
+		for (;;) {
+				while (!connection_admit()) connection_wait();
+				while ((connfd = accept4(listen_sockets[0], NULL, NULL, flags)) < 0 && errno == EINTR);
+				if (connfd < 0) {
+						perror("accept error");
+						connection_leave();
+						continue;
+				}
+				work_dispatch(connfd);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void connection_offload(int epfd, Connection * conn)
+* DESCRITPTION: Hands a connection whose next request would block the event loop to the
+* 							blocking threads. The thread forgets it, its events and its timer, till it
+* 							is given back.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 Connection * conn - connection to hand off
+* ARGS_OUT: None
+*******************************************************************************************/
+void connection_offload(int epfd, Connection * conn) {
+		if (epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL) < 0) {
+				perror("epoll_ctl error");
+				connection_close(conn);
+				return;
+		}
+		timer_cancel(conn->watchdog, &conn->timer);
+		conn->watchdog = NULL;
+
+		conn->next = NULL;
+		Pthread_mutex_lock(&blocking_mutex);
+		if (blocking_tail) blocking_tail->next = conn;
+		else blocking_head = conn;
+		blocking_tail = conn;
+		pthread_cond_signal(&blocking_cond);
+		Pthread_mutex_unlock(&blocking_mutex);
+}
+
+/*******************************************************************************************
+* FUNCTION: void take_returned_connections(int epfd, int thread_num, TimerWheel * wheel)
+* DESCRITPTION: Registers again in the epoll instance of the thread the connections given back
+* 							by the blocking threads, with their timers armed.
+* ARGS_IN: int epfd - epoll instance of the thread
+* 				 int thread_num - identifier of the thread
+* 				 TimerWheel * wheel - timers of the connections of the thread
+* ARGS_OUT: None
+*******************************************************************************************/
+void take_returned_connections(int epfd, int thread_num, TimerWheel * wheel) {
+		Connection * conn, * next;
+		uint64_t wakeups;
+
+		if (read(threadPool[thread_num].return_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) perror("read eventfd");
+		Pthread_mutex_lock(&blocking_mutex);
+		conn = threadPool[thread_num].returned;
+		threadPool[thread_num].returned = NULL;
+		Pthread_mutex_unlock(&blocking_mutex);
+
+		for (; conn; conn = next) {
+				next = conn->next;
+				conn->watchdog = wheel;
+				connection_watch(conn);
+				/* the socket is reported at once if the client sent something meanwhile */
+				if (epoll_add_connection(epfd, conn) == ERROR) connection_close(conn);
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void* blocking_main(void *arg)
+* DESCRITPTION: Function executed by each blocking thread in epoll mode, which answers the
+* 							requests handed off by the event loops and runs the state machine of their
+* 							connections till they would block, blocking in the socket while a body or
+* 							the output of a script are streamed. Then the connection is given back to
+* 							its thread, or closed. While a blocking thread has it, it counts in the
+* 							counters of the blocking thread, as those of each thread are only written
+* 							by it.
+* ARGS_IN: void * arg - place of the thread among the blocking threads
+* ARGS_OUT: None
+*******************************************************************************************/
+void* blocking_main(void *arg) {
+		Metrics * metrics = metrics_thread(nthreads + (intptr_t) arg), * owner_metrics;
+		Connection * conn;
+		uint64_t one = 1;
+		int owner;
+
+		Pthread_detach(pthread_self());
+
+		for (;;) {
+				Pthread_mutex_lock(&blocking_mutex);
+				while (blocking_head == NULL) pthread_cond_wait(&blocking_cond, &blocking_mutex);
+				conn = blocking_head;
+				if ((blocking_head = conn->next) == NULL) blocking_tail = NULL;
+				Pthread_mutex_unlock(&blocking_mutex);
+
+				owner_metrics = conn->metrics;
+				conn->metrics = metrics;
+				conn->offloaded = TRUE;
+				if (handle_connection(conn, server_config.server_root, server_config.server_signature) == END_OF_CONNECTION) {
+						connection_close(conn);
+						continue;
+				}
+				conn->offloaded = FALSE;
+				conn->metrics = owner_metrics;
+
+				/* the connection belongs to its thread again once it is in the list */
+				owner = conn->owner;
+				Pthread_mutex_lock(&blocking_mutex);
+				conn->next = threadPool[owner].returned;
+				threadPool[owner].returned = conn;
+				Pthread_mutex_unlock(&blocking_mutex);
+				if (write(threadPool[owner].return_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void* thread_main_epoll(void *arg)
+* DESCRITPTION: Function executed by each thread in epoll mode. Each thread runs its own edge
+* 							triggered event loop, accepting connections from its listening socket
+* 							(shared or its own SO_REUSEPORT one) and serving all of them without blocking, so idle keep alive
+* 							connections only cost their Connection structure. The connections waiting
+* 							for their clients are timed by a timing wheel of the thread, which sets
+* 							the timeout of epoll_wait. With max_connections open the listening socket
+* 							is removed from the epoll instance till one of them is closed. The
+* 							requests that would block the loop, with a script or a streamed body, are
+* 							handed off to the blocking threads together with their connections.
+* ARGS_IN: void * arg - an int pointer to the thread_num of the current thread
+* ARGS_OUT: None
+*******************************************************************************************/
+void* thread_main_epoll(void *arg) {
+		int epfd, fd, n, ret, timeout, paused = FALSE, thread_num = (intptr_t) arg;
+		struct epoll_event ev, events[MAX_EPOLL_EVENTS];
+		Connection * conn;
+		TimerWheel wheel;
+		uint64_t wakeups;
+
+		Pthread_detach(pthread_self());
+		if (server_config.cpu_affinity) pin_thread(thread_num);
+
+		if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+				perror("epoll_create1 error");
+				exit(EXIT_FAILURE);
+		}
+
+		/* the listening socket is identified by a NULL pointer, EPOLLEXCLUSIVE avoids waking
+		up every thread for each new connection when the socket is shared. In acceptor mode the
+		descriptor that wakes the thread when it is given connections is identified by the Thread
+		structure of the thread instead */
+		if (acceptor_mode) {
+				ev.events = EPOLLIN;
+				ev.data.ptr = &threadPool[thread_num];
+				fd = work_wake_fd(thread_num);
+		} else {
+				ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+				ev.data.ptr = NULL;
+				fd = listen_sockets[thread_num];
+		}
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				perror("epoll_ctl error");
+				exit(EXIT_FAILURE);
+		}
+		/* the descriptor that wakes the thread when the blocking threads give it back connections
+		is identified by its place in the Thread structure */
+		ev.events = EPOLLIN;
+		ev.data.ptr = &threadPool[thread_num].return_fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, threadPool[thread_num].return_fd, &ev) < 0) {
+				perror("epoll_ctl error");
+				exit(EXIT_FAILURE);
+		}
+		timer_wheel_init(&wheel, FALSE);
+
+		for (;;) {
+				/* the listening socket is level triggered, it is left out while no connection can be
+				accepted, and the thread looks every tick if one has been closed */
+				if (paused && __atomic_load_n(&open_connections, __ATOMIC_SEQ_CST) < server_config.max_connections) {
+						ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+						ev.data.ptr = NULL;
+						if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) paused = FALSE;
+				}
+				timeout = timer_wheel_next(&wheel, timer_now());
+				if (paused && (timeout < 0 || timeout > TIMER_TICK_MS)) timeout = TIMER_TICK_MS;
+
+				/* the connections given while the thread was busy, to it or to others that are still
+				busy, are taken before waiting */
+				if (acceptor_mode) {
+						work_idle(thread_num, TRUE);
+						take_pending_connections(epfd, thread_num, &wheel);
+				}
+				n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout);
+				if (acceptor_mode) work_idle(thread_num, FALSE);
+				if (n < 0) {
+						if (errno != EINTR) perror("epoll_wait error");
+						continue;
+				}
+
+				for (int i = 0; i < n; i++) {
+						if (events[i].data.ptr == NULL) {
+								if (!paused && accept_pending_connections(epfd, thread_num, &wheel)) {
+										epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+										paused = TRUE;
+								}
+								continue;
+						}
+						if (events[i].data.ptr == &threadPool[thread_num].return_fd) {
+								take_returned_connections(epfd, thread_num, &wheel);
+								continue;
+						}
+						if (events[i].data.ptr == &threadPool[thread_num]) {
+								if (read(fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) perror("read eventfd");
+								take_pending_connections(epfd, thread_num, &wheel);
+								continue;
+						}
+
+						/* run the state machine of the connection till it would block, or till a request
+						that would block the thread, which is answered by a blocking thread */
+						conn = events[i].data.ptr;
+						if ((events[i].events & EPOLLERR) ||
+						    (ret = handle_connection(conn, server_config.server_root, server_config.server_signature)) == END_OF_CONNECTION) {
+								/* closing the descriptor also removes it from the epoll instance */
+								connection_close(conn);
+						} else if (ret == CONN_OFFLOAD) {
+								connection_offload(epfd, conn);
+						}
+				}
+
+				/* the connections are closed once the events of the batch, which may point to them,
+				have been handled */
+				timer_expire(&wheel, timer_now(), connection_expired);
+		}
+}
+
 /*******************************************************************************************
 * FUNCTION: void threads_init(long nthreads, Thread ** poolp)
 * DESCRITPTION: This function initilizes nthreads threads and saves its relevant information
 *								into the Thread arrray. The global mutex to access the critical zone is also
-* 							initialized. Each thread will execute the thread_main function.
-* ARGS_IN: long nthreads - number of threads in the pool
+* 							initialized. Each thread will execute the thread_main function, together
+* 							with the watchdog thread, or thread_main_epoll in epoll mode, together
+* 							with the blocking threads. In acceptor
+* 							listener mode the acceptor thread is started too. A pool that scales
+* 							starts with min_workers threads.
+* ARGS_IN: long nthreads - number of places in the pool
 *					 Thread ** poolp - pointer to the pool array to be initialized, and allocated
 * ARGS_OUT: None
 *******************************************************************************************/
 void threads_init(long nthreads, Thread ** poolp) {
+		void * (*func)(void *) = thread_main;
+		long nblocking = 0;
+		pthread_t tid;
+
 		/* mutex initialized for access to the critical zone (global variables) */
 		pthread_mutex_init(&mutex,NULL);
 
+		if (strcmp(server_config.server_mode, "epoll") == 0) {
+				func = thread_main_epoll;
+				nblocking = server_config.blocking_workers;
+		} else {
+				/* the threads block in their connections, another one ends those that wait too long */
+				timer_wheel_init(&watchdog, TRUE);
+				Pthread_create(&tid, watchdog_main, NULL);
+		}
+
 		/* memory is allocated in order to store the information abou the threads */
 		if((*poolp = calloc(nthreads, sizeof(Thread))) == NULL) {
 				fprintf(stderr, "Error when alocating memory for threads.\n");
 				exit(EXIT_FAILURE);
 		}
 
-		/* start all the threads, saving their information into the array */
+		/* each thread counts in its own cache lines, the blocking threads after the pool */
+		if (metrics_init(nthreads + nblocking) == ERROR) {
+				exit(EXIT_FAILURE);
+		}
+
+		/* in acceptor mode the connections reach the threads through their work queues */
+		if (acceptor_mode && work_queues_init(nthreads) == ERROR) {
+				exit(EXIT_FAILURE);
+		}
+
+		/* the thread_num field is an identifier only valid inside our program */
 		for(int i = 0; i < nthreads; i++) {
-				/* each created thread  will execute the thread_main function */
-				Pthread_create(&((*poolp)[i].thread_tid), thread_main, (void *)(intptr_t)i);
-				/* the thread_num field is an identifier only valid inside our program */
 				(*poolp)[i].thread_num = i;
+				if (nblocking && ((*poolp)[i].return_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+						perror("eventfd");
+						exit(EXIT_FAILURE);
+				}
+		}
+
+		/* the blocking threads of epoll mode */
+		for (long i = 0; i < nblocking; i++) {
+				Pthread_create(&tid, blocking_main, (void *)(intptr_t) i);
 		}
+
+		/* start the threads, saving their information into the array */
+		for(long i = 0; i < (pool_scaling ? server_config.min_workers : nthreads); i++) {
+				if (pool_grow(func) == ERROR) exit(EXIT_FAILURE);
+		}
+
+		/* the acceptor starts once every thread has its work queue */
+		if (acceptor_mode) Pthread_create(&tid, acceptor_main, NULL);
 	}
 
 /*******************************************************************************************
@@ -186,18 +1031,49 @@ int main(int argc, char **argv) {
 		containing the different fields: nº of clients, port, nº of threads & server signature */
 		server_config = get_server_configuration();
 
-		/* here the socket is oppened, binded and starts to listen */
-		sockfd = initiate_server();
+		/* here the sockets are oppened, binded and start to listen */
+		nthreads = server_config.max_workers;
+		if (server_config.cpu_affinity) nthreads = cpus_init(&thread_cpus);
+		listeners_init(nthreads, &listen_sockets);
 		printf("Listening connections. SIGINT to close server.\n");
 
+		/* sendfile has no MSG_NOSIGNAL, a client closing the connection must not kill the server */
+		signal(SIGPIPE, SIG_IGN);
+
 		/* block SIGINT for child threads */
 		sigset_t set;
 		sigemptyset(&set);
 		sigaddset(&set, SIGINT);
 		pthread_sigmask(SIG_BLOCK, &set, NULL);
 
+		/* every thread is created with thread_stack_size bytes of stack instead of the default of
+		the system (8 MB of address space each, usually) */
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if ((errno = pthread_attr_setstacksize(&attr, server_config.thread_stack_size)) != 0 ||
+		    (errno = pthread_setattr_default_np(&attr)) != 0) {
+				perror("ERROR: thread_stack_size");
+				exit(EXIT_FAILURE);
+		}
+		pthread_attr_destroy(&attr);
+
+		/* the replies and the caches must be ready before any thread serves a request */
+		if (http_init(server_config.server_signature, server_config.max_body_size) == ERROR) {
+				exit(EXIT_FAILURE);
+		}
+		http_timeouts_init(server_config.header_timeout, server_config.body_timeout,
+		                   server_config.keepalive_timeout, server_config.write_timeout);
+		http_status_init(server_config.status_path);
+		file_cache_init(server_config.file_cache_size, server_config.file_cache_max_file);
+		fd_cache_init(server_config.fd_cache_entries, server_config.fd_cache_ttl);
+		compress_init(server_config.compression_level, server_config.compression_min_size, server_config.compression_types);
+		script_pool_init(server_config.script_workers, server_config.script_worker_max_requests);
+		if (cache_watch_init(server_config.server_root) == ERROR) {
+				fprintf(stderr, "WARNING: inotify not available, cached files are checked with stat.\n");
+		}
+
 		/* thread pool is created and started, together with a mutex to access the critical zone */
-		threads_init(server_config.max_clients, &threadPool);
+		threads_init(nthreads, &threadPool);
 
 		/* everything done by threads, wait SIGINT signal to close server */
 		struct sigaction act;
@@ -210,14 +1086,28 @@ int main(int argc, char **argv) {
 
 		/* print the number of connections each thread has received, before leaving */
 		printf("\n");
-		for (int i = 0; i < server_config.max_clients; i++) {
-				printf("thread %d, %ld connections\n", i, threadPool[i].thread_count);
+		for (int i = 0; i < used_threads; i++) {
+				printf("thread %d, %ld connections\n", i, metrics_thread(i)->connections);
 		}
+		long hits, misses, bytes;
+		file_cache_stats(&hits, &misses, &bytes);
+		printf("file cache: %ld hits, %ld misses, %ld bytes cached\n", hits, misses, bytes);
+		long negative_hits;
+		fd_cache_stats(&hits, &misses, &negative_hits);
+		printf("descriptor cache: %ld hits, %ld misses, %ld not found hits\n", hits, misses, negative_hits);
+		long scripts, started;
+		script_pool_stats(&scripts, &started);
+		printf("script workers: %ld scripts run, %ld interpreters started\n", scripts, started);
 
 		/* clean before leaving */
 		if (threadPool) free(threadPool);
+		if (listen_sockets) free(listen_sockets);
+		if (thread_cpus) free(thread_cpus);
 		if (server_config.server_root) free(server_config.server_root);
 		if (server_config.server_signature) free(server_config.server_signature);
+		if (server_config.server_mode) free(server_config.server_mode);
+		if (server_config.listener_mode) free(server_config.listener_mode);
+		if (server_config.status_path) free(server_config.status_path);
 
 		exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,195 @@
+/*******************************************************************************************
+* FILE: timer.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Hierarchical timing wheels. Time goes in ticks of TIMER_TICK_MS and each wheel
+* 							has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS lists of timers: the
+* 							lowest level has one list per tick of the current round of slots, and each
+* 							level above one list per round of the level below. A timer goes to the
+* 							lowest level where it expires in the current round, so arming, moving and
+* 							cancelling a timer only links or unlinks it from a list, and each tick
+* 							only looks at one list of the lowest level. When a round of a level ends,
+* 							the next list of the level above is moved down, each timer once per level.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/timer.h"
+#include <time.h>
+
+
+/*******************************************************************************************
+* FUNCTION: long long timer_now()
+* DESCRITPTION: Gives the current time of the monotonic clock with the precision of the
+* 							kernel tick, which is read without a system call.
+* ARGS_IN: None
+* ARGS_OUT: the time in milliseconds
+*******************************************************************************************/
+long long timer_now() {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_wheel_init(TimerWheel * wheel, int locked)
+* DESCRITPTION: Initializes an empty timing wheel starting at the current time.
+* ARGS_IN: TimerWheel * wheel - wheel to initialize
+* 				 int locked - TRUE if several threads use the wheel, which is then protected by a
+* 											mutex, FALSE if only the thread that owns it does
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_wheel_init(TimerWheel * wheel, int locked) {
+		memset(wheel, 0, sizeof(TimerWheel));
+		wheel->tick = timer_now() / TIMER_TICK_MS;
+		wheel->locked = locked;
+		if (locked) pthread_mutex_init(&wheel->lock, NULL);
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_link(TimerWheel * wheel, Timer * timer)
+* DESCRITPTION: Links a timer in the list of the wheel where it expires: the lowest level in
+* 							which the tick of the timer is in the current round, the one that has the
+* 							same upper bits as the current tick.
+* ARGS_IN: TimerWheel * wheel - wheel where the timer is linked
+* 				 Timer * timer - timer with the tick in which it expires, not before the current one
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_link(TimerWheel * wheel, Timer * timer) {
+		long long diff = timer->expires ^ wheel->tick;
+		int level = 0;
+		Timer ** list;
+
+		while (level < TIMER_WHEEL_LEVELS - 1 && (diff >> (TIMER_WHEEL_BITS * (level + 1))) != 0) level++;
+		list = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+
+		timer->next = *list;
+		if (*list) (*list)->pprev = &timer->next;
+		timer->pprev = list;
+		*list = timer;
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_unlink(Timer * timer)
+* DESCRITPTION: Unlinks a timer from the list where it is.
+* ARGS_IN: Timer * timer - armed timer
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_unlink(Timer * timer) {
+		*timer->pprev = timer->next;
+		if (timer->next) timer->next->pprev = timer->pprev;
+		timer->next = NULL;
+		timer->pprev = NULL;
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_arm(TimerWheel * wheel, Timer * timer, long long deadline)
+* DESCRITPTION: Arms a timer to expire at a given time, or moves it if it was already armed.
+* 							Costs the same whatever the number of timers of the wheel.
+* ARGS_IN: TimerWheel * wheel - wheel where the timer is armed
+* 				 Timer * timer - timer to arm, its data field is not modified
+* 				 long long deadline - time of timer_now at which it expires, rounded up to the
+* 															next tick
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_arm(TimerWheel * wheel, Timer * timer, long long deadline) {
+		long long expires = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+		if (wheel->locked) pthread_mutex_lock(&wheel->lock);
+
+		/* the current tick has been processed already, and the upper level can only hold one round */
+		expires = MAX(expires, wheel->tick + 1);
+		expires = MIN(expires, wheel->tick + ((long long)(TIMER_WHEEL_SLOTS - 1) << (TIMER_WHEEL_BITS * (TIMER_WHEEL_LEVELS - 1))));
+		/* a timer armed again with the same deadline, f.e. while a request arrives, stays where it is */
+		if (timer->pprev == NULL || timer->expires != expires) {
+				if (timer->pprev) timer_unlink(timer);
+				else wheel->count++;
+				timer->expires = expires;
+				timer_link(wheel, timer);
+		}
+
+		if (wheel->locked) pthread_mutex_unlock(&wheel->lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_cancel(TimerWheel * wheel, Timer * timer)
+* DESCRITPTION: Disarms a timer, nothing is done if it is not armed.
+* ARGS_IN: TimerWheel * wheel - wheel where the timer was armed
+* 				 Timer * timer - timer to disarm
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_cancel(TimerWheel * wheel, Timer * timer) {
+		if (wheel->locked) pthread_mutex_lock(&wheel->lock);
+		if (timer->pprev) {
+				timer_unlink(timer);
+				wheel->count--;
+		}
+		if (wheel->locked) pthread_mutex_unlock(&wheel->lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: void timer_expire(TimerWheel * wheel, long long now, void (*expired)(Timer * timer))
+* DESCRITPTION: Moves the wheel to the current time, calling the function for each timer that
+* 							expires, already disarmed. In a locked wheel the function is called with
+* 							the mutex held, so it runs before a timer_cancel of the same timer returns.
+* ARGS_IN: TimerWheel * wheel - wheel to move
+* 				 long long now - current time of timer_now
+* 				 void (*expired)(Timer * timer) - function called for each expired timer
+* ARGS_OUT: None
+*******************************************************************************************/
+void timer_expire(TimerWheel * wheel, long long now, void (*expired)(Timer * timer)) {
+		long long target = now / TIMER_TICK_MS;
+		Timer * timer, * next;
+		int level;
+
+		if (wheel->locked) pthread_mutex_lock(&wheel->lock);
+
+		while (wheel->tick < target) {
+				wheel->tick++;
+
+				/* at the end of a round of a level the next list of the level above is moved down,
+				starting from the highest level whose round ends, as its timers may go to the next list
+				of the level below */
+				for (level = 1; level < TIMER_WHEEL_LEVELS && (wheel->tick & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) == 0; level++);
+				while (--level > 0) {
+						Timer ** list = &wheel->slots[level][(wheel->tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+						timer = *list;
+						*list = NULL;
+						for (; timer; timer = next) {
+								next = timer->next;
+								timer_link(wheel, timer);
+						}
+				}
+
+				/* every timer of the list of the tick expires now */
+				Timer ** list = &wheel->slots[0][wheel->tick & (TIMER_WHEEL_SLOTS - 1)];
+				while ((timer = *list) != NULL) {
+						timer_unlink(timer);
+						wheel->count--;
+						expired(timer);
+				}
+
+				/* nothing to do in the ticks till the next one with timers */
+				if (wheel->count == 0) wheel->tick = target;
+		}
+
+		if (wheel->locked) pthread_mutex_unlock(&wheel->lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: int timer_wheel_next(TimerWheel * wheel, long long now)
+* DESCRITPTION: Tells how long the owner of the wheel can sleep before calling timer_expire,
+* 							f.e. as the timeout of epoll_wait. It is the next tick with timers in the
+* 							lowest level, or the next time the upper levels are moved down to it.
+* ARGS_IN: TimerWheel * wheel - wheel of the owner
+* 				 long long now - current time of timer_now
+* ARGS_OUT: the number of milliseconds, -1 if there is no timer armed
+*******************************************************************************************/
+int timer_wheel_next(TimerWheel * wheel, long long now) {
+		long long tick = wheel->tick + 1;
+
+		if (wheel->count == 0) return -1;
+
+		/* the lists of the rest of the round of the lowest level, the round ends at the latest */
+		while ((tick & (TIMER_WHEEL_SLOTS - 1)) != 0 && wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)] == NULL) tick++;
+		return (int) MAX(0, tick * TIMER_TICK_MS - now);
+}
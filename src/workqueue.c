@@ -0,0 +1,269 @@
+/*******************************************************************************************
+* FILE: workqueue.c
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Queues of the connections accepted by the acceptor thread, one per worker
+* 							thread. The acceptor gives each connection to an idle worker, or to the
+* 							next one in turn when every worker is busy, and a worker that runs out of
+* 							connections steals them from the queues of the others, so a worker stuck
+* 							in a slow request (f.e. a long script) does not keep the connections given
+* 							to it waiting while the rest are idle. Each queue has its own lock, taken
+* 							by its worker, the acceptor and the thieves, so they hardly ever meet.
+* 							Connections have nothing in the cache of whoever accepted them, so both the
+* 							owner and the thieves take the oldest one, which has waited the most.
+* 							A queue only receives connections while it is open, from when its worker
+* 							starts till it leaves the pool.
+*******************************************************************************************/
+
+/* All defines, data structure definition and constant definition is stored in utils.h */
+#include "../includes/workqueue.h"
+#include <sys/eventfd.h>
+#include <poll.h>
+
+/* structure that stores the queue of a worker, aligned so that two queues never share a
+cache line */
+typedef struct {
+		pthread_mutex_t lock;
+		/* descriptors of the connections, from head (the oldest) to tail, as positions that
+		only grow */
+		int fds[WORK_QUEUE_SIZE];
+		long head;
+		long tail;
+		/* boolean representing if the worker is running and receives connections */
+		int open;
+		/* boolean representing if the worker is waiting for work */
+		int idle;
+		/* eventfd through where the worker is woken */
+		int wake_fd;
+} __attribute__((aligned(CACHE_LINE_SIZE))) WorkQueue;
+
+/* GLOBAL VARIABLES */
+WorkQueue * work_queues = NULL;
+long nwork_queues = 0;
+/* next worker in turn to receive a connection, only used by the acceptor */
+long work_turn = 0;
+
+
+/*******************************************************************************************
+* FUNCTION: int work_queues_init(long nworkers)
+* DESCRITPTION: Creates the queues of the workers, empty and closed. Must be called before
+* 							the threads are created.
+* ARGS_IN: long nworkers - number of worker threads
+* ARGS_OUT: -1 in case of error, 0 otherwise
+*******************************************************************************************/
+int work_queues_init(long nworkers) {
+		if (posix_memalign((void **) &work_queues, CACHE_LINE_SIZE, nworkers * sizeof(WorkQueue)) != 0) {
+				fprintf(stderr, "ERROR: error when allocating memory for the work queues.\n");
+				return ERROR;
+		}
+		memset(work_queues, 0, nworkers * sizeof(WorkQueue));
+		for (int i = 0; i < nworkers; i++) {
+				pthread_mutex_init(&work_queues[i].lock, NULL);
+				if ((work_queues[i].wake_fd = eventfd(0, EFD_CLOEXEC)) < 0) {
+						perror("eventfd");
+						return ERROR;
+				}
+		}
+		nwork_queues = nworkers;
+		return OK;
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_push(WorkQueue * q, int fd)
+* DESCRITPTION: Appends a connection to a queue.
+* ARGS_IN: WorkQueue * q - queue
+* 				 int fd - socket descriptor of the connection
+* ARGS_OUT: -1 if the queue is full or closed, 0 otherwise
+*******************************************************************************************/
+int work_push(WorkQueue * q, int fd) {
+		int ret = ERROR;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->open && q->tail - q->head < WORK_QUEUE_SIZE) {
+				q->fds[q->tail % WORK_QUEUE_SIZE] = fd;
+				__atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+				ret = OK;
+		}
+		pthread_mutex_unlock(&q->lock);
+		return ret;
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_pop(WorkQueue * q)
+* DESCRITPTION: Takes the oldest connection of a queue. An empty queue is seen without taking
+* 							its lock.
+* ARGS_IN: WorkQueue * q - queue
+* ARGS_OUT: the socket descriptor of the connection, -1 if the queue is empty
+*******************************************************************************************/
+int work_pop(WorkQueue * q) {
+		int fd = -1;
+
+		if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) return -1;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->head != q->tail) {
+				fd = q->fds[q->head % WORK_QUEUE_SIZE];
+				__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&q->lock);
+		return fd;
+}
+
+/*******************************************************************************************
+* FUNCTION: void work_wake(WorkQueue * q)
+* DESCRITPTION: Wakes the worker of a queue.
+* ARGS_IN: WorkQueue * q - queue of the worker
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_wake(WorkQueue * q) {
+		uint64_t one = 1;
+
+		if (write(q->wake_fd, &one, sizeof(one)) < 0) perror("write eventfd");
+}
+
+/*******************************************************************************************
+* FUNCTION: void work_dispatch(int fd)
+* DESCRITPTION: Gives an accepted connection to a worker: to an idle one if there is any, and
+* 							otherwise to the next one in turn, where it waits till that worker or an
+* 							idle one takes it. Waits while every open queue is full. Called by the
+* 							acceptor.
+* ARGS_IN: int fd - socket descriptor of the connection
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_dispatch(int fd) {
+		long worker, i;
+
+		for (;;) {
+				/* the first idle worker after the last one that received a connection, so that they
+				take turns */
+				for (i = 0; i < nwork_queues; i++) {
+						worker = (work_turn + i) % nwork_queues;
+						if (__atomic_load_n(&work_queues[worker].idle, __ATOMIC_SEQ_CST)) break;
+				}
+				if (i == nwork_queues) worker = work_turn % nwork_queues;
+
+				for (i = 0; i < nwork_queues; i++) {
+						if (work_push(&work_queues[(worker + i) % nwork_queues], fd) == OK) break;
+				}
+				if (i < nwork_queues) break;
+				/* every worker is far behind, the new connections wait in the backlog meanwhile */
+				usleep(1000);
+		}
+		worker = (worker + i) % nwork_queues;
+		work_turn = worker + 1;
+
+		/* a worker that marked itself idle after this point sees the connection when it looks at
+		the queues, one that did it before is seen here and woken: its own one, or if it is busy
+		any other, which steals it */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for (i = 0; i < nwork_queues; i++) {
+				WorkQueue * q = &work_queues[(worker + i) % nwork_queues];
+				if (__atomic_load_n(&q->idle, __ATOMIC_SEQ_CST)) {
+						work_wake(q);
+						break;
+				}
+		}
+}
+
+/*******************************************************************************************
+* FUNCTION: void work_open(int worker)
+* DESCRITPTION: Opens the queue of a worker, which receives connections from then on. Called
+* 							before the worker starts.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_open(int worker) {
+		pthread_mutex_lock(&work_queues[worker].lock);
+		work_queues[worker].open = TRUE;
+		pthread_mutex_unlock(&work_queues[worker].lock);
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_close(int worker)
+* DESCRITPTION: Closes the queue of a worker that is leaving, if there is no connection left
+* 							in it.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: -1 if the queue still has connections, which the worker must serve, 0 otherwise
+*******************************************************************************************/
+int work_close(int worker) {
+		WorkQueue * q = &work_queues[worker];
+		int ret = ERROR;
+
+		pthread_mutex_lock(&q->lock);
+		if (q->head == q->tail) {
+				q->open = FALSE;
+				ret = OK;
+		}
+		pthread_mutex_unlock(&q->lock);
+		return ret;
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_take(int worker)
+* DESCRITPTION: Takes the oldest connection of the queue of a worker or, if it is empty, steals
+* 							the oldest one of the queue of another worker. Never waits.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: the socket descriptor of the connection, -1 if every queue is empty
+*******************************************************************************************/
+int work_take(int worker) {
+		int fd;
+
+		for (long i = 0; i < nwork_queues; i++) {
+				if ((fd = work_pop(&work_queues[(worker + i) % nwork_queues])) >= 0) return fd;
+		}
+		return -1;
+}
+
+/*******************************************************************************************
+* FUNCTION: void work_idle(int worker, int idle)
+* DESCRITPTION: Tells if a worker is going to wait for work, so that the acceptor wakes it when
+* 							a connection arrives. A worker that waits in its own way (f.e. epoll_wait
+* 							on the descriptor of work_wake_fd) must mark itself idle and then call
+* 							work_take till it is empty before waiting, so that no connection is missed.
+* ARGS_IN: int worker - number of the worker
+* 				 int idle - TRUE before waiting, FALSE once it has been woken
+* ARGS_OUT: None
+*******************************************************************************************/
+void work_idle(int worker, int idle) {
+		__atomic_store_n(&work_queues[worker].idle, idle, __ATOMIC_SEQ_CST);
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_wake_fd(int worker)
+* DESCRITPTION: Gives the descriptor that becomes readable when a worker is woken, it must be
+* 							read once it is.
+* ARGS_IN: int worker - number of the worker
+* ARGS_OUT: an eventfd descriptor
+*******************************************************************************************/
+int work_wake_fd(int worker) {
+		return work_queues[worker].wake_fd;
+}
+
+/*******************************************************************************************
+* FUNCTION: int work_next(int worker, int timeout)
+* DESCRITPTION: Takes the next connection for a worker that serves one connection at a time,
+* 							sleeping till there is one or the timeout expires.
+* ARGS_IN: int worker - number of the worker
+* 				 int timeout - milliseconds to wait, -1 to wait forever
+* ARGS_OUT: the socket descriptor of the connection, -1 if the timeout expired
+*******************************************************************************************/
+int work_next(int worker, int timeout) {
+		struct pollfd pfd = { .fd = work_queues[worker].wake_fd, .events = POLLIN };
+		uint64_t value;
+		int fd, n;
+
+		for (;;) {
+				if ((fd = work_take(worker)) >= 0) return fd;
+
+				/* looking again once idle, a connection given meanwhile is not missed */
+				work_idle(worker, TRUE);
+				n = 1;
+				if ((fd = work_take(worker)) < 0) {
+						while ((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR);
+						if (n > 0 && read(pfd.fd, &value, sizeof(value)) < 0) perror("read eventfd");
+				}
+				work_idle(worker, FALSE);
+				if (fd >= 0) return fd;
+				/* the connection may have arrived just before the worker stopped being idle */
+				if (n == 0) return work_take(worker);
+		}
+}
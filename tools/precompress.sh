@@ -0,0 +1,36 @@
+#!/bin/sh
+###########################################################################################
+# FILE: precompress.sh
+# AUTHORS: Cesar Ramirez & Pedro Urbina
+# DESCRITPTION: Creates the precompressed versions of the text files served (.html, .htm and
+#               .txt), next to each file: file.br with brotli, file.zst with zstd and file.gz
+#               with gzip, each one only if its program is installed. The server sends them
+#               instead of the file to the clients that accept them (see wiki/technical_design.md),
+#               as long as they are not older than the file, so this must be run again after
+#               changing the files. A version is only kept if it is smaller than the file.
+#               Usage: tools/precompress.sh [directory], htmlfiles by default.
+###########################################################################################
+
+dir=${1:-htmlfiles}
+
+# compress <file> <suffix> <program...> writes the program output for file in file.suffix
+compress() {
+		file=$1
+		suffix=$2
+		shift 2
+		command -v "$1" > /dev/null 2>&1 || return 0
+		# the version is up to date
+		[ -f "$file$suffix" ] && [ ! "$file" -nt "$file$suffix" ] && return 0
+		"$@" < "$file" > "$file$suffix.tmp" || { rm -f "$file$suffix.tmp"; return 1; }
+		if [ "$(wc -c < "$file$suffix.tmp")" -lt "$(wc -c < "$file")" ]; then
+				mv "$file$suffix.tmp" "$file$suffix"
+		else
+				rm -f "$file$suffix.tmp" "$file$suffix"
+		fi
+}
+
+find "$dir" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.txt' \) | while read -r file; do
+		compress "$file" .br brotli -q 11 -c
+		compress "$file" .zst zstd -q -19 -c
+		compress "$file" .gz gzip -9 -n -c
+done
@@ -0,0 +1,207 @@
+<?php
+/*******************************************************************************************
+* FILE: php_worker.php
+* AUTHORS: Cesar Ramirez & Pedro Urbina
+* DESCRITPTION: Persistent php worker started by the server (src/scripts.c). It receives the
+* 							scripts to run through the socket in descriptor 3 and includes them, so
+* 							that the interpreter is only started once. The records are the ones of
+* 							workers/python_worker.py. php://stdin is replaced by the standard input
+* 							sent by the server, and the CGI variables are set in the environment and
+* 							in $_SERVER, with $_GET parsed from QUERY_STRING. The output is sent in STDOUT records each time the
+* 							output buffer fills or the script calls ob_flush. A script that calls
+* 							exit ends the worker, which tells the server in the END record so that
+* 							it starts a new one.
+*******************************************************************************************/
+
+const RECORD_VERSION = 1;
+const RECORD_BEGIN = 1;
+const RECORD_ARG = 2;
+const RECORD_STDIN = 3;
+const RECORD_STDOUT = 4;
+const RECORD_END = 5;
+const RECORD_PARAM = 6;
+const OUTPUT_BUFFER_SIZE = 8192;
+
+$channel = fopen('php://fd/3', 'r+b');
+ini_set('display_errors', 'stderr');
+
+/* stream wrapper that answers php://stdin and php://input with the standard input of the
+current script, read from the STDIN records as the server sends them, so both share the
+position. The rest of php:// streams are opened with the original wrapper */
+class ScriptInput {
+		public static $id = null;
+		public static $data = '';
+		public static $pos = 0;
+		public static $done = true;
+		public $context;
+		private $real = null;
+
+		/* starts the input of a script with the content of its first STDIN record */
+		static function start($id, $content) {
+				self::$id = $id;
+				self::$data = $content;
+				self::$pos = 0;
+				self::$done = $content === '';
+		}
+
+		/* reads the next STDIN record, false if the server closed the channel */
+		static function next() {
+				$header = read_exact(8);
+				if ($header === null) return false;
+				$record = unpack('Cversion/Ctype/nid/Nlength', $header);
+				$content = $record['length'] ? read_exact($record['length']) : '';
+				if ($content === null || $record['type'] != RECORD_STDIN || $record['id'] != self::$id) return false;
+				self::$data = $content;
+				self::$pos = 0;
+				self::$done = $content === '';
+				return true;
+		}
+
+		/* skips the input the script did not read, till the empty STDIN record */
+		static function drain() {
+				while (!self::$done) {
+						if (!self::next()) exit(1);
+				}
+		}
+
+		function stream_open($path, $mode, $options, &$opened_path) {
+				$name = strtolower($path);
+				if ($name === 'php://stdin' || $name === 'php://input') {
+						return true;
+				}
+				stream_wrapper_restore('php');
+				$this->real = fopen($path, $mode);
+				stream_wrapper_unregister('php');
+				stream_wrapper_register('php', 'ScriptInput');
+				return $this->real !== false;
+		}
+
+		function stream_read($count) {
+				if ($this->real) return fread($this->real, $count);
+				while (self::$pos == strlen(self::$data) && !self::$done) {
+						if (!self::next()) exit(1);
+				}
+				$data = (string) substr(self::$data, self::$pos, $count);
+				self::$pos += strlen($data);
+				return $data;
+		}
+
+		function stream_write($data) {
+				return $this->real ? fwrite($this->real, $data) : 0;
+		}
+
+		function stream_eof() {
+				return $this->real ? feof($this->real) : self::$done && self::$pos >= strlen(self::$data);
+		}
+
+		function stream_close() {
+				if ($this->real) fclose($this->real);
+		}
+
+		function stream_set_option($option, $arg1, $arg2) {
+				return true;
+		}
+
+		function stream_stat() {
+				return array();
+		}
+}
+
+function read_exact($n) {
+		global $channel;
+		$data = '';
+		while (strlen($data) < $n) {
+				$chunk = fread($channel, $n - strlen($data));
+				if ($chunk === false || $chunk === '') return null;
+				$data .= $chunk;
+		}
+		return $data;
+}
+
+/* records held to be sent together, null to send them as they are written */
+$held = null;
+
+function send_record($type, $id, $content = '') {
+		global $channel, $held;
+		$record = pack('CCnN', RECORD_VERSION, $type, $id, strlen($content)) . $content;
+		if ($held !== null) {
+				$held .= $record;
+				return;
+		}
+		fwrite($channel, $record);
+		fflush($channel);
+}
+
+/* output buffer handler, sends the output of the script being run */
+function send_output($buffer) {
+		global $running_id;
+		if ($buffer !== '' && $running_id !== null) send_record(RECORD_STDOUT, $running_id, $buffer);
+		return '';
+}
+
+/* sends the rest of the output and the end of the script being run in a single write, called
+at the end of each script and also when a script calls exit, in which case the worker does
+not keep running */
+function finish_script($status, $keep) {
+		global $channel, $running_id, $held;
+		if ($running_id === null) return;
+		$held = '';
+		while (ob_get_level() > 0) ob_end_flush();
+		send_record(RECORD_END, $running_id, pack('NN', $status, $keep));
+		fwrite($channel, $held);
+		fflush($channel);
+		$held = null;
+		$running_id = null;
+}
+
+register_shutdown_function(function() { finish_script(0, 0); });
+stream_wrapper_unregister('php');
+stream_wrapper_register('php', 'ScriptInput');
+
+$running_id = null;
+$script_path = null;
+$script_args = array();
+$script_params = array();
+$server_base = $_SERVER;
+
+/* the scripts are included here, in the global scope, as they expect $argv to be a global */
+while (($header = read_exact(8)) !== null) {
+		$record = unpack('Cversion/Ctype/nid/Nlength', $header);
+		$content = $record['length'] ? read_exact($record['length']) : '';
+		if ($content === null) break;
+
+		if ($record['type'] == RECORD_BEGIN) {
+				$script_path = $content;
+				$script_args = array();
+				$script_params = array();
+		} else if ($record['type'] == RECORD_ARG) {
+				$script_args[] = $content;
+		} else if ($record['type'] == RECORD_PARAM) {
+				list($name, $value) = array_pad(explode('=', $content, 2), 2, '');
+				$script_params[$name] = $value;
+		} else if ($record['type'] == RECORD_STDIN) {
+				/* the script starts with the first STDIN record and reads the rest as they arrive */
+				$argv = array_merge(array($script_path), $script_args);
+				$argc = count($argv);
+				$_SERVER = array_merge($server_base, $script_params);
+				$_SERVER['argv'] = $argv;
+				$_SERVER['argc'] = $argc;
+				$_GET = array();
+				parse_str(isset($script_params['QUERY_STRING']) ? $script_params['QUERY_STRING'] : '', $_GET);
+				foreach ($script_params as $name => $value) putenv("$name=$value");
+				ScriptInput::start($record['id'], $content);
+				$running_id = $record['id'];
+				$script_status = 0;
+				ob_start('send_output', OUTPUT_BUFFER_SIZE);
+				try {
+						include $script_path;
+				} catch (Throwable $e) {
+						fwrite(STDERR, $e . "\n");
+						$script_status = 255;
+				}
+				finish_script($script_status, 1);
+				foreach ($script_params as $name => $value) putenv($name);
+				ScriptInput::drain();
+		}
+}
+?>
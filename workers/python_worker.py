@@ -0,0 +1,192 @@
+#!/usr/bin/env python
+###########################################################################################
+# FILE: python_worker.py
+# AUTHORS: Cesar Ramirez & Pedro Urbina
+# DESCRITPTION: Persistent python worker started by the server (src/scripts.c). It receives
+#               the scripts to run through the socket in descriptor 3 and runs them inside
+#               this interpreter, so that the interpreter is only started once. Every message
+#               is a record with a header of 8 bytes (version, type, request id and length of
+#               the content, in network order) followed by the content:
+#                 BEGIN  server -> worker  path of the script
+#                 ARG    server -> worker  one argument of the script
+#                 PARAM  server -> worker  one CGI variable of the request, as NAME=value
+#                 STDIN  server -> worker  standard input of the script, an empty one ends it.
+#                                          The script starts with the first one and reads the
+#                                          rest as they arrive
+#                 STDOUT worker -> server  output of the script, sent as it is flushed
+#                 END    worker -> server  exit status of the script and whether the worker
+#                                          keeps running (two 4 byte integers)
+###########################################################################################
+
+import io
+import os
+import signal
+import socket
+import struct
+import sys
+import traceback
+
+VERSION = 1
+BEGIN, ARG, STDIN, STDOUT, END, PARAM = 1, 2, 3, 4, 5, 6
+HEADER = struct.Struct("!BBHI")
+STATUS = struct.Struct("!ii")
+# output of the scripts kept before sending it, as python does when stdout is a pipe
+OUTPUT_BUFFER_SIZE = 8192
+
+channel = socket.socket(fileno=3)
+# compiled scripts, recompiled when the file changes
+compiled = {}
+
+
+def read_record():
+    """Reads a record from the server, None if it closed the channel."""
+    header = read_exact(HEADER.size)
+    if header is None:
+        return None
+    version, rtype, rid, length = HEADER.unpack(header)
+    content = read_exact(length) if length else b""
+    if content is None:
+        return None
+    return rtype, rid, content
+
+
+def read_exact(n):
+    """Reads n bytes from the server, None if it closed the channel."""
+    data = bytearray()
+    while len(data) < n:
+        chunk = channel.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return bytes(data)
+
+
+def record(rtype, rid, content=b""):
+    return HEADER.pack(VERSION, rtype, rid, len(content)) + content
+
+
+class RecordReader(io.RawIOBase):
+    """Standard input of the script, read from the STDIN records as the server sends them."""
+
+    def __init__(self, rid, content):
+        self.rid = rid
+        self.data = content
+        self.pos = 0
+        self.done = not content
+
+    def readable(self):
+        return True
+
+    def readinto(self, b):
+        while self.pos == len(self.data) and not self.done:
+            self.next()
+        n = min(len(b), len(self.data) - self.pos)
+        b[:n] = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return n
+
+    def next(self):
+        rec = read_record()
+        if rec is None:
+            raise SystemExit("server closed the channel")
+        rtype, rid, content = rec
+        if rtype != STDIN or rid != self.rid:
+            raise IOError("unexpected record while reading the standard input")
+        self.data, self.pos, self.done = content, 0, not content
+
+    def drain(self):
+        """Skips the input the script did not read, till the empty STDIN record."""
+        while not self.done:
+            self.next()
+
+
+class RecordWriter(io.RawIOBase):
+    """Sends to the server in STDOUT records what the script writes. Once the script ends the
+    records are held, so that the last output goes together with the END record."""
+
+    def __init__(self, rid):
+        self.rid = rid
+        self.held = None
+
+    def writable(self):
+        return True
+
+    def write(self, b):
+        if self.held is None:
+            channel.sendall(record(STDOUT, self.rid, bytes(b)))
+        else:
+            self.held.append(record(STDOUT, self.rid, bytes(b)))
+        return len(b)
+
+
+def load(path):
+    """Returns the code of the script, compiling it only if it changed since the last time."""
+    st = os.stat(path)
+    key = (st.st_mtime_ns, st.st_size, st.st_ino)
+    cached = compiled.get(path)
+    if cached is None or cached[0] != key:
+        with open(path, "rb") as f:
+            cached = (key, compile(f.read(), path, "exec"))
+        compiled[path] = cached
+    return cached[1]
+
+
+def run(rid, path, args, params, content):
+    """Runs a script as if it was executed with "python path args", with the CGI variables in
+    params added to os.environ and the STDIN records, starting with content, as stdin. The
+    output reaches the server each time the buffer fills or the script flushes it."""
+    status = 0
+    saved = sys.argv, sys.stdin, sys.stdout
+    saved_environ = {name: os.environ.get(name) for name in params}
+    os.environ.update(params)
+    sys.argv = [path] + args
+    reader = RecordReader(rid, content)
+    sys.stdin = io.TextIOWrapper(io.BufferedReader(reader), encoding="utf-8", errors="replace")
+    raw = RecordWriter(rid)
+    output = io.BufferedWriter(raw, OUTPUT_BUFFER_SIZE)
+    sys.stdout = writer = io.TextIOWrapper(output, encoding="utf-8")
+    try:
+        exec(load(path), {"__name__": "__main__", "__file__": path, "__builtins__": __builtins__})
+    except SystemExit as e:
+        status = e.code if isinstance(e.code, int) else (0 if e.code is None else 1)
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    finally:
+        # the scripts may leave an alarm programmed, it must not fire in the next one
+        signal.alarm(0)
+        signal.signal(signal.SIGALRM, signal.SIG_DFL)
+        sys.argv, sys.stdin, sys.stdout = saved
+        for name, value in saved_environ.items():
+            if value is None:
+                os.environ.pop(name, None)
+            else:
+                os.environ[name] = value
+        raw.held = []
+        writer.flush()
+
+    raw.held.append(record(END, rid, STATUS.pack(status, 1)))
+    channel.sendall(b"".join(raw.held))
+    reader.drain()
+
+
+def main():
+    path, args, params = None, [], {}
+    while True:
+        rec = read_record()
+        if rec is None:
+            return
+        rtype, rid, content = rec
+        if rtype == BEGIN:
+            path, args, params = content.decode(), [], {}
+        elif rtype == ARG:
+            args.append(content.decode("utf-8", "surrogateescape"))
+        elif rtype == PARAM:
+            name, _, value = content.decode("utf-8", "surrogateescape").partition("=")
+            params[name] = value
+        elif rtype == STDIN:
+            run(rid, path, args, params, content)
+
+
+if __name__ == "__main__":
+    main()